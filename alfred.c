@@ -18,13 +18,22 @@
  */
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <libxml/parser.h>
-#include <libxml/tree.h>
-#include <libxml/xmlschemas.h>
+#include <libxml/xmlreader.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#ifdef HAVE_LUAJIT
+#include <luajit.h>
+#endif
 #include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <glib.h>
 #include <glib-unix.h>
@@ -37,22 +46,526 @@
 #define APTERYX_CONFIG_DIR "/etc/apteryx/schema/"
 #define SECONDS_TO_MILLI 1000
 
+/* Lua version differences */
+#if LUA_VERSION_NUM < 503
+#define alfred_dump(L,w,d) lua_dump (L, w, d)
+#else
+#define alfred_dump(L,w,d) lua_dump (L, w, d, 0)
+#endif
+#if LUA_VERSION_NUM < 502
+/* Lua 5.1 and LuaJIT */
+#define lua_rawlen(L,i) lua_objlen (L, i)
+#define lua_pushglobaltable(L) lua_pushvalue (L, LUA_GLOBALSINDEX)
+#define LUA_OPEQ 0
+#define lua_compare(L,a,b,op) lua_equal (L, a, b)
+#endif
+#ifdef LUAJIT_VERSION_NUM
+#define ALFRED_LUA_ABI LUAJIT_VERSION_NUM
+#else
+#define ALFRED_LUA_ABI LUA_VERSION_NUM
+#endif
+
+/* Length of the bytecode header that must match this build */
+#if defined (LUAJIT_VERSION_NUM)
+#define ALFRED_BYTECODE_HEADER 4
+#elif LUA_VERSION_NUM >= 504
+#define ALFRED_BYTECODE_HEADER 31
+#elif LUA_VERSION_NUM == 503
+#define ALFRED_BYTECODE_HEADER 33
+#elif LUA_VERSION_NUM == 502
+#define ALFRED_BYTECODE_HEADER 18
+#else
+#define ALFRED_BYTECODE_HEADER 12
+#endif
+
 /* Debug */
 bool apteryx_debug = false;
 
+/* Use the pooled allocator for the Lua state */
+static bool alfred_lua_pool = false;
+
+/* Cache of the parsed schema files (if enabled) */
+static const char *alfred_cache_file = NULL;
+
+/* Run the Lua garbage collector from the idle loop */
+static bool alfred_idle_gc = false;
+static int alfred_gc_pause = 200;
+static int alfred_gc_stepmul = 200;
+static int alfred_gc_step_kb = 16;
+
+/* Defer running a module's scripts until one of its callbacks is used */
+static bool alfred_lazy = false;
+
+/* Reload schema files when they change */
+static bool alfred_reload = false;
+
+/* Cache apteryx.get/search results for the length of a callback */
+static bool alfred_memo = false;
+
+/* Validate sets against the pattern and VALUE list of each leaf */
+static bool alfred_native_validate = false;
+
+/* Event trace capture (if enabled) */
+static FILE *alfred_trace_fp = NULL;
+
+/* Replaying a trace, so leave Apteryx and the system alone */
+static bool alfred_offline = false;
+
+/* Queues for work that nobody is waiting on. Gets run straight from the
+ * Apteryx socket, watches and delayed work wait in these lanes and share
+ * what is left of the main loop by weight (if enabled).
+ */
+typedef enum
+{
+    ALFRED_LANE_WATCH,
+    ALFRED_LANE_DELAYED,
+    ALFRED_LANES,
+} alfred_lane_type;
+static bool alfred_lanes = false;
+static int alfred_lane_weight[ALFRED_LANES] = { 4, 1 };
+static const char *alfred_lane_names[ALFRED_LANES] = { "watch", "delayed" };
+
+/* Supervisor mode: number of worker shards, 0 for one per schema file */
+static int alfred_shards = -1;
+
+/* Worker mode: the schema files this process runs, "<index>/<count>"
+ * for a share by file name hash, otherwise a single file name.
+ */
+static const char *alfred_shard = NULL;
+#define ALFRED_RELOAD_DELAY_MS  250
+
+/* How long prefetched provide values are used for, unless set in the schema */
+#define ALFRED_PREFETCH_TTL_MS  1000
+
+/* Most Apteryx callbacks to run per main loop wakeup */
+#define ALFRED_PROCESS_BATCH    64
+
+/* Size-class pool for the many small, short lived Lua objects.
+ * Blocks up to POOL_MAX_BLOCK bytes are carved out of slabs aligned to
+ * POOL_SLAB_SIZE so the owning slab can be found from the block address.
+ * Anything larger is handed to realloc.
+ */
+#define POOL_QUANTUM        16
+#define POOL_MAX_BLOCK      512
+#define POOL_CLASSES        (POOL_MAX_BLOCK / POOL_QUANTUM)
+#define POOL_SLAB_SIZE      (16 * 1024)
+#define POOL_SLAB_HEADER    64
+#define POOL_CLASS(size)    (((size) - 1) / POOL_QUANTUM)
+#define POOL_BLOCK(class)   (((class) + 1) * POOL_QUANTUM)
+#define POOL_STRANDED       16
+
+typedef struct pool_slab_t
+{
+    /* List of slabs with free blocks */
+    struct pool_slab_t *next;
+    struct pool_slab_t *prev;
+    bool listed;
+    /* Size class of every block in this slab */
+    int class;
+    /* Number of blocks handed out */
+    uint32_t used;
+    /* Blocks that have been returned */
+    void *free;
+    /* Space that has never been handed out */
+    char *unused;
+} pool_slab_t;
+
+typedef struct lua_pool_t
+{
+    /* Free lists, only ever touched by the thread running the Lua state */
+    pool_slab_t *slabs[POOL_CLASSES];
+    /* Stats */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t large_allocs;
+    uint64_t large_frees;
+    size_t large_bytes;
+    uint32_t num_slabs;
+    uint32_t peak_slabs;
+    /* Large blocks kept after a failed shrink into the pool */
+    void *stranded[POOL_STRANDED];
+    int num_stranded;
+} lua_pool_t;
+
+static void
+pool_slab_link (lua_pool_t *pool, pool_slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = pool->slabs[slab->class];
+    if (slab->next)
+        slab->next->prev = slab;
+    pool->slabs[slab->class] = slab;
+    slab->listed = true;
+}
+
+static void
+pool_slab_unlink (lua_pool_t *pool, pool_slab_t *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        pool->slabs[slab->class] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+    slab->listed = false;
+}
+
+static void *
+pool_block_alloc (lua_pool_t *pool, int class)
+{
+    pool_slab_t *slab = pool->slabs[class];
+    size_t size = POOL_BLOCK (class);
+    void *block;
+
+    if (!slab)
+    {
+        if (posix_memalign ((void **) &slab, POOL_SLAB_SIZE, POOL_SLAB_SIZE) != 0)
+            return NULL;
+        memset (slab, 0, sizeof (pool_slab_t));
+        slab->class = class;
+        slab->unused = (char *) slab + POOL_SLAB_HEADER;
+        pool_slab_link (pool, slab);
+        pool->num_slabs++;
+        if (pool->num_slabs > pool->peak_slabs)
+            pool->peak_slabs = pool->num_slabs;
+    }
+
+    if (slab->free)
+    {
+        block = slab->free;
+        slab->free = *(void **) block;
+    }
+    else
+    {
+        block = slab->unused;
+        slab->unused += size;
+    }
+    slab->used++;
+
+    /* Full slabs drop off the list until a block is returned */
+    if (!slab->free && slab->unused + size > (char *) slab + POOL_SLAB_SIZE)
+        pool_slab_unlink (pool, slab);
+
+    pool->allocs++;
+    return block;
+}
+
+static void
+pool_block_free (lua_pool_t *pool, void *block)
+{
+    pool_slab_t *slab = (pool_slab_t *) ((uintptr_t) block & ~((uintptr_t) POOL_SLAB_SIZE - 1));
+
+    *(void **) block = slab->free;
+    slab->free = block;
+    slab->used--;
+    if (!slab->listed)
+        pool_slab_link (pool, slab);
+
+    /* Hand empty slabs back, but keep one per class to avoid thrashing */
+    if (slab->used == 0 && (slab->prev || slab->next))
+    {
+        pool_slab_unlink (pool, slab);
+        free (slab);
+        pool->num_slabs--;
+    }
+    pool->frees++;
+}
+
+/* Forget a stranded block, returning false if ptr is not one */
+static bool
+pool_stranded_remove (lua_pool_t *pool, void *ptr)
+{
+    for (int i = 0; i < pool->num_stranded; i++)
+    {
+        if (pool->stranded[i] == ptr)
+        {
+            pool->stranded[i] = pool->stranded[--pool->num_stranded];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *
+lua_pool_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    lua_pool_t *pool = (lua_pool_t *) ud;
+    void *block;
+
+    /* When ptr is NULL osize is the object type, not a size */
+    if (!ptr)
+        osize = 0;
+
+    if (nsize == 0)
+    {
+        if (osize > POOL_MAX_BLOCK ||
+            (ptr && pool->num_stranded && pool_stranded_remove (pool, ptr)))
+        {
+            pool->large_frees++;
+            pool->large_bytes -= osize;
+            free (ptr);
+        }
+        else if (ptr)
+        {
+            pool_block_free (pool, ptr);
+        }
+        return NULL;
+    }
+
+    /* Large to large is a plain realloc */
+    if (osize > POOL_MAX_BLOCK && nsize > POOL_MAX_BLOCK)
+    {
+        block = realloc (ptr, nsize);
+        /* Lua expects shrinking to succeed, so keep the old block */
+        if (!block && nsize <= osize)
+            block = ptr;
+        if (block)
+            pool->large_bytes += nsize - osize;
+        return block;
+    }
+
+    /* Already the right size class */
+    if (ptr && osize <= POOL_MAX_BLOCK && nsize <= POOL_MAX_BLOCK &&
+        POOL_CLASS (osize) == POOL_CLASS (nsize))
+    {
+        return ptr;
+    }
+
+    if (nsize > POOL_MAX_BLOCK)
+    {
+        block = malloc (nsize);
+        if (block)
+        {
+            pool->large_allocs++;
+            pool->large_bytes += nsize;
+        }
+    }
+    else
+    {
+        block = pool_block_alloc (pool, POOL_CLASS (nsize));
+    }
+    if (block && ptr)
+    {
+        memcpy (block, ptr, osize < nsize ? osize : nsize);
+        lua_pool_alloc (ud, ptr, osize, 0);
+    }
+    else if (!block && ptr && nsize <= osize)
+    {
+        /* Lua expects shrinking to succeed, so keep the old block. A large
+         * block is from now on freed with a pooled size, so remember it.
+         */
+        if (osize > POOL_MAX_BLOCK)
+        {
+            if (pool->num_stranded == POOL_STRANDED)
+                return NULL;
+            pool->stranded[pool->num_stranded++] = ptr;
+            pool->large_bytes += nsize - osize;
+        }
+        block = ptr;
+    }
+    return block;
+}
+
+static void
+lua_pool_destroy (lua_pool_t *pool)
+{
+    DEBUG ("LUA: Pool allocs:%"PRIu64" frees:%"PRIu64" large:%"PRIu64"/%"PRIu64
+           " slabs:%u peak:%u\n", pool->allocs, pool->frees, pool->large_allocs,
+           pool->large_frees, pool->num_slabs, pool->peak_slabs);
+    for (int i = 0; i < POOL_CLASSES; i++)
+    {
+        while (pool->slabs[i])
+        {
+            pool_slab_t *slab = pool->slabs[i];
+            pool_slab_unlink (pool, slab);
+            free (slab);
+        }
+    }
+    g_free (pool);
+}
+
+static int
+alfred_panic (lua_State *ls)
+{
+    CRITICAL ("LUA: Unprotected error: %s\n", lua_tostring (ls, -1));
+    return 0;
+}
+
+/* Something to do, found while loading a schema file */
+typedef enum
+{
+    ALFRED_SCRIPT,
+    ALFRED_WATCH,
+    ALFRED_REFRESH,
+    ALFRED_PROVIDE,
+    ALFRED_INDEX,
+    ALFRED_VALIDATE,
+} alfred_action_type;
+
+struct alfred_module_t;
+
+typedef struct alfred_action_t
+{
+    alfred_action_type type;
+    /* Module the action was loaded from */
+    struct alfred_module_t *module;
+    /* Path the callback is registered on (NULL for scripts) */
+    char *path;
+    /* Lua source */
+    char *script;
+    /* Precompiled Lua chunk (scripts only) */
+    char *code;
+    size_t code_len;
+    /* Attributes of the action element */
+    GHashTable *attrs;
+    /* Paths that invalidate the cached results of an INDEX */
+    char **depends;
+    GHashTable *index_cache;
+    /* Only run a WATCH for the last value set within this window */
+    guint coalesce_ms;
+    GHashTable *coalesce_pending;
+    /* Deliver each changed subtree to the WATCH as one _tree table */
+    bool watch_tree;
+    /* Bounds of an adaptive REFRESH timeout, and how often each path is read */
+    bool refresh_adaptive;
+    uint64_t refresh_min_us;
+    uint64_t refresh_max_us;
+    GHashTable *refresh_reads;
+    /* Lua function that provides all the sibling values at once, and
+     * the values it returned until they expire
+     */
+    const char *prefetch;
+    guint prefetch_ttl_ms;
+    GHashTable *prefetch_values;
+    uint64_t prefetch_expiry;
+    /* Native checks of a VALIDATE, from the NODE pattern and VALUE list,
+     * and whether there is a script to run once they pass
+     */
+    GRegex *pattern;
+    char **values;
+    bool validate_script;
+} alfred_action_t;
+
+/* A schema file or Lua library from the config directory */
+typedef struct alfred_module_t
+{
+    char *filename;
+    bool library;
+    /* Source of a bytecode library, used if the bytecode does not suit */
+    char *source;
+    /* Identity of the file, for the schema cache */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    /* Actions in the order they appear in the file */
+    GList *actions;
+    /* The module's scripts have been run */
+    bool loaded;
+    /* Globals defined by the scripts of a deferred module (lazy mode) */
+    GHashTable *defines;
+} alfred_module_t;
+
+/* A queued watch event or timed out delayed work */
+typedef struct alfred_lane_work_t
+{
+    alfred_lane_type lane;
+    uint64_t queued;
+    char *path;
+    char *value;
+    char *script;
+    int call;
+} alfred_lane_work_t;
+
+/* A lane and the time its work spent waiting */
+typedef struct alfred_lane_t
+{
+    GQueue queue;
+    guint peak;
+    uint64_t runs;
+    uint64_t wait_us;
+    uint64_t max_wait_us;
+} alfred_lane_t;
+
 /* An Alfred instance. */
 struct alfred_instance_t
 {
     /* Lua state */
     lua_State *ls;
+    /* Pooled allocator for the Lua state (if enabled) */
+    lua_pool_t *pool;
     /* List of watches based on path */
     GList *watches;
+    /* List of tree watches based on path */
+    GList *tree_watches;
+    /* Leaf changes waiting to be delivered to tree watches */
+    GNode *tree_pending;
+    guint tree_idle;
     /* List of refreshers based on path */
     GList *refreshers;
     /* List of provides based on path */
     GList *provides;
     /* List of indexes based on path */
     GList *indexes;
+    /* List of validates based on path */
+    GList *validates;
+    /* Compiled VALIDATE patterns, shared by every NODE with the same pattern */
+    GHashTable *regexes;
+    /* Watches on the dependencies of cached indexes */
+    GList *index_deps;
+    /* Callbacks have been registered with Apteryx */
+    bool registered;
+    /* The running callback, for building _keys and _segments when read */
+    alfred_action_t *args_action;
+    const char *args_path;
+    bool args_built;
+    uint64_t args_tables;
+    /* Loaded schema files and libraries */
+    GList *modules;
+    /* Modules were restored from the schema cache */
+    bool cached;
+    /* Scripts run to find what they define for lazy loading */
+    uint32_t surveys;
+    /* Config directory and its inotify watch */
+    char *path;
+    int reload_fd;
+    guint reload_source;
+    guint reload_timer;
+    GHashTable *reload_pending;
+    /* Idle garbage collection */
+    guint gc_idle;
+    int gc_base_kb;
+    bool gc_running;
+    uint64_t gc_steps;
+    uint64_t gc_cycles;
+    uint64_t gc_forced;
+    /* Watch events replaced by a later value before they ran */
+    uint64_t coalesced;
+    /* Apteryx callbacks run, and the main loop wakeups that ran them */
+    uint64_t process_events;
+    uint64_t process_wakeups;
+    /* Provide prefetches, and provides answered from them */
+    uint64_t prefetch_fills;
+    uint64_t prefetch_hits;
+    /* Values validated, rejected, and validated by a script */
+    uint64_t validate_checks;
+    uint64_t validate_rejects;
+    uint64_t validate_scripts;
+    /* The apteryx-xml api module, once something has used it */
+    int api_ref;
+    /* Per callback apteryx.get/search cache */
+    bool memo_active;
+    bool memo_used;
+    int memo_get_ref;
+    int memo_search_ref;
+    uint64_t memo_hits;
+    uint64_t memo_misses;
+    /* Apteryx writes and commands skipped while replaying a trace */
+    uint64_t offline_writes;
+    uint64_t offline_execs;
+    /* Prioritised queues of background work */
+    alfred_lane_t lanes[ALFRED_LANES];
+    guint lane_idle;
 } alfred_instance_t;
 typedef struct alfred_instance_t *alfred_instance;
 
@@ -143,849 +656,6316 @@ alfred_exec (lua_State *ls, const char *script, int nresults)
     return (res == 0);
 }
 
-static bool
-watch_node_changed (const char *path, const char *value)
+static gboolean
+alfred_gc_idle (gpointer data)
 {
-    GList *matches = NULL;
-    GList *node = NULL;
-    GList *script = NULL;
-    GList *scripts = NULL;
-    bool ret = false;
-    cb_info_t *cb = NULL;
-
-    assert (path);
-    assert (alfred_inst);
-
-    matches = cb_match (&alfred_inst->watches, path, CB_MATCH_EXACT |
-                        CB_PATH_MATCH_PART | CB_MATCH_WILD_PATH);
-    if (matches == NULL)
-    {
-        ERROR ("ALFRED: No Alfred watch for %s\n", path);
-        return false;
-    }
+    alfred_instance alfred = (alfred_instance) data;
 
-    for (node = g_list_first (matches); node != NULL; node = g_list_next (node))
+    alfred->gc_steps++;
+    if (lua_gc (alfred->ls, LUA_GCSTEP, alfred_gc_step_kb))
     {
-        cb = node->data;
-        scripts = (GList *) (long) cb->cb;
-        for (script = g_list_first (scripts); script != NULL; script = g_list_next (script))
+        /* Cycle complete, take over from the collector again */
+        if (alfred->gc_running)
         {
-            lua_pushstring (alfred_inst->ls, path);
-            lua_setglobal (alfred_inst->ls, "_path");
-            lua_pushstring (alfred_inst->ls, value);
-            lua_setglobal (alfred_inst->ls, "_value");
-            ret = alfred_exec (alfred_inst->ls, script->data, 0);
+            lua_gc (alfred->ls, LUA_GCSTOP, 0);
+            alfred->gc_running = false;
         }
+        alfred->gc_base_kb = lua_gc (alfred->ls, LUA_GCCOUNT, 0);
+        alfred->gc_cycles++;
+        alfred->gc_idle = 0;
+        return G_SOURCE_REMOVE;
     }
-    g_list_free_full (matches, (GDestroyNotify) cb_release);
-    DEBUG("LUA: Stack:%d Memory:%dkb\n", lua_gettop (alfred_inst->ls),
-            lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0));
-    DEBUG ("ALFRED WATCH: %s = %s\n", path, value);
-    return ret;
+    return G_SOURCE_CONTINUE;
 }
 
-uint64_t
-refresh_node_changed (const char *path)
+/* Called after running Lua in the request path. Garbage is collected
+ * in small steps once there are no Apteryx events pending. If the heap
+ * grows past the point where Lua would normally have started a cycle,
+ * hand control back to the automatic collector until we catch up.
+ */
+static void
+alfred_gc_check (alfred_instance alfred)
 {
-    uint64_t timeout;
-    GList *matches = NULL;
-    char *script = NULL;
-    cb_info_t *cb = NULL;
-    int s_0;
-
-    matches = cb_match (&alfred_inst->refreshers, path, CB_MATCH_EXACT | CB_MATCH_WILD_PATH);
-    if (matches == NULL)
-    {
-        ERROR ("ALFRED: No Alfred refresh for %s\n", path);
-        return 0;
-    }
+    if (!alfred_idle_gc)
+        return;
 
-    cb = g_list_first (matches)->data;
-    script = (char *) (long) cb->cb;
-    lua_pushstring (alfred_inst->ls, path);
-    lua_setglobal (alfred_inst->ls, "_path");
-    s_0 = lua_gettop (alfred_inst->ls);
-    if (!alfred_exec (alfred_inst->ls, script, 1))
+    if (!alfred->gc_running &&
+        lua_gc (alfred->ls, LUA_GCCOUNT, 0) > (int64_t) alfred->gc_base_kb * alfred_gc_pause / 100)
     {
-        ERROR ("Lua: Failed to execute refresh script for path: %s\n", path);
+        DEBUG ("LUA: Idle GC behind, restarting collector\n");
+        lua_gc (alfred->ls, LUA_GCRESTART, 0);
+        alfred->gc_running = true;
+        alfred->gc_forced++;
     }
-    g_list_free_full (matches, (GDestroyNotify) cb_release);
-    /* The return value of luaL_dostring is the top value of the stack */
-    timeout = lua_tonumber (alfred_inst->ls, -1);
-    lua_pop (alfred_inst->ls, 1);
-
-    DEBUG("LUA: Stack:%d Memory:%dkb\n", lua_gettop (alfred_inst->ls),
-            lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0));
-    if (lua_gettop (alfred_inst->ls) != s_0)
+    if (!alfred->gc_idle)
     {
-        ERROR ("Lua: Stack not zero(%d) after provide: %s\n",
-                lua_gettop (alfred_inst->ls), path);
+        alfred->gc_idle = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                                           alfred_gc_idle, alfred, NULL);
     }
-    return timeout;
 }
 
+#ifdef HAVE_LUAJIT
+/* Entry points for the LuaJIT FFI fast path. These are looked up by
+ * name through ffi.C, so alfred is linked with --export-dynamic.
+ */
 char *
-provide_node_changed (const char *path)
+alfred_ffi_get (const char *path)
 {
-    const char *const_value = NULL;
-    char *ret = NULL;
-    GList *matches = NULL;
-    char *script = NULL;
-    cb_info_t *cb = NULL;
-    int s_0;
+    return apteryx_get (path);
+}
 
-    matches = cb_match (&alfred_inst->provides, path, CB_MATCH_EXACT | CB_MATCH_WILD_PATH);
-    if (matches == NULL)
-    {
-        ERROR ("ALFRED: No Alfred provide for %s\n", path);
-        return NULL;
-    }
+bool
+alfred_ffi_set (const char *path, const char *value)
+{
+    return apteryx_set (path, value);
+}
 
-    cb = g_list_first (matches)->data;
-    script = (char *) (long) cb->cb;
-    lua_pushstring (alfred_inst->ls, path);
-    lua_setglobal (alfred_inst->ls, "_path");
-    s_0 = lua_gettop (alfred_inst->ls);
-    if (!alfred_exec (alfred_inst->ls, script, 1))
+void
+alfred_ffi_free (char *value)
+{
+    free (value);
+}
+
+/* Replace apteryx.get(path) and apteryx.set(path, value) with FFI calls
+ * that skip the Lua C API. Any other form of call goes to the binding.
+ */
+static const char *alfred_ffi_script =
+    "local ffi = require('ffi')\n"
+    "ffi.cdef[[\n"
+    "char *alfred_ffi_get (const char *path);\n"
+    "bool alfred_ffi_set (const char *path, const char *value);\n"
+    "void alfred_ffi_free (char *value);\n"
+    "]]\n"
+    "local C = ffi.C\n"
+    "local get, set = apteryx.get, apteryx.set\n"
+    "apteryx.get = function (path, ...)\n"
+    "    if type (path) ~= 'string' or select ('#', ...) > 0 then\n"
+    "        return get (path, ...)\n"
+    "    end\n"
+    "    local value = C.alfred_ffi_get (path)\n"
+    "    if value == nil then\n"
+    "        return nil\n"
+    "    end\n"
+    "    local result = ffi.string (value)\n"
+    "    C.alfred_ffi_free (value)\n"
+    "    return result\n"
+    "end\n"
+    "apteryx.set = function (path, value, ...)\n"
+    "    if type (path) ~= 'string' or (value ~= nil and type (value) ~= 'string')\n"
+    "       or select ('#', ...) > 0 then\n"
+    "        return set (path, value, ...)\n"
+    "    end\n"
+    "    return C.alfred_ffi_set (path, value)\n"
+    "end\n";
+
+static void
+alfred_ffi_init (lua_State *ls)
+{
+    lua_getglobal (ls, "apteryx");
+    if (!lua_istable (ls, -1))
     {
-        ERROR ("Lua: Failed to execute provide script for path: %s\n", path);
+        lua_pop (ls, 1);
+        return;
     }
-    g_list_free_full (matches, (GDestroyNotify) cb_release);
-    /* The return value of luaL_dostring is the top value of the stack */
-    const_value = lua_tostring (alfred_inst->ls, -1);
-    lua_pop (alfred_inst->ls, 1);
-    ret = g_strdup (const_value);
-    DEBUG("LUA: Stack:%d Memory:%dkb\n", lua_gettop (alfred_inst->ls),
-            lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0));
-    if (lua_gettop (alfred_inst->ls) != s_0)
+    lua_pop (ls, 1);
+    if (luaL_dostring (ls, alfred_ffi_script) != 0)
     {
-        ERROR ("Lua: Stack not zero(%d) after provide: %s\n",
-                lua_gettop (alfred_inst->ls), path);
+        ERROR ("LUA: Failed to set up the FFI fast path: %s\n", lua_tostring (ls, -1));
+        lua_pop (ls, 1);
     }
-    return ret;
 }
+#endif
 
-static GList *
-index_node_changed (const char *path)
+/* Stand in for the Apteryx binding calls that change the database or
+ * register callbacks while replaying a trace. The call is counted and
+ * reported as successful.
+ */
+static int
+alfred_offline_write (lua_State *ls)
 {
-    char *script = NULL;
-    const char *tmp_path = NULL;
-    char *tmp_path2 = NULL;
-    GList *ret = NULL;
-    GList *matches = NULL;
-    cb_info_t *cb = NULL;
-    int s_0;
+    alfred_inst->offline_writes++;
+    DEBUG ("ALFRED: Replay skipped write to %s\n",
+           lua_type (ls, 1) == LUA_TSTRING ? lua_tostring (ls, 1) : "tree");
+    lua_pushboolean (ls, true);
+    return 1;
+}
 
-    matches = cb_match (&alfred_inst->indexes, path, CB_MATCH_EXACT | CB_MATCH_WILD_PATH);
-    if (matches == NULL)
-    {
-        ERROR ("ALFRED: No Alfred index for %s\n", path);
-        return NULL;
-    }
-    cb = g_list_first (matches)->data;
-    script = (char *) (long) cb->cb;
-    lua_pushstring (alfred_inst->ls, path);
-    lua_setglobal (alfred_inst->ls, "_path");
-    s_0 = lua_gettop (alfred_inst->ls);
-    if (!alfred_exec (alfred_inst->ls, script, 1))
+/* Exit status of a command that succeeded, as os.execute reports it */
+static int
+alfred_offline_status (lua_State *ls)
+{
+#if LUA_VERSION_NUM < 502
+    lua_pushinteger (ls, 0);
+    return 1;
+#else
+    lua_pushboolean (ls, true);
+    lua_pushstring (ls, "exit");
+    lua_pushinteger (ls, 0);
+    return 3;
+#endif
+}
+
+static int
+alfred_offline_execute (lua_State *ls)
+{
+    alfred_inst->offline_execs++;
+    DEBUG ("ALFRED: Replay skipped os.execute of %s\n", luaL_optstring (ls, 1, ""));
+    if (lua_isnoneornil (ls, 1))
     {
-        ERROR ("Lua: Failed to execute index script for path: %s\n", path);
+        lua_pushboolean (ls, true);
+        return 1;
     }
-    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    return alfred_offline_status (ls);
+}
 
-    if (lua_gettop (alfred_inst->ls))
-    {
-        if (lua_istable(alfred_inst->ls, -1))
-        {
-            lua_pushnil (alfred_inst->ls);
-            while (lua_next(alfred_inst->ls, -2) != 0)
+static int
+alfred_offline_read (lua_State *ls)
+{
+    const char *format = luaL_optstring (ls, 2, "l");
+
+    /* The command printed nothing */
+    if (format[0] == '*')
+        format++;
+    if (format[0] == 'a')
+        lua_pushstring (ls, "");
+    else
+        lua_pushnil (ls);
+    return 1;
+}
+
+static int
+alfred_offline_lines_next (lua_State *ls)
+{
+    return 0;
+}
+
+static int
+alfred_offline_lines (lua_State *ls)
+{
+    lua_pushcfunction (ls, alfred_offline_lines_next);
+    return 1;
+}
+
+static int
+alfred_offline_write_file (lua_State *ls)
+{
+    lua_settop (ls, 1);
+    return 1;
+}
+
+static int
+alfred_offline_close (lua_State *ls)
+{
+#if LUA_VERSION_NUM < 502
+    lua_pushboolean (ls, true);
+    return 1;
+#else
+    return alfred_offline_status (ls);
+#endif
+}
+
+/* io.popen returns a handle that reads nothing and closes cleanly */
+static int
+alfred_offline_popen (lua_State *ls)
+{
+    alfred_inst->offline_execs++;
+    DEBUG ("ALFRED: Replay skipped io.popen of %s\n", luaL_checkstring (ls, 1));
+    lua_newtable (ls);
+    lua_pushcfunction (ls, alfred_offline_read);
+    lua_setfield (ls, -2, "read");
+    lua_pushcfunction (ls, alfred_offline_lines);
+    lua_setfield (ls, -2, "lines");
+    lua_pushcfunction (ls, alfred_offline_write_file);
+    lua_setfield (ls, -2, "write");
+    lua_pushcfunction (ls, alfred_offline_write_file);
+    lua_setfield (ls, -2, "flush");
+    lua_pushcfunction (ls, alfred_offline_close);
+    lua_setfield (ls, -2, "close");
+    return 1;
+}
+
+static void
+alfred_offline_init (lua_State *ls)
+{
+    const char *writes[] = { "set", "set_tree", "prune", "cas", "cas_tree", "watch",
+                             "unwatch", "watch_tree", "unwatch_tree", "provide", "unprovide",
+                             "index", "unindex", "refresh", "unrefresh", "validate",
+                             "unvalidate", "proxy", "unproxy", NULL };
+
+    lua_getglobal (ls, "apteryx");
+    if (lua_istable (ls, -1))
+    {
+        for (int i = 0; writes[i]; i++)
+        {
+            lua_getfield (ls, -1, writes[i]);
+            if (!lua_isnil (ls, -1))
             {
-                tmp_path = lua_tostring (alfred_inst->ls, -1);
-                tmp_path2 = strdup (tmp_path);
-                ret = g_list_append (ret, tmp_path2);
-                /* Removes 'value'; keeps 'key' for next iteration */
-                lua_pop (alfred_inst->ls, 1);
+                lua_pushcfunction (ls, alfred_offline_write);
+                lua_setfield (ls, -3, writes[i]);
             }
-            lua_pop (alfred_inst->ls, 1);
+            lua_pop (ls, 1);
         }
     }
-    DEBUG("LUA: Stack:%d Memory:%dkb\n", lua_gettop(alfred_inst->ls),
-            lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0));
-    if (lua_gettop (alfred_inst->ls) != s_0)
+    lua_pop (ls, 1);
+
+    /* Commands run from the scripts are counted like Alfred.exec */
+    lua_getglobal (ls, "os");
+    if (lua_istable (ls, -1))
     {
-        ERROR ("Lua: Stack not zero(%d) after index: %s\n",
-                lua_gettop (alfred_inst->ls), path);
+        lua_pushcfunction (ls, alfred_offline_execute);
+        lua_setfield (ls, -2, "execute");
     }
-    return ret;
+    lua_pop (ls, 1);
+    lua_getglobal (ls, "io");
+    if (lua_istable (ls, -1))
+    {
+        lua_pushcfunction (ls, alfred_offline_popen);
+        lua_setfield (ls, -2, "popen");
+    }
+    lua_pop (ls, 1);
 }
 
+/* Request scoped read cache. While a callback runs, repeated apteryx.get
+ * and apteryx.search calls for the same path are answered from tables in
+ * the registry instead of going back to apteryxd. Any write made through
+ * the binding empties the cache, as does the end of the callback.
+ */
+static char alfred_memo_nil;
+
 static void
-alfred_register_watches (gpointer value, gpointer user_data)
+alfred_memo_clear (alfred_instance alfred)
 {
-    cb_info_t *cb = (cb_info_t *) value;
-    int install = GPOINTER_TO_INT (user_data);
+    lua_newtable (alfred->ls);
+    lua_rawseti (alfred->ls, LUA_REGISTRYINDEX, alfred->memo_get_ref);
+    lua_newtable (alfred->ls);
+    lua_rawseti (alfred->ls, LUA_REGISTRYINDEX, alfred->memo_search_ref);
+    alfred->memo_used = false;
+}
 
-    if ((install && !apteryx_watch (cb->path, watch_node_changed)) ||
-        (!install && !apteryx_unwatch (cb->path, watch_node_changed)))
-    {
-        ERROR ("Failed to (un)register watch for path %s\n", cb->path);
-    }
+/* Call the original binding (upvalue 1) with the arguments on the stack */
+static int
+alfred_memo_passthrough (lua_State *ls)
+{
+    lua_pushvalue (ls, lua_upvalueindex (1));
+    lua_insert (ls, 1);
+    lua_call (ls, lua_gettop (ls) - 1, LUA_MULTRET);
+    return lua_gettop (ls);
 }
 
-static void
-alfred_register_refresh (gpointer value, gpointer user_data)
+static int
+alfred_memo_lookup (lua_State *ls, int ref, bool copy)
 {
-    cb_info_t *cb = (cb_info_t *) value;
-    int install = GPOINTER_TO_INT (user_data);
+    alfred_instance alfred = alfred_inst;
 
-    if ((install && !apteryx_refresh (cb->path, refresh_node_changed)) ||
-        (!install && !apteryx_unrefresh (cb->path, refresh_node_changed)))
+    if (!alfred->memo_active || lua_gettop (ls) != 1 || lua_type (ls, 1) != LUA_TSTRING)
+        return alfred_memo_passthrough (ls);
+
+    lua_rawgeti (ls, LUA_REGISTRYINDEX, ref);
+    lua_pushvalue (ls, 1);
+    lua_rawget (ls, 2);
+    if (!lua_isnil (ls, 3))
     {
-        ERROR ("Failed to (un)register refresh for path %s\n", cb->path);
+        alfred->memo_hits++;
+        if (lua_touserdata (ls, 3) == &alfred_memo_nil)
+        {
+            lua_pushnil (ls);
+            return 1;
+        }
+    }
+    else
+    {
+        alfred->memo_misses++;
+        lua_pop (ls, 1);
+        lua_pushvalue (ls, lua_upvalueindex (1));
+        lua_pushvalue (ls, 1);
+        lua_call (ls, 1, 1);
+        lua_pushvalue (ls, 1);
+        if (lua_isnil (ls, 3))
+            lua_pushlightuserdata (ls, &alfred_memo_nil);
+        else
+            lua_pushvalue (ls, 3);
+        lua_rawset (ls, 2);
+        alfred->memo_used = true;
+    }
+
+    /* Hand out a copy so the script can't change what is cached */
+    if (copy && lua_istable (ls, 3))
+    {
+        lua_newtable (ls);
+        lua_pushnil (ls);
+        while (lua_next (ls, 3) != 0)
+        {
+            lua_pushvalue (ls, -2);
+            lua_insert (ls, -2);
+            lua_rawset (ls, 4);
+        }
     }
+    return 1;
 }
 
-static void
-alfred_register_provide (gpointer value, gpointer user_data)
+static int
+alfred_memo_get (lua_State *ls)
 {
-    cb_info_t *cb = (cb_info_t *) value;
-    int install = GPOINTER_TO_INT (user_data);
+    return alfred_memo_lookup (ls, alfred_inst->memo_get_ref, false);
+}
 
-    if ((install && !apteryx_provide (cb->path, provide_node_changed)) ||
-        (!install && !apteryx_unprovide (cb->path, provide_node_changed)))
+static int
+alfred_memo_search (lua_State *ls)
+{
+    return alfred_memo_lookup (ls, alfred_inst->memo_search_ref, true);
+}
+
+static int
+alfred_memo_write (lua_State *ls)
+{
+    if (alfred_inst->memo_used)
+        alfred_memo_clear (alfred_inst);
+    return alfred_memo_passthrough (ls);
+}
+
+static void
+alfred_memo_wrap (lua_State *ls, const char *name, lua_CFunction fn)
+{
+    lua_getfield (ls, -1, name);
+    if (lua_isfunction (ls, -1))
     {
-        ERROR ("Failed to (un)register provide for path %s\n", cb->path);
+        lua_pushcclosure (ls, fn, 1);
+        lua_setfield (ls, -2, name);
+    }
+    else
+    {
+        lua_pop (ls, 1);
     }
 }
 
+/* Wrap the Lua apteryx binding with the read cache */
 static void
-alfred_register_index (gpointer value, gpointer user_data)
+alfred_memo_init (alfred_instance alfred)
 {
-    cb_info_t *cb = (cb_info_t *) value;
-    int install = GPOINTER_TO_INT (user_data);
+    const char *writes[] = { "set", "set_tree", "prune", "cas", "cas_tree", NULL };
+    lua_State *ls = alfred->ls;
 
-    if ((install && !apteryx_index (cb->path, index_node_changed)) ||
-        (!install && !apteryx_unindex (cb->path, index_node_changed)))
+    lua_newtable (ls);
+    alfred->memo_get_ref = luaL_ref (ls, LUA_REGISTRYINDEX);
+    lua_newtable (ls);
+    alfred->memo_search_ref = luaL_ref (ls, LUA_REGISTRYINDEX);
+
+    lua_getglobal (ls, "apteryx");
+    if (lua_istable (ls, -1))
     {
-        ERROR ("Failed to (un)register provide for path %s\n", cb->path);
+        alfred_memo_wrap (ls, "get", alfred_memo_get);
+        alfred_memo_wrap (ls, "search", alfred_memo_search);
+        for (int i = 0; writes[i]; i++)
+            alfred_memo_wrap (ls, writes[i], alfred_memo_write);
     }
+    lua_pop (ls, 1);
 }
 
-static bool
-destroy_watches (gpointer value, gpointer rpc)
+static inline void
+alfred_memo_begin (alfred_instance alfred)
 {
-    cb_info_t *cb = (cb_info_t *) value;
-    GList *scripts = (GList *) (long) cb->cb;
-    DEBUG ("XML: Destroy watches for path %s\n", cb->path);
-
-    g_list_free_full (scripts, g_free);
-    cb_destroy (cb);
-    cb_release (cb);
-    return true;
+    alfred->memo_active = alfred_memo;
 }
 
-static bool
-destroy_refresher (gpointer value, gpointer rpc)
+static inline void
+alfred_memo_end (alfred_instance alfred)
 {
-    cb_info_t *cb = (cb_info_t *) value;
-    char *script = (char *) (long) cb->cb;
-    DEBUG ("XML: Destroy refresher for path %s\n", cb->path);
-
-    g_free (script);
-    cb_destroy (cb);
-    cb_release (cb);
-    return true;
+    if (alfred->memo_used)
+        alfred_memo_clear (alfred);
+    alfred->memo_active = false;
 }
 
-static bool
-destroy_provides (gpointer value, gpointer rpc)
-{
-    cb_info_t *cb = (cb_info_t *) value;
-    char *script = (char *) (long) cb->cb;
-    DEBUG ("XML: Destroy provides for path %s\n", cb->path);
+static void alfred_module_load (alfred_instance alfred, alfred_module_t *module);
+static void alfred_trace (alfred_action_type type, const char *path, const char *value);
+static void alfred_lane_push (alfred_instance alfred, alfred_lane_work_t *work);
 
-    g_free (script);
-    cb_destroy (cb);
-    cb_release (cb);
-    return true;
+/* In lazy mode, make sure the module an action came from has been loaded */
+static inline void
+alfred_action_load (alfred_instance alfred, alfred_action_t *action)
+{
+    if (action->module && !action->module->loaded)
+        alfred_module_load (alfred, action->module);
 }
 
-static bool
-destroy_indexes (gpointer value, gpointer rpc)
+/* Give the callback the segments of the path, and the segments matched by
+ * each '*' of the callback path, without the script having to parse _path.
+ * Most scripts never look at them, so _keys and _segments are only built
+ * when first read through the globals __index. Every call gets new tables,
+ * as scripts and the functions they call may keep them after the callback
+ * returns.
+ */
+static inline void
+alfred_path_args (alfred_instance alfred, alfred_action_t *action, const char *path)
 {
-    cb_info_t *cb = (cb_info_t *) value;
-    char *script = (char *) (long) cb->cb;
-    DEBUG ("XML: Destroy indexes for path %s\n", cb->path);
+    alfred->args_action = action;
+    alfred->args_path = path;
+}
 
-    g_free (script);
-    cb_destroy (cb);
-    cb_release (cb);
-    return true;
+/* The callback has finished, so its _keys and _segments go */
+static inline void
+alfred_path_args_end (alfred_instance alfred)
+{
+    alfred->args_action = NULL;
+    alfred->args_path = NULL;
+    if (alfred->args_built)
+    {
+        lua_State *ls = alfred->ls;
+
+        lua_pushglobaltable (ls);
+        lua_pushstring (ls, "_keys");
+        lua_pushnil (ls);
+        lua_rawset (ls, -3);
+        lua_pushstring (ls, "_segments");
+        lua_pushnil (ls);
+        lua_rawset (ls, -3);
+        lua_pop (ls, 1);
+        alfred->args_built = false;
+    }
 }
 
-static bool
-node_is_leaf (xmlNode *node)
+/* Build _keys and _segments for the running callback into the globals
+ * table at idx.
+ */
+static void
+alfred_path_tables (alfred_instance alfred, int idx)
 {
-    for (xmlNode *n = node->children; n; n = n->next)
+    lua_State *ls = alfred->ls;
+    const char *p = alfred->args_path;
+    const char *q = alfred->args_action->path;
+    int keys = 0;
+    int segments = 0;
+
+    lua_newtable (ls);
+    lua_newtable (ls);
+    while (*p == '/')
     {
-        if (n->type == XML_ELEMENT_NODE && strcmp ((const char *) n->name, "NODE") == 0)
-            return false;
+        const char *end = strchrnul (++p, '/');
+        const char *qend = q ? strchrnul (q + (*q == '/'), '/') : NULL;
+
+        lua_pushlstring (ls, p, end - p);
+        lua_rawseti (ls, -2, ++segments);
+        if (q && *q == '/')
+        {
+            if (qend - q == 2 && q[1] == '*')
+            {
+                lua_pushlstring (ls, p, end - p);
+                lua_rawseti (ls, -3, ++keys);
+            }
+            q = *qend ? qend : NULL;
+        }
+        p = end;
     }
-    return true;
+    lua_pushstring (ls, "_segments");
+    lua_insert (ls, -2);
+    lua_rawset (ls, idx);
+    lua_pushstring (ls, "_keys");
+    lua_insert (ls, -2);
+    lua_rawset (ls, idx);
+    alfred->args_built = true;
+    alfred->args_tables++;
 }
 
 static bool
-process_node (alfred_instance alfred, xmlNode *node, char *parent)
+watch_action_run (alfred_instance alfred, alfred_action_t *action,
+                  const char *path, const char *value)
 {
-    xmlChar *name = NULL;
-    xmlChar *content = NULL;
-    char *path = NULL;
-    char *tmp_content = NULL;
-    GList *matches = NULL;
-    GList *scripts = NULL;
-    cb_info_t *cb;
-    bool res = true;
+    bool ret;
+
+    alfred_action_load (alfred, action);
+    lua_pushstring (alfred->ls, path);
+    lua_setglobal (alfred->ls, "_path");
+    lua_pushstring (alfred->ls, value);
+    lua_setglobal (alfred->ls, "_value");
+    alfred_path_args (alfred, action, path);
+    ret = alfred_exec (alfred->ls, action->script, 0);
+    alfred_path_args_end (alfred);
+    return ret;
+}
 
-    assert (alfred);
+/* A watch event held back until the coalesce window ends */
+typedef struct coalesce_event_t
+{
+    alfred_action_t *action;
+    char *path;
+    char *value;
+    guint timer;
+} coalesce_event_t;
 
-    /* Ignore fluff */
-    if (!node || node->type != XML_ELEMENT_NODE)
-        return true;
+static void
+coalesce_event_free (coalesce_event_t *event)
+{
+    if (event->timer)
+        g_source_remove (event->timer);
+    g_free (event->path);
+    g_free (event->value);
+    g_free (event);
+}
 
-    /* Process this node */
-    if (strcmp ((const char *) node->name, "NODE") == 0)
-    {
-        /* Find node name and path */
-        name = xmlGetProp (node, (xmlChar *) "name");
-        if (parent)
-            path = g_strdup_printf ("%s/%s", parent, name);
-        else
-            path = g_strdup_printf ("/%s", name);
+static gboolean
+coalesce_event_process (gpointer data)
+{
+    coalesce_event_t *event = (coalesce_event_t *) data;
 
-        DEBUG ("XML: %s: %s (%s)\n", node->name, name, path);
-    }
-    else if (strcmp ((const char *) node->name, "WATCH") == 0)
-    {
-        content = xmlNodeGetContent (node);
-        tmp_content = g_strdup ((char *) content);
-        /* If the node is a leaf or ends in a '*' don't add another '*' */
-        if (node_is_leaf (node->parent) || parent[strlen (parent) - 1] == '*')
-        {
-            path = g_strdup (parent);
-        }
-        else
-        {
-            path = g_strdup_printf ("%s/*", parent);
-        }
+    /* Take the event out of the queue before running it */
+    event->timer = 0;
+    g_hash_table_steal (event->action->coalesce_pending, event->path);
 
-        if (alfred->watches)
-        {
-            matches = cb_match (&alfred->watches, path, CB_MATCH_EXACT);
-        }
-        if (matches == NULL)
-        {
-            scripts = g_list_append (scripts, tmp_content);
-            cb = cb_create (&alfred->watches, "", (const char *) path, 0,
-                            (uint64_t) (long) scripts);
-        }
-        else
-        {
-            /* A watch already exists on that exact path */
-            cb = matches->data;
-            scripts = (GList *) (long) cb->cb;
-            scripts = g_list_append (scripts, tmp_content);
-            g_list_free_full (matches, (GDestroyNotify) cb_release);
-        }
-        DEBUG ("XML: %s: (%s)\n", node->name, cb->path);
-    }
-    else if (strcmp ((const char *) node->name, "SCRIPT") == 0)
+    alfred_memo_begin (alfred_inst);
+    watch_action_run (alfred_inst, event->action, event->path, event->value);
+    alfred_memo_end (alfred_inst);
+    alfred_gc_check (alfred_inst);
+
+    coalesce_event_free (event);
+    return false;
+}
+
+static GHashTable *
+coalesce_pending (alfred_action_t *action)
+{
+    if (!action->coalesce_pending)
     {
-        bool ret = false;
-        content = xmlNodeGetContent (node);
-        DEBUG ("XML: %s: %s\n", node->name, content);
-        ret = alfred_exec (alfred->ls, (char *) content, 0);
-        if (!ret)
-        {
-            res = false;
-            goto exit;
-        }
+        action->coalesce_pending = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                                          (GDestroyNotify) coalesce_event_free);
     }
-    else if (strcmp ((const char *) node->name, "REFRESH") == 0)
-    {
-        content = xmlNodeGetContent (node);
-        tmp_content = g_strdup ((char *) content);
-        DEBUG ("REFRESH: %s, XML STR: %s\n", parent, content);
+    return action->coalesce_pending;
+}
 
-        /* If the node is a leaf or ends in a '*' don't add another '*' */
-        if (node_is_leaf (node->parent) || parent[strlen (parent) - 1] == '*')
-        {
-            path = g_strdup (parent);
-        }
-        else
-        {
-            path = g_strdup_printf ("%s/*", parent);
-        }
-        if (path)
-        {
-            cb = cb_create (&alfred->refreshers, "", (const char *) path, 0,
-                            (uint64_t) (long) tmp_content);
-        }
-    }
-    else if (strcmp ((const char *) node->name, "PROVIDE") == 0)
-    {
-        content = xmlNodeGetContent (node);
-        tmp_content = g_strdup ((char *) content);
-        DEBUG ("PROVIDE: %s, XML STR: %s\n", parent, content);
+/* Hand the events waiting on a watch to the version of it from a reloaded
+ * file, so the latest value is still delivered. If the new watch does not
+ * coalesce, they are delivered as soon as the reload is done.
+ */
+static void
+coalesce_event_move (alfred_action_t *old, alfred_action_t *action)
+{
+    GHashTableIter iter;
+    gpointer value;
 
-        /* If the node is a leaf or ends in a '*' don't add another '*' */
-        if (node_is_leaf (node->parent) || parent[strlen (parent) - 1] == '*')
-        {
-            path = g_strdup (parent);
-        }
-        else
-        {
-            path = g_strdup_printf ("%s/*", parent);
-        }
-        if (path)
-        {
-            cb = cb_create (&alfred->provides, "", (const char *) path, 0,
-                            (uint64_t) (long) tmp_content);
-        }
-    }
-    else if (strcmp ((const char *) node->name, "INDEX") == 0)
+    if (!old->coalesce_pending)
+        return;
+    g_hash_table_iter_init (&iter, old->coalesce_pending);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
     {
-        content = xmlNodeGetContent (node);
-        tmp_content = g_strdup ((char *) content);
-        DEBUG ("INDEX: XML STR: %s\n", content);
+        coalesce_event_t *event = (coalesce_event_t *) value;
 
-        /* If the node is a leaf or ends in a '*' don't add another '*' */
-        if (node_is_leaf (node->parent) || parent[strlen (parent) - 1] == '*')
+        g_hash_table_iter_steal (&iter);
+        event->action = action;
+        if (!action->coalesce_ms)
         {
-            path = g_strdup (parent);
-        }
-        else
-        {
-            path = g_strdup_printf ("%s/*", parent);
-        }
-        if (path)
-        {
-            cb = cb_create (&alfred->indexes, "", (const char *) path, 0,
-                            (uint64_t) (long) tmp_content);
+            g_source_remove (event->timer);
+            event->timer = g_idle_add (coalesce_event_process, event);
         }
+        g_hash_table_insert (coalesce_pending (action), event->path, event);
     }
-    /* Process children */
-    for (xmlNode *n = node->children; n; n = n->next)
+}
+
+/* Queue a watch event, keeping only the latest value for each path */
+static void
+coalesce_event_add (alfred_instance alfred, alfred_action_t *action,
+                    const char *path, const char *value)
+{
+    coalesce_event_t *event;
+
+    event = g_hash_table_lookup (coalesce_pending (action), path);
+    if (event)
     {
-        if (!process_node (alfred, n, path))
-        {
-            res = false;
-            goto exit;
-        }
+        g_free (event->value);
+        event->value = g_strdup (value);
+        alfred->coalesced++;
+        return;
     }
-
-  exit:
-    if (path)
-        g_free (path);
-    if (name)
-        xmlFree (name);
-    if (content)
-        xmlFree (content);
-    return res;
+    event = g_malloc0 (sizeof (coalesce_event_t));
+    event->action = action;
+    event->path = g_strdup (path);
+    event->value = g_strdup (value);
+    event->timer = g_timeout_add (action->coalesce_ms, coalesce_event_process, event);
+    g_hash_table_insert (action->coalesce_pending, event->path, event);
 }
 
 static bool
-load_config_files (alfred_instance alfred, const char *path)
+watch_node_run (const char *path, const char *value)
 {
-    struct dirent *entry;
-    DIR *dir;
-    bool res = true;
+    GList *matches = NULL;
+    GList *node = NULL;
+    GList *script = NULL;
+    GList *scripts = NULL;
+    bool ret = false;
+    cb_info_t *cb = NULL;
 
-    /* Find all the XML files in this folder */
-    dir = opendir (path);
-    if (dir == NULL)
+    matches = cb_match (&alfred_inst->watches, path, CB_MATCH_EXACT |
+                        CB_PATH_MATCH_PART | CB_MATCH_WILD_PATH);
+    if (matches == NULL)
     {
-        DEBUG ("XML: Failed to open \"%s\"", path);
+        ERROR ("ALFRED: No Alfred watch for %s\n", path);
         return false;
     }
 
-    /* Load all libraries first */
-    for (entry = readdir (dir); entry; entry = readdir (dir))
+    alfred_memo_begin (alfred_inst);
+    for (node = g_list_first (matches); node != NULL; node = g_list_next (node))
     {
-        const char *ext = strrchr (entry->d_name, '.');
-        if (ext && strcmp (".lua", ext) == 0)
-        {
-            char *filename = g_strdup_printf ("%s/%s", path, entry->d_name);
-            int error;
-
-            DEBUG ("ALFRED: Load Lua file \"%s\"\n", filename);
-
-            /* Execute the script */
-            lua_getglobal (alfred->ls, "debug");
-            lua_getfield (alfred->ls, -1, "traceback");
-            error = luaL_loadfile (alfred->ls, filename);
-            if (error == 0)
-                error = lua_pcall (alfred->ls, 0, 0, 0);
-            if (error != 0)
-                alfred_error (alfred->ls, error);
-            g_free (filename);
-
-            while (lua_gettop (alfred->ls))
-                lua_pop (alfred->ls, 1);
+        cb = node->data;
+        scripts = (GList *) (long) cb->cb;
+        for (script = g_list_first (scripts); script != NULL; script = g_list_next (script))
+        {
+            alfred_action_t *action = (alfred_action_t *) script->data;
 
-            /* Stop processing files if there has been an error */
-            if (error != 0)
+            if (action->coalesce_ms)
             {
-                res = false;
-                goto exit;
+                coalesce_event_add (alfred_inst, action, path, value);
+                ret = true;
             }
-        }
-    }
-    rewinddir (dir);
-
-    /* Load all XML files */
-    for (entry = readdir (dir); entry; entry = readdir (dir))
-    {
-        const char *ext = strchr (entry->d_name, '.');
-        if (ext && ((strcmp (".xml", ext) == 0) || (strcmp (".xml.gz", ext) == 0)))
-        {
-            /* Full path */
-            char *filename = g_strdup_printf ("%s%s%s", path,
-                path[strlen (path) - 1] == '/' ? "" : "/", entry->d_name);
-
-            DEBUG ("ALFRED: Parse XML file \"%s\"\n", filename);
-            /* Parse the file */
-            xmlDoc *doc = xmlParseFile (filename);
-            if (doc == NULL)
+            else
             {
-                ERROR ("ALFRED: Invalid file \"%s\"\n", filename);
-                g_free (filename);
-                res = false;
-                goto exit;
+                ret = watch_action_run (alfred_inst, action, path, value);
             }
-            res = process_node (alfred, xmlDocGetRootElement (doc), NULL);
-            xmlFreeDoc (doc);
-            g_free (filename);
-
-            /* Stop processing files if there has been an error */
-            if (!res)
-                goto exit;
         }
     }
-
-  exit:
-    closedir (dir);
-    return res;
-}
-
-GList *delayed_work = NULL;
-struct delayed_work_s {
-    guint id;
-    int call;
-    char *script;
-};
-
-static void
-dw_destroy (gpointer arg1)
-{
-    struct delayed_work_s *dw = (struct delayed_work_s *) arg1;
-    luaL_unref (alfred_inst->ls, LUA_REGISTRYINDEX, dw->call);
-    dw->call = LUA_NOREF;
-    g_free (dw->script);
-    g_free (dw);
+    alfred_memo_end (alfred_inst);
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    alfred_gc_check (alfred_inst);
+    DEBUG("LUA: Stack:%d Memory:%dkb\n", lua_gettop (alfred_inst->ls),
+            lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0));
+    DEBUG ("ALFRED WATCH: %s = %s\n", path, value);
+    return ret;
 }
 
-static gboolean
-delayed_work_process (gpointer arg1)
+static bool
+watch_node_changed (const char *path, const char *value)
 {
-    struct delayed_work_s *dw = (struct delayed_work_s *) arg1;
-
-    /* Remove the script to be run */
-    delayed_work = g_list_remove (delayed_work, dw);
+    assert (path);
+    assert (alfred_inst);
 
-    if (dw->script)
-    {
-        /* Execute the script */
-        alfred_exec (alfred_inst->ls, dw->script, 0);
-    }
-    else
+    if (alfred_trace_fp)
+        alfred_trace (ALFRED_WATCH, path, value);
+    if (alfred_lanes)
     {
-        lua_rawgeti (alfred_inst->ls, LUA_REGISTRYINDEX, dw->call);
-        alfred_call (alfred_inst->ls, 0);
-        lua_pop (alfred_inst->ls, 0);
+        alfred_lane_work_t *work = g_malloc0 (sizeof (alfred_lane_work_t));
+
+        work->lane = ALFRED_LANE_WATCH;
+        work->path = g_strdup (path);
+        work->value = g_strdup (value);
+        work->call = LUA_NOREF;
+        alfred_lane_push (alfred_inst, work);
+        return true;
     }
+    return watch_node_run (path, value);
+}
 
-    return false;
+/* A tree watch action to run, and the first changed leaf it matched */
+typedef struct tree_watch_hit_t
+{
+    alfred_action_t *action;
+    char *path;
+} tree_watch_hit_t;
+
+static void
+tree_watch_hit_free (tree_watch_hit_t *hit)
+{
+    g_free (hit->path);
+    g_free (hit);
 }
 
+/* Add the tree watch actions that match a changed leaf, once each */
 static void
-delayed_work_add (lua_State *ls, bool reset_timer)
+tree_watch_match (alfred_instance alfred, const char *path, GList **hits)
 {
-    int call_args = 0;
-    bool found = false;
-    const char *script = NULL;
-    struct delayed_work_s *dw = NULL;
+    GList *matches = cb_match (&alfred->tree_watches, path, CB_MATCH_EXACT |
+                               CB_PATH_MATCH_PART | CB_MATCH_WILD_PATH);
 
-    if (lua_isstring (ls, 2))
-    {
-        script = lua_tostring(ls, 2);
-    }
-    else /* lua_isfunction(ls, 2) */
+    for (GList *node = matches; node; node = g_list_next (node))
     {
-        call_args = lua_gettop (ls) - 1;
-    }
+        cb_info_t *cb = node->data;
 
-    for (GList * iter = delayed_work; iter && !found; iter = g_list_next (iter))
-    {
-        dw = (struct delayed_work_s *) iter->data;
-        if (script)
-        {
-            found = dw->script && strcmp (script, dw->script) == 0;
-        }
-        else if (lua_isfunction (ls, 2)
-                 && dw->call != LUA_NOREF && dw->call != LUA_REFNIL)
+        for (GList *iter = (GList *) (long) cb->cb; iter; iter = g_list_next (iter))
         {
-            size_t len;
-            bool call_same = true;
+            tree_watch_hit_t *hit = NULL;
 
-            lua_rawgeti(ls, LUA_REGISTRYINDEX, dw->call);
-            /* Try to avoid comparing calls */
-            len = lua_rawlen(ls, -1);
-            if (((size_t)call_args) != len)
-            {
-                lua_pop(ls, 1);
-                continue;
-            }
-            for (size_t i = 0; call_same && i < call_args; i++)
+            for (GList *h = *hits; h && !hit; h = g_list_next (h))
             {
-                lua_rawgeti(ls, -1, i + 1);
-                /* lua_compare has the usual meaning in lua, tables with
-                 * the same keys and values will not be counted as the same,
-                 * unless metamethods are changed.
-                 */
-                call_same = lua_compare(ls, i + 2, -1, LUA_OPEQ);
-                lua_pop(ls, 1);
+                if (((tree_watch_hit_t *) h->data)->action == iter->data)
+                    hit = h->data;
             }
-            found = call_same;
-            lua_pop(ls, 1);
-        }
-        if (found && reset_timer)
-        {
-            delayed_work = g_list_remove (delayed_work, dw);
-            g_source_remove (dw->id);
+            if (hit)
+                continue;
+            hit = g_malloc0 (sizeof (tree_watch_hit_t));
+            hit->action = (alfred_action_t *) iter->data;
+            hit->path = g_strdup (path);
+            *hits = g_list_append (*hits, hit);
         }
     }
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+}
 
-    if (!found || reset_timer)
+/* Push a Lua table of the children of node, keyed by name with the
+ * value of each leaf, and collect the actions watching those leaves.
+ */
+static void
+tree_watch_table (alfred_instance alfred, GNode *node, GString *path, GList **hits)
+{
+    lua_State *ls = alfred->ls;
+
+    lua_newtable (ls);
+    for (GNode *child = node->children; child; child = child->next)
     {
-        struct delayed_work_s *dw = (struct delayed_work_s *) g_malloc0 (sizeof (struct delayed_work_s));
+        gsize len = path->len;
 
-        if (script)
+        g_string_append_c (path, '/');
+        g_string_append (path, APTERYX_NAME (child));
+        if (APTERYX_HAS_VALUE (child))
         {
-            dw->script = g_strdup (script);
+            lua_pushstring (ls, APTERYX_VALUE (child));
+            tree_watch_match (alfred, path->str, hits);
         }
         else
         {
-            /* Transfer stack (past delay) into the argument table */
-            lua_newtable(ls);
-            lua_pushvalue(ls, 2);
-            lua_rawseti(ls, -2, 1);
-            lua_replace(ls, 2);
-            for (int i = lua_gettop (ls); i > 2; i--)
-            {
-                lua_rawseti(ls, 2, i - 1);
-            }
-            dw->call = luaL_ref(ls, LUA_REGISTRYINDEX);
+            tree_watch_table (alfred, child, path, hits);
         }
-        delayed_work = g_list_append (delayed_work, dw);
-        dw->id = g_timeout_add_full (G_PRIORITY_DEFAULT,
-                                     lua_tonumber (ls, 1) * SECONDS_TO_MILLI,
-                                     delayed_work_process, (gpointer) dw, dw_destroy);
+        lua_setfield (ls, -2, APTERYX_NAME (child));
+        g_string_truncate (path, len);
     }
 }
 
-static int
-validate_script_or_function_args (lua_State *ls, const char *funct)
+/* Run every tree watch that covers part of a changed tree once, with the
+ * whole tree in _tree. The table always starts at "/", so a change to
+ * /interface/eth0/state is _tree.interface.eth0.state. _keys are those of
+ * the first changed leaf below the watch.
+ */
+static bool
+tree_watch_run (alfred_instance alfred, GNode *root)
 {
-    bool success = true;
+    lua_State *ls = alfred->ls;
+    const char *name = APTERYX_NAME (root);
+    GString *path = g_string_new (NULL);
+    GList *hits = NULL;
+    char **segments;
+    int count;
+    bool ret = false;
 
-    if (!lua_isnumber (ls, 1))
+    /* The root may hold the common prefix of the changed paths */
+    if (name && name[0] == '/')
+        g_string_append (path, name);
+    while (path->len && path->str[path->len - 1] == '/')
+        g_string_truncate (path, path->len - 1);
+
+    tree_watch_table (alfred, root, path, &hits);
+    segments = g_strsplit (path->str[0] == '/' ? path->str + 1 : path->str, "/", -1);
+    count = g_strv_length (segments);
+    for (int i = count - 1; i >= 0; i--)
     {
-        ERROR ("First argument to %s must be a number\n", funct);
-        success = false;
+        if (!segments[i][0])
+            continue;
+        lua_newtable (ls);
+        lua_insert (ls, -2);
+        lua_setfield (ls, -2, segments[i]);
     }
-    if (lua_isstring (ls, 2))
+    g_strfreev (segments);
+    lua_setglobal (ls, "_tree");
+
+    if (hits == NULL)
     {
-        if (lua_gettop (ls) != 2)
-        {
-            ERROR ("%s takes 2 arguements\n", funct);
-            success = false;
-        }
+        ERROR ("ALFRED: No Alfred tree watch for %s\n", path->str[0] ? path->str : "/");
     }
-    else if (!lua_isfunction (ls, 2))
+
+    alfred_memo_begin (alfred);
+    for (GList *iter = hits; iter; iter = g_list_next (iter))
     {
-        ERROR ("Second argument to %s must be a string or Lua function\n", funct);
-        success = false;
+        tree_watch_hit_t *hit = (tree_watch_hit_t *) iter->data;
+        alfred_action_t *action = hit->action;
+
+        alfred_action_load (alfred, action);
+        lua_pushstring (ls, action->path);
+        lua_setglobal (ls, "_path");
+        lua_pushnil (ls);
+        lua_setglobal (ls, "_value");
+        alfred_path_args (alfred, action, hit->path);
+        ret = alfred_exec (ls, action->script, 0);
+        alfred_path_args_end (alfred);
     }
-    return success;
+    alfred_memo_end (alfred);
+
+    /* Let the tree be collected */
+    lua_pushnil (ls);
+    lua_setglobal (ls, "_tree");
+    alfred_gc_check (alfred);
+    DEBUG ("ALFRED TREE WATCH: %s (%d actions)\n", path->str, g_list_length (hits));
+    g_list_free_full (hits, (GDestroyNotify) tree_watch_hit_free);
+    g_string_free (path, true);
+    return ret;
 }
 
-static int
-rate_limit (lua_State *ls)
+#ifdef HAVE_APTERYX_WATCH_TREE
+static bool
+tree_watch_changed (GNode *tree)
 {
-    if (validate_script_or_function_args (ls, "Alfred.rate_limit()"))
-    {
-        delayed_work_add (ls, false);
-    }
-    return 0;
+    bool ret;
+
+    assert (tree);
+    assert (alfred_inst);
+
+    ret = tree_watch_run (alfred_inst, tree);
+    apteryx_free_tree (tree);
+    return ret;
 }
+#endif
 
-static int
-after_quiet (lua_State *ls)
+/* Deliver the leaf changes collected since the last main loop iteration */
+static gboolean
+tree_watch_flush (gpointer data)
 {
-    if (validate_script_or_function_args (ls, "Alfred.after_quiet()"))
+    alfred_instance alfred = (alfred_instance) data;
+    GNode *tree = alfred->tree_pending;
+
+    alfred->tree_idle = 0;
+    alfred->tree_pending = NULL;
+    if (tree)
     {
-        delayed_work_add (ls, true);
+        tree_watch_run (alfred, tree);
+        apteryx_free_tree (tree);
     }
-    return 0;
+    return false;
 }
 
+/* Add a changed leaf to the pending tree, replacing any earlier value */
 static void
-alfred_shutdown (void)
+tree_watch_merge (alfred_instance alfred, const char *path, const char *value)
 {
-    assert (alfred_inst);
+    GNode *node;
+    const char *p = path;
 
-    if (alfred_inst->watches)
+    if (!alfred->tree_pending)
+        alfred->tree_pending = g_node_new (g_strdup ("/"));
+    node = alfred->tree_pending;
+    while (*p == '/')
     {
-        g_list_foreach (alfred_inst->watches, (GFunc) alfred_register_watches,
-                        GINT_TO_POINTER (0));
-        g_list_foreach (alfred_inst->watches, (GFunc) destroy_watches, NULL);
-        g_list_free (alfred_inst->watches);
-    }
+        const char *end = strchrnul (++p, '/');
+        char *name = g_strndup (p, end - p);
+        GNode *child = apteryx_find_child (node, name);
 
-    if (alfred_inst->refreshers)
-    {
-        g_list_foreach (alfred_inst->refreshers, (GFunc) alfred_register_refresh,
-                        GINT_TO_POINTER (0));
-        g_list_foreach (alfred_inst->refreshers, (GFunc) destroy_refresher, NULL);
-        g_list_free (alfred_inst->refreshers);
+        if (child)
+            g_free (name);
+        else
+            child = APTERYX_NODE (node, name);
+        node = child;
+        p = end;
     }
-
-    if (alfred_inst->provides)
+    if (APTERYX_HAS_VALUE (node))
     {
-        g_list_foreach (alfred_inst->provides, (GFunc) alfred_register_provide,
-                        GINT_TO_POINTER (0));
-        g_list_foreach (alfred_inst->provides, (GFunc) destroy_provides, NULL);
-        g_list_free (alfred_inst->provides);
+        g_free (node->children->data);
+        node->children->data = g_strdup (value ? value : "");
     }
-
-    if (alfred_inst->indexes)
+    else if (!node->children)
     {
-        g_list_foreach (alfred_inst->indexes, (GFunc) alfred_register_index,
-                        GINT_TO_POINTER (0));
-        g_list_foreach (alfred_inst->indexes, (GFunc) destroy_indexes, NULL);
-        g_list_free (alfred_inst->indexes);
+        APTERYX_NODE (node, g_strdup (value ? value : ""));
     }
+}
 
-    if (alfred_inst->ls)
-        lua_close (alfred_inst->ls);
-
-    g_free (alfred_inst);
-    alfred_inst = NULL;
-    return;
+/* Add a changed leaf, and deliver the tree once the main loop is idle */
+static void
+tree_watch_add (alfred_instance alfred, const char *path, const char *value)
+{
+    tree_watch_merge (alfred, path, value);
+    if (!alfred->tree_idle)
+        alfred->tree_idle = g_idle_add (tree_watch_flush, alfred);
 }
 
-void
-alfred_init (const char *path)
+#ifndef HAVE_APTERYX_WATCH_TREE
+/* Without tree watches in Apteryx, batch the leaf watches of each
+ * main loop iteration into one tree.
+ */
+static bool
+tree_watch_leaf (const char *path, const char *value)
 {
     assert (path);
+    assert (alfred_inst);
 
-    /* Malloc memory for the new service */
-    alfred_inst = (alfred_instance) g_malloc0 (sizeof (*alfred_inst));
-    if (!alfred_inst)
+    tree_watch_add (alfred_inst, path, value);
+    return true;
+}
+#endif
+
+/* When a refreshed path was last refreshed, and the timeout returned */
+typedef struct refresh_reads_t
+{
+    uint64_t last_us;
+    uint64_t timeout_us;
+} refresh_reads_t;
+
+/* Apteryx only calls a refresher when the data is read after the last
+ * timeout expired, so the time between calls is never shorter than that
+ * timeout. A call soon after it expired means the path is read often, so
+ * the timeout is halved to keep it fresher. A call long after means the
+ * path is rarely read, so the timeout is doubled and fewer reads need a
+ * refresh. Otherwise it is kept. Always within the bounds from the schema.
+ */
+static uint64_t
+refresh_adapt (alfred_action_t *action, const char *path, uint64_t timeout)
+{
+    uint64_t now = get_time_us ();
+    refresh_reads_t *reads;
+
+    if (!action->refresh_reads)
     {
-        CRITICAL ("ALFRED: No memory for alfred instance\n");
-        goto error;
+        action->refresh_reads = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free, g_free);
     }
-
-    /* Initialise the Lua state */
-    alfred_inst->ls = luaL_newstate ();
-    if (!alfred_inst->ls)
+    reads = g_hash_table_lookup (action->refresh_reads, path);
+    if (!reads)
     {
-        CRITICAL ("XML: Failed to instantiate Lua interpreter\n");
-        goto error;
+        /* Nothing known yet, so start from the script's timeout */
+        reads = g_malloc0 (sizeof (refresh_reads_t));
+        g_hash_table_insert (action->refresh_reads, g_strdup (path), reads);
+        DEBUG ("ALFRED REFRESH: %s first refresh\n", path);
     }
-
-    /* Load required libraries */
-    luaL_openlibs (alfred_inst->ls);
-    if (luaopen_apteryx (alfred_inst->ls))
+    else
     {
-        /* Provide global access to the Apteryx library */
-        lua_setglobal (alfred_inst->ls, "apteryx");
+        uint64_t gap = now - reads->last_us;
+
+        timeout = reads->timeout_us;
+        if (gap < timeout + timeout / 8)
+            timeout /= 2;
+        else if (gap > timeout * 2)
+            timeout *= 2;
+        DEBUG ("ALFRED REFRESH: %s refreshed after %"PRIu64"us\n", path, gap);
     }
+    timeout = CLAMP (timeout, action->refresh_min_us, action->refresh_max_us);
+    reads->last_us = now;
+    reads->timeout_us = timeout;
+    DEBUG ("ALFRED REFRESH: %s timeout %"PRIu64"us\n", path, timeout);
+    return timeout;
+}
 
-    /* Load the apteryx-xml API if available
-       api = require("apteryx.xml").api("/etc/apteryx/schema/")
-     */
-    if (luaL_dostring (alfred_inst->ls, "require('api')") != 0)
+uint64_t
+refresh_node_changed (const char *path)
+{
+    uint64_t timeout;
+    GList *matches = NULL;
+    char *script = NULL;
+    cb_info_t *cb = NULL;
+    alfred_action_t *action;
+    int s_0;
+
+    if (alfred_trace_fp)
+        alfred_trace (ALFRED_REFRESH, path, NULL);
+    matches = cb_match (&alfred_inst->refreshers, path, CB_MATCH_EXACT | CB_MATCH_WILD_PATH);
+    if (matches == NULL)
     {
-        ERROR ("Lua: Failed to require('api')\n");
+        ERROR ("ALFRED: No Alfred refresh for %s\n", path);
+        return 0;
     }
 
-    /* Add the rate_limit,after_quiet functions to a Lua table so it can be called using Lua */
+    cb = g_list_first (matches)->data;
+    action = (alfred_action_t *) (long) cb->cb;
+    alfred_action_load (alfred_inst, action);
+    script = action->script;
+    alfred_path_args (alfred_inst, action, path);
+    lua_pushstring (alfred_inst->ls, path);
+    lua_setglobal (alfred_inst->ls, "_path");
+    s_0 = lua_gettop (alfred_inst->ls);
+    alfred_memo_begin (alfred_inst);
+    if (!alfred_exec (alfred_inst->ls, script, 1))
+    {
+        ERROR ("Lua: Failed to execute refresh script for path: %s\n", path);
+    }
+    alfred_path_args_end (alfred_inst);
+    alfred_memo_end (alfred_inst);
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    /* The return value of luaL_dostring is the top value of the stack */
+    timeout = lua_tonumber (alfred_inst->ls, -1);
+    lua_pop (alfred_inst->ls, 1);
+    if (action->refresh_adaptive)
+        timeout = refresh_adapt (action, path, timeout);
+    alfred_gc_check (alfred_inst);
+
+    DEBUG("LUA: Stack:%d Memory:%dkb\n", lua_gettop (alfred_inst->ls),
+            lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0));
+    if (lua_gettop (alfred_inst->ls) != s_0)
+    {
+        ERROR ("Lua: Stack not zero(%d) after provide: %s\n",
+                lua_gettop (alfred_inst->ls), path);
+    }
+    return timeout;
+}
+
+/* Answer a provide from the values its prefetch function returned. When
+ * they have expired the function is called again with the requested path,
+ * and returns a table of path = value for that path and its siblings.
+ * Returns false if the path is not in the table, so the script runs.
+ */
+static bool
+provide_prefetch (alfred_instance alfred, alfred_action_t *action, const char *path,
+                  char **value)
+{
+    lua_State *ls = alfred->ls;
+    uint64_t now = get_time_us ();
+    gpointer cached;
+
+    if (!action->prefetch_values || now >= action->prefetch_expiry)
+    {
+        if (action->prefetch_values)
+            g_hash_table_remove_all (action->prefetch_values);
+        else
+            action->prefetch_values = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                             g_free, g_free);
+        action->prefetch_expiry = now + (uint64_t) action->prefetch_ttl_ms * 1000;
+        alfred->prefetch_fills++;
+
+        alfred_memo_begin (alfred);
+        lua_getglobal (ls, action->prefetch);
+        lua_pushstring (ls, path);
+        if (lua_pcall (ls, 1, 1, 0) != 0)
+        {
+            alfred_error (ls, LUA_ERRRUN);
+        }
+        else if (lua_istable (ls, -1))
+        {
+            lua_pushnil (ls);
+            while (lua_next (ls, -2))
+            {
+                if (lua_type (ls, -2) == LUA_TSTRING && lua_isstring (ls, -1))
+                {
+                    g_hash_table_insert (action->prefetch_values,
+                                         g_strdup (lua_tostring (ls, -2)),
+                                         g_strdup (lua_tostring (ls, -1)));
+                }
+                lua_pop (ls, 1);
+            }
+        }
+        else if (!lua_isnil (ls, -1))
+        {
+            ERROR ("Lua: Prefetch %s for %s did not return a table\n", action->prefetch, path);
+        }
+        lua_pop (ls, 1);
+        alfred_memo_end (alfred);
+    }
+
+    if (!g_hash_table_lookup_extended (action->prefetch_values, path, NULL, &cached))
+        return false;
+    alfred->prefetch_hits++;
+    *value = g_strdup ((const char *) cached);
+    return true;
+}
+
+char *
+provide_node_changed (const char *path)
+{
+    const char *const_value = NULL;
+    char *ret = NULL;
+    GList *matches = NULL;
+    char *script = NULL;
+    cb_info_t *cb = NULL;
+    alfred_action_t *action;
+    int s_0;
+
+    if (alfred_trace_fp)
+        alfred_trace (ALFRED_PROVIDE, path, NULL);
+    matches = cb_match (&alfred_inst->provides, path, CB_MATCH_EXACT | CB_MATCH_WILD_PATH);
+    if (matches == NULL)
+    {
+        ERROR ("ALFRED: No Alfred provide for %s\n", path);
+        return NULL;
+    }
+
+    cb = g_list_first (matches)->data;
+    action = (alfred_action_t *) (long) cb->cb;
+    alfred_action_load (alfred_inst, action);
+    script = action->script;
+    alfred_path_args (alfred_inst, action, path);
+    lua_pushstring (alfred_inst->ls, path);
+    lua_setglobal (alfred_inst->ls, "_path");
+    if (action->prefetch && provide_prefetch (alfred_inst, action, path, &ret))
+    {
+        alfred_path_args_end (alfred_inst);
+        g_list_free_full (matches, (GDestroyNotify) cb_release);
+        alfred_gc_check (alfred_inst);
+        DEBUG ("ALFRED PROVIDE: %s (prefetched)\n", path);
+        return ret;
+    }
+    s_0 = lua_gettop (alfred_inst->ls);
+    alfred_memo_begin (alfred_inst);
+    if (!alfred_exec (alfred_inst->ls, script, 1))
+    {
+        ERROR ("Lua: Failed to execute provide script for path: %s\n", path);
+    }
+    alfred_path_args_end (alfred_inst);
+    alfred_memo_end (alfred_inst);
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    /* The return value of luaL_dostring is the top value of the stack */
+    const_value = lua_tostring (alfred_inst->ls, -1);
+    ret = g_strdup (const_value);
+    lua_pop (alfred_inst->ls, 1);
+    alfred_gc_check (alfred_inst);
+    DEBUG("LUA: Stack:%d Memory:%dkb\n", lua_gettop (alfred_inst->ls),
+            lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0));
+    if (lua_gettop (alfred_inst->ls) != s_0)
+    {
+        ERROR ("Lua: Stack not zero(%d) after provide: %s\n",
+                lua_gettop (alfred_inst->ls), path);
+    }
+    return ret;
+}
+
+/* Check a value against the VALUE list and pattern of a NODE */
+static int
+validate_native (alfred_action_t *action, const char *value)
+{
+    if (action->values && !g_strv_contains ((const gchar * const *) action->values, value))
+        return -EINVAL;
+    if (action->pattern && !g_regex_match (action->pattern, value, 0, NULL))
+        return -EINVAL;
+    return 0;
+}
+
+/* Run the script of a VALIDATE. It rejects the value by returning false
+ * or a negative error number.
+ */
+static int
+validate_run (alfred_instance alfred, alfred_action_t *action, const char *path,
+              const char *value)
+{
+    lua_State *ls = alfred->ls;
+    int s_0 = lua_gettop (ls);
+    int res = 0;
+
+    alfred_action_load (alfred, action);
+    lua_pushstring (ls, path);
+    lua_setglobal (ls, "_path");
+    lua_pushstring (ls, value);
+    lua_setglobal (ls, "_value");
+    alfred_path_args (alfred, action, path);
+    alfred_memo_begin (alfred);
+    if (!alfred_exec (ls, action->script, 1))
+    {
+        ERROR ("Lua: Failed to execute validate script for path: %s\n", path);
+    }
+    else if (lua_isboolean (ls, -1) && !lua_toboolean (ls, -1))
+    {
+        res = -EINVAL;
+    }
+    else if (lua_type (ls, -1) == LUA_TNUMBER && lua_tointeger (ls, -1) < 0)
+    {
+        res = (int) lua_tointeger (ls, -1);
+    }
+    alfred_path_args_end (alfred);
+    alfred_memo_end (alfred);
+    lua_settop (ls, s_0);
+    alfred->validate_scripts++;
+    return res;
+}
+
+/* Native checks belong to a leaf, so only apply to paths of the same
+ * depth. A wildcard match can be any path below the callback path.
+ */
+static bool
+validate_leaf_match (const char *cb_path, const char *path)
+{
+    int depth = 0;
+
+    for (const char *c = cb_path; *c; c++)
+        depth += (*c == '/');
+    for (const char *c = path; *c; c++)
+        depth -= (*c == '/');
+    return depth == 0;
+}
+
+int
+validate_node_changed (const char *path, const char *value)
+{
+    GList *matches = NULL;
+    int res = 0;
+
+    matches = cb_match (&alfred_inst->validates, path, CB_MATCH_EXACT | CB_MATCH_WILD_PATH);
+    if (matches == NULL)
+    {
+        ERROR ("ALFRED: No Alfred validate for %s\n", path);
+        return 0;
+    }
+    alfred_inst->validate_checks++;
+
+    /* Deleting a value is always allowed. Every matching action must
+     * accept the value, and no scripts run until all the native checks pass.
+     */
+    if (value && value[0])
+    {
+        for (GList *iter = matches; iter && res == 0; iter = g_list_next (iter))
+        {
+            cb_info_t *cb = (cb_info_t *) iter->data;
+
+            if (validate_leaf_match (cb->path, path))
+                res = validate_native ((alfred_action_t *) (long) cb->cb, value);
+        }
+        for (GList *iter = matches; iter && res == 0; iter = g_list_next (iter))
+        {
+            alfred_action_t *action = (alfred_action_t *) (long) ((cb_info_t *) iter->data)->cb;
+
+            if (action->validate_script)
+                res = validate_run (alfred_inst, action, path, value);
+        }
+    }
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    if (res < 0)
+    {
+        alfred_inst->validate_rejects++;
+        DEBUG ("ALFRED VALIDATE: %s = %s rejected (%d)\n", path, value, res);
+    }
+    alfred_gc_check (alfred_inst);
+    return res;
+}
+
+static GList *
+index_result_copy (GList *paths)
+{
+    GList *copy = NULL;
+
+    for (GList *iter = paths; iter; iter = g_list_next (iter))
+        copy = g_list_prepend (copy, strdup ((const char *) iter->data));
+    return g_list_reverse (copy);
+}
+
+static void
+index_result_free (GList *paths)
+{
+    g_list_free_full (paths, free);
+}
+
+/* Convert the table returned by an INDEX script to a list of paths.
+ * The array part is read in order, from the end so the list can be
+ * built by prepending. Any other entries are then walked with lua_next
+ * and appended after it.
+ */
+static GList *
+index_result_from_lua (lua_State *ls, int idx)
+{
+    size_t len = lua_rawlen (ls, idx);
+    GList *paths = NULL;
+    GList *rest = NULL;
+
+    for (size_t i = len; i > 0; i--)
+    {
+        const char *path;
+
+        lua_rawgeti (ls, idx, i);
+        path = lua_tostring (ls, -1);
+        if (path)
+            paths = g_list_prepend (paths, strdup (path));
+        lua_pop (ls, 1);
+    }
+
+    lua_pushnil (ls);
+    while (lua_next (ls, idx) != 0)
+    {
+        const char *path;
+
+        /* Skip the array entries already read above */
+        if (len && lua_type (ls, -2) == LUA_TNUMBER)
+        {
+            lua_Number key = lua_tonumber (ls, -2);
+            if (key >= 1 && key <= len && (lua_Number) (size_t) key == key)
+            {
+                lua_pop (ls, 1);
+                continue;
+            }
+        }
+        path = lua_tostring (ls, -1);
+        if (path)
+            rest = g_list_prepend (rest, strdup (path));
+        /* Removes 'value'; keeps 'key' for next iteration */
+        lua_pop (ls, 1);
+    }
+    return g_list_concat (paths, g_list_reverse (rest));
+}
+
+static GList *
+index_node_changed (const char *path)
+{
+    alfred_action_t *action = NULL;
+    gpointer cached = NULL;
+    char *script = NULL;
+    GList *ret = NULL;
+    GList *matches = NULL;
+    cb_info_t *cb = NULL;
+    int s_0;
+
+    if (alfred_trace_fp)
+        alfred_trace (ALFRED_INDEX, path, NULL);
+    matches = cb_match (&alfred_inst->indexes, path, CB_MATCH_EXACT | CB_MATCH_WILD_PATH);
+    if (matches == NULL)
+    {
+        ERROR ("ALFRED: No Alfred index for %s\n", path);
+        return NULL;
+    }
+    cb = g_list_first (matches)->data;
+    action = (alfred_action_t *) (long) cb->cb;
+
+    /* Nothing the index depends on has changed since it was last run */
+    if (action->index_cache &&
+        g_hash_table_lookup_extended (action->index_cache, path, NULL, &cached))
+    {
+        g_list_free_full (matches, (GDestroyNotify) cb_release);
+        return index_result_copy ((GList *) cached);
+    }
+
+    alfred_action_load (alfred_inst, action);
+    script = action->script;
+    alfred_path_args (alfred_inst, action, path);
+    lua_pushstring (alfred_inst->ls, path);
+    lua_setglobal (alfred_inst->ls, "_path");
+    s_0 = lua_gettop (alfred_inst->ls);
+    alfred_memo_begin (alfred_inst);
+    if (!alfred_exec (alfred_inst->ls, script, 1))
+    {
+        ERROR ("Lua: Failed to execute index script for path: %s\n", path);
+    }
+    alfred_path_args_end (alfred_inst);
+    alfred_memo_end (alfred_inst);
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+
+    if (lua_gettop (alfred_inst->ls) > s_0)
+    {
+        if (lua_istable (alfred_inst->ls, -1))
+            ret = index_result_from_lua (alfred_inst->ls, lua_gettop (alfred_inst->ls));
+        lua_pop (alfred_inst->ls, 1);
+    }
+    if (action->depends)
+    {
+        if (!action->index_cache)
+        {
+            action->index_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                         (GDestroyNotify) index_result_free);
+        }
+        g_hash_table_replace (action->index_cache, g_strdup (path), index_result_copy (ret));
+    }
+    alfred_gc_check (alfred_inst);
+    DEBUG("LUA: Stack:%d Memory:%dkb\n", lua_gettop(alfred_inst->ls),
+            lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0));
+    if (lua_gettop (alfred_inst->ls) != s_0)
+    {
+        ERROR ("Lua: Stack not zero(%d) after index: %s\n",
+                lua_gettop (alfred_inst->ls), path);
+    }
+    return ret;
+}
+
+/* A dependency of one or more cached indexes has changed */
+static bool
+index_dep_changed (const char *path, const char *value)
+{
+    GList *matches = NULL;
+
+    matches = cb_match (&alfred_inst->index_deps, path, CB_MATCH_EXACT |
+                        CB_PATH_MATCH_PART | CB_MATCH_WILD_PATH);
+    for (GList *node = matches; node; node = g_list_next (node))
+    {
+        cb_info_t *cb = (cb_info_t *) node->data;
+
+        for (GList *iter = (GList *) (long) cb->cb; iter; iter = g_list_next (iter))
+        {
+            alfred_action_t *action = (alfred_action_t *) iter->data;
+
+            if (action->index_cache)
+            {
+                DEBUG ("ALFRED: Invalidate index %s (%s changed)\n", action->path, path);
+                g_hash_table_remove_all (action->index_cache);
+            }
+        }
+    }
+    g_list_free_full (matches, (GDestroyNotify) cb_release);
+    return true;
+}
+
+static void
+alfred_register_watches (gpointer value, gpointer user_data)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    int install = GPOINTER_TO_INT (user_data);
+
+    if ((install && !apteryx_watch (cb->path, watch_node_changed)) ||
+        (!install && !apteryx_unwatch (cb->path, watch_node_changed)))
+    {
+        ERROR ("Failed to (un)register watch for path %s\n", cb->path);
+    }
+}
+
+static void
+alfred_register_tree_watches (gpointer value, gpointer user_data)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    int install = GPOINTER_TO_INT (user_data);
+
+#ifdef HAVE_APTERYX_WATCH_TREE
+    if ((install && !apteryx_watch_tree (cb->path, tree_watch_changed)) ||
+        (!install && !apteryx_unwatch_tree (cb->path, tree_watch_changed)))
+#else
+    if ((install && !apteryx_watch (cb->path, tree_watch_leaf)) ||
+        (!install && !apteryx_unwatch (cb->path, tree_watch_leaf)))
+#endif
+    {
+        ERROR ("Failed to (un)register tree watch for path %s\n", cb->path);
+    }
+}
+
+static void
+alfred_register_refresh (gpointer value, gpointer user_data)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    int install = GPOINTER_TO_INT (user_data);
+
+    if ((install && !apteryx_refresh (cb->path, refresh_node_changed)) ||
+        (!install && !apteryx_unrefresh (cb->path, refresh_node_changed)))
+    {
+        ERROR ("Failed to (un)register refresh for path %s\n", cb->path);
+    }
+}
+
+static void
+alfred_register_provide (gpointer value, gpointer user_data)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    int install = GPOINTER_TO_INT (user_data);
+
+    if ((install && !apteryx_provide (cb->path, provide_node_changed)) ||
+        (!install && !apteryx_unprovide (cb->path, provide_node_changed)))
+    {
+        ERROR ("Failed to (un)register provide for path %s\n", cb->path);
+    }
+}
+
+static void
+alfred_register_index (gpointer value, gpointer user_data)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    int install = GPOINTER_TO_INT (user_data);
+
+    if ((install && !apteryx_index (cb->path, index_node_changed)) ||
+        (!install && !apteryx_unindex (cb->path, index_node_changed)))
+    {
+        ERROR ("Failed to (un)register provide for path %s\n", cb->path);
+    }
+}
+
+static void
+alfred_register_validate (gpointer value, gpointer user_data)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    int install = GPOINTER_TO_INT (user_data);
+
+    if ((install && !apteryx_validate (cb->path, validate_node_changed)) ||
+        (!install && !apteryx_unvalidate (cb->path, validate_node_changed)))
+    {
+        ERROR ("Failed to (un)register validate for path %s\n", cb->path);
+    }
+}
+
+static void
+alfred_register_index_deps (gpointer value, gpointer user_data)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    int install = GPOINTER_TO_INT (user_data);
+
+    if ((install && !apteryx_watch (cb->path, index_dep_changed)) ||
+        (!install && !apteryx_unwatch (cb->path, index_dep_changed)))
+    {
+        ERROR ("Failed to (un)register index dependency for path %s\n", cb->path);
+    }
+}
+
+/* Watch the dependencies of an index. Each path is watched once, with the
+ * list of indexes that depend on it.
+ */
+static void
+index_deps_add (alfred_instance alfred, alfred_action_t *action)
+{
+    for (int i = 0; action->depends && action->depends[i]; i++)
+    {
+        GList *matches = cb_match (&alfred->index_deps, action->depends[i], CB_MATCH_EXACT);
+
+        if (matches)
+        {
+            cb_info_t *cb = (cb_info_t *) matches->data;
+            cb->cb = (uint64_t) (long) g_list_append ((GList *) (long) cb->cb, action);
+            g_list_free_full (matches, (GDestroyNotify) cb_release);
+        }
+        else
+        {
+            cb_info_t *cb = cb_create (&alfred->index_deps, "", action->depends[i], 0,
+                                       (uint64_t) (long) g_list_append (NULL, action));
+            if (alfred->registered)
+                alfred_register_index_deps (cb, GINT_TO_POINTER (1));
+        }
+        DEBUG ("XML: INDEX: (%s) depends on (%s)\n", action->path, action->depends[i]);
+    }
+}
+
+static void
+index_deps_remove (alfred_instance alfred, alfred_action_t *action)
+{
+    GList *unused = NULL;
+
+    for (GList *iter = alfred->index_deps; iter; iter = g_list_next (iter))
+    {
+        cb_info_t *cb = (cb_info_t *) iter->data;
+        GList *actions = (GList *) (long) cb->cb;
+
+        if (!cb->active || !g_list_find (actions, action))
+            continue;
+        actions = g_list_remove (actions, action);
+        cb->cb = (uint64_t) (long) actions;
+        if (!actions)
+            unused = g_list_prepend (unused, cb);
+    }
+    for (GList *iter = unused; iter; iter = g_list_next (iter))
+    {
+        cb_info_t *cb = (cb_info_t *) iter->data;
+        alfred_register_index_deps (cb, GINT_TO_POINTER (0));
+        cb_destroy (cb);
+        cb_release (cb);
+    }
+    g_list_free (unused);
+}
+
+static bool
+destroy_watches (gpointer value, gpointer rpc)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    GList *actions = (GList *) (long) cb->cb;
+    DEBUG ("XML: Destroy watches for path %s\n", cb->path);
+
+    /* The actions themselves belong to the module */
+    g_list_free (actions);
+    cb_destroy (cb);
+    cb_release (cb);
+    return true;
+}
+
+static bool
+destroy_refresher (gpointer value, gpointer rpc)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    DEBUG ("XML: Destroy refresher for path %s\n", cb->path);
+
+    cb_destroy (cb);
+    cb_release (cb);
+    return true;
+}
+
+static bool
+destroy_provides (gpointer value, gpointer rpc)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    DEBUG ("XML: Destroy provides for path %s\n", cb->path);
+
+    cb_destroy (cb);
+    cb_release (cb);
+    return true;
+}
+
+static bool
+destroy_indexes (gpointer value, gpointer rpc)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    DEBUG ("XML: Destroy indexes for path %s\n", cb->path);
+
+    cb_destroy (cb);
+    cb_release (cb);
+    return true;
+}
+
+static bool
+destroy_validates (gpointer value, gpointer rpc)
+{
+    cb_info_t *cb = (cb_info_t *) value;
+    DEBUG ("XML: Destroy validates for path %s\n", cb->path);
+
+    cb_destroy (cb);
+    cb_release (cb);
+    return true;
+}
+
+static alfred_action_t *
+action_new (alfred_action_type type, char *path, char *script)
+{
+    alfred_action_t *action = g_malloc0 (sizeof (alfred_action_t));
+    action->type = type;
+    action->path = path;
+    action->script = script;
+    return action;
+}
+
+static void
+action_free (alfred_action_t *action)
+{
+    g_free (action->path);
+    g_free (action->script);
+    g_free (action->code);
+    if (action->attrs)
+        g_hash_table_destroy (action->attrs);
+    g_strfreev (action->depends);
+    if (action->index_cache)
+        g_hash_table_destroy (action->index_cache);
+    if (action->coalesce_pending)
+        g_hash_table_destroy (action->coalesce_pending);
+    if (action->refresh_reads)
+        g_hash_table_destroy (action->refresh_reads);
+    if (action->prefetch_values)
+        g_hash_table_destroy (action->prefetch_values);
+    if (action->pattern)
+        g_regex_unref (action->pattern);
+    g_strfreev (action->values);
+    g_free (action);
+}
+
+static const char *
+action_attr (alfred_action_t *action, const char *name)
+{
+    return action->attrs ? g_hash_table_lookup (action->attrs, name) : NULL;
+}
+
+static void
+action_add_attr (alfred_action_t *action, const char *name, const char *value)
+{
+    if (!action->attrs)
+        action->attrs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    g_hash_table_replace (action->attrs, g_strdup (name), g_strdup (value));
+}
+
+/* Parse a duration such as "50ms" or "2s" into milliseconds */
+static guint
+parse_duration_ms (const char *value)
+{
+    char *end = NULL;
+    double duration = g_ascii_strtod (value, &end);
+
+    if (end == value || duration < 0)
+        return 0;
+    while (*end == ' ')
+        end++;
+    if (strcmp (end, "s") == 0)
+        duration *= 1000;
+    else if (*end && strcmp (end, "ms") != 0)
+        return 0;
+    return (guint) duration;
+}
+
+/* Work out the settings of an action from its attributes */
+static void
+action_setup (alfred_action_t *action)
+{
+    const char *depends = action_attr (action, "depends");
+    const char *coalesce = action_attr (action, "coalesce");
+    const char *tree = action_attr (action, "tree");
+    const char *min = action_attr (action, "min");
+    const char *max = action_attr (action, "max");
+    const char *prefetch = action_attr (action, "prefetch");
+    const char *ttl = action_attr (action, "ttl");
+    const char *values = action_attr (action, "values");
+
+    if (action->type == ALFRED_VALIDATE)
+    {
+        /* The VALUEs of a NODE, one per line */
+        g_strfreev (action->values);
+        action->values = values ? g_strsplit (values, "\n", -1) : NULL;
+        action->validate_script = action->script &&
+                                  action->script[strspn (action->script, " \t\r\n")];
+    }
+
+    if (action->type == ALFRED_PROVIDE && prefetch && prefetch[0])
+    {
+        action->prefetch = prefetch;
+        action->prefetch_ttl_ms = ttl ? parse_duration_ms (ttl) : ALFRED_PREFETCH_TTL_MS;
+        if (!action->prefetch_ttl_ms)
+        {
+            ERROR ("XML: Invalid ttl \"%s\"\n", ttl);
+            action->prefetch = NULL;
+        }
+    }
+
+    if (action->type == ALFRED_REFRESH && (min || max))
+    {
+        action->refresh_adaptive = true;
+        action->refresh_min_us = min ? (uint64_t) parse_duration_ms (min) * 1000 : 0;
+        action->refresh_max_us = max ? (uint64_t) parse_duration_ms (max) * 1000 : UINT64_MAX;
+        if ((min && !action->refresh_min_us) || (max && !action->refresh_max_us) ||
+            action->refresh_min_us > action->refresh_max_us)
+        {
+            ERROR ("XML: Invalid refresh bounds for %s\n", action->path);
+            action->refresh_adaptive = false;
+        }
+    }
+
+    if (action->type == ALFRED_WATCH && tree)
+        action->watch_tree = g_strcmp0 (tree, "true") == 0;
+
+    if (action->type == ALFRED_WATCH && coalesce)
+    {
+        action->coalesce_ms = parse_duration_ms (coalesce);
+        if (!action->coalesce_ms)
+            ERROR ("XML: Invalid coalesce \"%s\"\n", coalesce);
+    }
+
+    if (action->type == ALFRED_INDEX && depends)
+    {
+        char **paths = g_strsplit_set (depends, ", ", -1);
+        int n = 0;
+
+        /* Drop the empty strings left by repeated separators */
+        for (int i = 0; paths[i]; i++)
+        {
+            if (paths[i][0])
+                paths[n++] = paths[i];
+            else
+                g_free (paths[i]);
+        }
+        paths[n] = NULL;
+        if (n)
+            action->depends = paths;
+        else
+            g_free (paths);
+    }
+}
+
+static void
+module_free (alfred_module_t *module)
+{
+    g_list_free_full (module->actions, (GDestroyNotify) action_free);
+    if (module->defines)
+        g_hash_table_destroy (module->defines);
+    g_free (module->filename);
+    g_free (module->source);
+    g_free (module);
+}
+
+static bool
+action_type (const char *name, alfred_action_type *type)
+{
+    if (strcmp (name, "SCRIPT") == 0)
+        *type = ALFRED_SCRIPT;
+    else if (strcmp (name, "WATCH") == 0)
+        *type = ALFRED_WATCH;
+    else if (strcmp (name, "REFRESH") == 0)
+        *type = ALFRED_REFRESH;
+    else if (strcmp (name, "PROVIDE") == 0)
+        *type = ALFRED_PROVIDE;
+    else if (strcmp (name, "INDEX") == 0)
+        *type = ALFRED_INDEX;
+    else if (strcmp (name, "VALIDATE") == 0)
+        *type = ALFRED_VALIDATE;
+    else
+        return false;
+    return true;
+}
+
+/* A NODE that is open while streaming through a schema file */
+typedef struct parse_frame_t
+{
+    char *path;
+    /* The NODE has child NODEs, so is not a leaf */
+    bool has_children;
+    /* Actions that need to know if the NODE is a leaf */
+    GList *pending;
+    /* The pattern and VALUEs of the NODE, and its VALIDATE script */
+    char *pattern;
+    GString *values;
+    alfred_action_t *validate;
+} parse_frame_t;
+
+static void
+parse_frame_close (parse_frame_t *frame, alfred_module_t *module)
+{
+    const char *path = frame->path;
+
+    /* Values are only checked natively for leaves. The pattern of a list
+     * entry applies to its key, not to the values below it.
+     */
+    if ((frame->pattern || frame->values) && frame->has_children)
+    {
+        DEBUG ("XML: Not validating non-leaf %s\n", path);
+    }
+    else if ((frame->pattern || frame->values) && alfred_native_validate)
+    {
+        if (!frame->validate)
+        {
+            frame->validate = action_new (ALFRED_VALIDATE, NULL, g_strdup (""));
+            module->actions = g_list_prepend (module->actions, frame->validate);
+            frame->pending = g_list_append (frame->pending, frame->validate);
+        }
+        if (frame->pattern)
+            action_add_attr (frame->validate, "pattern", frame->pattern);
+        if (frame->values)
+            action_add_attr (frame->validate, "values", frame->values->str);
+    }
+    if (frame->validate)
+        action_setup (frame->validate);
+
+    /* If the node is a leaf or ends in a '*' don't add another '*' */
+    for (GList *iter = frame->pending; iter; iter = g_list_next (iter))
+    {
+        alfred_action_t *action = (alfred_action_t *) iter->data;
+
+        if (!frame->has_children || path[strlen (path) - 1] == '*')
+            action->path = g_strdup (path);
+        else
+            action->path = g_strdup_printf ("%s/*", path);
+        DEBUG ("XML: Action (%s)\n", action->path);
+    }
+    g_list_free (frame->pending);
+    g_free (frame->pattern);
+    if (frame->values)
+        g_string_free (frame->values, true);
+    g_free (frame->path);
+    g_free (frame);
+}
+
+/* Stream through a schema file keeping only the stack of open NODEs and
+ * the text of the action being read.
+ */
+static bool
+parse_schema (alfred_module_t *module, const char *filename)
+{
+    xmlTextReaderPtr reader;
+    GList *frames = NULL;
+    GString *content = NULL;
+    GHashTable *attrs = NULL;
+    alfred_action_type type = ALFRED_SCRIPT;
+    int depth = 0;
+    bool res = true;
+    int ret;
+
+    reader = xmlReaderForFile (filename, NULL, 0);
+    if (reader == NULL)
+    {
+        ERROR ("ALFRED: Invalid file \"%s\"\n", filename);
+        return false;
+    }
+
+    while (res && (ret = xmlTextReaderRead (reader)) == 1)
+    {
+        int node_type = xmlTextReaderNodeType (reader);
+        const char *name = (const char *) xmlTextReaderConstName (reader);
+        parse_frame_t *frame = frames ? (parse_frame_t *) frames->data : NULL;
+        bool finished = false;
+
+        /* Collecting the body of an action */
+        if (content)
+        {
+            if (node_type == XML_READER_TYPE_TEXT ||
+                node_type == XML_READER_TYPE_CDATA ||
+                node_type == XML_READER_TYPE_WHITESPACE ||
+                node_type == XML_READER_TYPE_SIGNIFICANT_WHITESPACE)
+            {
+                g_string_append (content, (const char *) xmlTextReaderConstValue (reader));
+            }
+            else if (node_type == XML_READER_TYPE_END_ELEMENT &&
+                     xmlTextReaderDepth (reader) == depth)
+            {
+                finished = true;
+            }
+        }
+        else if (node_type == XML_READER_TYPE_ELEMENT && strcmp (name, "NODE") == 0)
+        {
+            xmlChar *node_name = xmlTextReaderGetAttribute (reader, (xmlChar *) "name");
+            xmlChar *pattern = xmlTextReaderGetAttribute (reader, (xmlChar *) "pattern");
+            parse_frame_t *node = g_malloc0 (sizeof (parse_frame_t));
+
+            if (frame)
+            {
+                frame->has_children = true;
+                node->path = g_strdup_printf ("%s/%s", frame->path, node_name);
+            }
+            else
+            {
+                node->path = g_strdup_printf ("/%s", node_name);
+            }
+            DEBUG ("XML: NODE: %s (%s)\n", node_name, node->path);
+            xmlFree (node_name);
+            if (pattern)
+            {
+                node->pattern = g_strdup ((const char *) pattern);
+                xmlFree (pattern);
+            }
+
+            if (xmlTextReaderIsEmptyElement (reader))
+                parse_frame_close (node, module);
+            else
+                frames = g_list_prepend (frames, node);
+        }
+        else if (node_type == XML_READER_TYPE_END_ELEMENT && strcmp (name, "NODE") == 0)
+        {
+            if (frame)
+            {
+                frames = g_list_delete_link (frames, frames);
+                parse_frame_close (frame, module);
+            }
+        }
+        else if (node_type == XML_READER_TYPE_ELEMENT && frame && strcmp (name, "VALUE") == 0)
+        {
+            xmlChar *value = xmlTextReaderGetAttribute (reader, (xmlChar *) "value");
+
+            if (value)
+            {
+                /* One per line, set on the VALIDATE when the NODE ends */
+                if (frame->values)
+                    g_string_append_c (frame->values, '\n');
+                else
+                    frame->values = g_string_new (NULL);
+                g_string_append (frame->values, (const char *) value);
+                xmlFree (value);
+            }
+        }
+        else if (node_type == XML_READER_TYPE_ELEMENT && action_type (name, &type))
+        {
+            if (type != ALFRED_SCRIPT && !frame)
+            {
+                ERROR ("XML: %s must be within a NODE\n", name);
+                res = false;
+                break;
+            }
+            content = g_string_new (NULL);
+            depth = xmlTextReaderDepth (reader);
+            finished = xmlTextReaderIsEmptyElement (reader);
+            while (xmlTextReaderMoveToNextAttribute (reader) == 1)
+            {
+                if (!attrs)
+                    attrs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+                g_hash_table_replace (attrs,
+                                      g_strdup ((const char *) xmlTextReaderConstName (reader)),
+                                      g_strdup ((const char *) xmlTextReaderConstValue (reader)));
+            }
+            xmlTextReaderMoveToElement (reader);
+            name = (const char *) xmlTextReaderConstName (reader);
+        }
+
+        if (finished)
+        {
+            alfred_action_t *action;
+
+            DEBUG ("XML: %s: %s\n", name, content->str);
+            action = action_new (type, NULL, g_string_free (content, false));
+            action->attrs = attrs;
+            /* A VALIDATE is set up when its NODE ends, with the NODE's checks */
+            if (type == ALFRED_VALIDATE && !frame->validate)
+                frame->validate = action;
+            else
+                action_setup (action);
+            content = NULL;
+            attrs = NULL;
+
+            /* Keep the actions in file order, the path is filled in once
+             * we know if the parent NODE is a leaf */
+            module->actions = g_list_prepend (module->actions, action);
+            if (type != ALFRED_SCRIPT)
+                frame->pending = g_list_append (frame->pending, action);
+        }
+    }
+    if (res && ret != 0)
+    {
+        ERROR ("ALFRED: Invalid file \"%s\"\n", filename);
+        res = false;
+    }
+
+    if (content)
+        g_string_free (content, true);
+    if (attrs)
+        g_hash_table_destroy (attrs);
+    for (GList *iter = frames; iter; iter = g_list_next (iter))
+        parse_frame_close ((parse_frame_t *) iter->data, module);
+    g_list_free (frames);
+    xmlFreeTextReader (reader);
+    module->actions = g_list_reverse (module->actions);
+    return res;
+}
+
+static char *
+module_path (const char *path, alfred_module_t *module)
+{
+    return g_strdup_printf ("%s%s%s", path,
+                            path[strlen (path) - 1] == '/' ? "" : "/", module->filename);
+}
+
+/* Extract the actions from a schema file or library */
+static bool
+parse_module (alfred_module_t *module, const char *path)
+{
+    char *filename = module_path (path, module);
+    bool res = true;
+
+    if (module->library)
+    {
+        /* The library itself is a single script, loaded from the file */
+        module->actions = g_list_prepend (NULL, action_new (ALFRED_SCRIPT, NULL, NULL));
+    }
+    else
+    {
+        DEBUG ("ALFRED: Parse XML file \"%s\"\n", filename);
+        res = parse_schema (module, filename);
+    }
+    g_free (filename);
+    return res;
+}
+
+/* Shared state of the threads parsing schema files */
+typedef struct parse_pool_t
+{
+    const char *path;
+    gint failed;
+} parse_pool_t;
+
+static void
+parse_module_thread (gpointer data, gpointer user_data)
+{
+    alfred_module_t *module = (alfred_module_t *) data;
+    parse_pool_t *ctx = (parse_pool_t *) user_data;
+
+    if (!parse_module (module, ctx->path))
+        g_atomic_int_set (&ctx->failed, 1);
+}
+
+/* Parse all the modules in parallel. Only the Lua needs to run on the
+ * main thread, so the callbacks are registered once parsing is complete.
+ */
+static bool
+parse_modules (GList *modules, const char *path)
+{
+    parse_pool_t ctx = { .path = path, .failed = 0 };
+    int threads = MIN (g_get_num_processors (), (int) g_list_length (modules));
+    GThreadPool *pool = NULL;
+
+    /* libxml2 must be initialised before it is used from multiple threads */
+    xmlInitParser ();
+    if (threads > 1)
+        pool = g_thread_pool_new (parse_module_thread, &ctx, threads, true, NULL);
+
+    for (GList *iter = modules; iter; iter = g_list_next (iter))
+    {
+        if (pool)
+            g_thread_pool_push (pool, iter->data, NULL);
+        else
+            parse_module_thread (iter->data, &ctx);
+    }
+
+    /* Wait for all the files to be parsed */
+    if (pool)
+        g_thread_pool_free (pool, false, true);
+    return g_atomic_int_get (&ctx.failed) == 0;
+}
+
+static int
+alfred_dump_writer (lua_State *ls, const void *p, size_t sz, void *ud)
+{
+    g_byte_array_append ((GByteArray *) ud, (const guint8 *) p, sz);
+    return 0;
+}
+
+/* Check the header of a bytecode file against what this build writes */
+static bool
+alfred_bytecode_valid (lua_State *ls, const char *filename)
+{
+    GByteArray *expected = g_byte_array_new ();
+    char header[ALFRED_BYTECODE_HEADER];
+    bool res = false;
+    FILE *fp;
+
+    if (luaL_loadstring (ls, "") == 0)
+    {
+        alfred_dump (ls, alfred_dump_writer, expected);
+        lua_pop (ls, 1);
+    }
+    fp = fopen (filename, "rb");
+    if (fp)
+    {
+        res = expected->len >= sizeof (header) &&
+              fread (header, 1, sizeof (header), fp) == sizeof (header) &&
+              memcmp (header, expected->data, sizeof (header)) == 0;
+        fclose (fp);
+    }
+    g_byte_array_free (expected, true);
+    return res;
+}
+
+/* Compile a library or <SCRIPT> block onto the stack, keeping the chunk
+ * if it is going to be written to the schema cache.
+ */
+static int
+script_load (alfred_instance alfred, alfred_module_t *module,
+             alfred_action_t *action, const char *path)
+{
+    lua_State *ls = alfred->ls;
+    int res;
+
+    if (action->code)
+    {
+        res = luaL_loadbufferx (ls, action->code, action->code_len, module->filename, "b");
+    }
+    else if (module->library)
+    {
+        char *filename = module_path (path, module);
+        if (module->source && !alfred_bytecode_valid (ls, filename))
+        {
+            ERROR ("ALFRED: \"%s\" was compiled for a different Lua, using \"%s\"\n",
+                   module->filename, module->source);
+            g_free (filename);
+            filename = g_strdup_printf ("%s%s%s", path,
+                                        path[strlen (path) - 1] == '/' ? "" : "/",
+                                        module->source);
+        }
+        DEBUG ("ALFRED: Load Lua file \"%s\"\n", filename);
+        res = luaL_loadfile (ls, filename);
+        g_free (filename);
+    }
+    else
+    {
+        DEBUG ("XML: SCRIPT: %s\n", action->script);
+        res = luaL_loadstring (ls, action->script);
+    }
+
+    if (res == 0 && alfred_cache_file && !action->code)
+    {
+        GByteArray *code = g_byte_array_new ();
+        if (alfred_dump (ls, alfred_dump_writer, code) == 0)
+        {
+            action->code_len = code->len;
+            action->code = (char *) g_byte_array_free (code, false);
+        }
+        else
+        {
+            g_byte_array_free (code, true);
+        }
+    }
+    return res;
+}
+
+/* Run a library or <SCRIPT> block */
+static bool
+run_script (alfred_instance alfred, alfred_module_t *module,
+            alfred_action_t *action, const char *path)
+{
+    lua_State *ls = alfred->ls;
+    int s_0 = lua_gettop (ls);
+    int res;
+
+    res = script_load (alfred, module, action, path);
+    if (res == 0)
+        res = lua_pcall (ls, 0, 0, 0);
+    if (res != 0)
+        alfred_error (ls, res);
+    lua_settop (ls, s_0);
+    return (res == 0);
+}
+
+/* Compile the pattern of a VALIDATE, or reuse it if another NODE has the
+ * same pattern. Patterns match the whole value, as in XML Schema.
+ */
+static void
+action_compile_pattern (alfred_instance alfred, alfred_action_t *action)
+{
+    const char *pattern = action_attr (action, "pattern");
+    GRegex *regex = NULL;
+    GError *error = NULL;
+
+    if (!pattern || action->pattern)
+        return;
+    if (!alfred->regexes)
+        alfred->regexes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify) g_regex_unref);
+    regex = g_hash_table_lookup (alfred->regexes, pattern);
+    if (!regex)
+    {
+        char *anchored = g_strdup_printf ("^(?:%s)$", pattern);
+
+        regex = g_regex_new (anchored, G_REGEX_OPTIMIZE | G_REGEX_DOLLAR_ENDONLY, 0, &error);
+        g_free (anchored);
+        if (!regex)
+        {
+            ERROR ("XML: Invalid pattern \"%s\" for %s: %s\n", pattern, action->path,
+                   error->message);
+            g_error_free (error);
+            return;
+        }
+        g_hash_table_insert (alfred->regexes, g_strdup (pattern), regex);
+    }
+    action->pattern = g_regex_ref (regex);
+}
+
+/* Create the callback for an action. Returns the new callback, or NULL if
+ * the action was added to an existing watch.
+ */
+static cb_info_t *
+add_callback (alfred_instance alfred, alfred_action_t *action)
+{
+    GList *matches = NULL;
+    GList *actions = NULL;
+    GList **watches = NULL;
+    cb_info_t *cb = NULL;
+
+    switch (action->type)
+    {
+    case ALFRED_WATCH:
+        watches = action->watch_tree ? &alfred->tree_watches : &alfred->watches;
+        if (*watches)
+        {
+            matches = cb_match (watches, action->path, CB_MATCH_EXACT);
+        }
+        if (matches == NULL)
+        {
+            actions = g_list_append (actions, action);
+            cb = cb_create (watches, "", (const char *) action->path, 0,
+                            (uint64_t) (long) actions);
+        }
+        else
+        {
+            /* A watch already exists on that exact path */
+            cb_info_t *watch = matches->data;
+            actions = (GList *) (long) watch->cb;
+            actions = g_list_append (actions, action);
+            g_list_free_full (matches, (GDestroyNotify) cb_release);
+        }
+        DEBUG ("XML: WATCH%s: (%s)\n", action->watch_tree ? " TREE" : "", action->path);
+        break;
+    case ALFRED_REFRESH:
+        cb = cb_create (&alfred->refreshers, "", (const char *) action->path, 0,
+                        (uint64_t) (long) action);
+        break;
+    case ALFRED_PROVIDE:
+        cb = cb_create (&alfred->provides, "", (const char *) action->path, 0,
+                        (uint64_t) (long) action);
+        break;
+    case ALFRED_INDEX:
+        cb = cb_create (&alfred->indexes, "", (const char *) action->path, 0,
+                        (uint64_t) (long) action);
+        index_deps_add (alfred, action);
+        break;
+    case ALFRED_VALIDATE:
+        action_compile_pattern (alfred, action);
+        cb = cb_create (&alfred->validates, "", (const char *) action->path, 0,
+                        (uint64_t) (long) action);
+        break;
+    default:
+        break;
+    }
+    return cb;
+}
+
+/* __index of the globals table while surveying a script */
+static int
+alfred_survey_index (lua_State *ls)
+{
+    lua_getmetatable (ls, 1);
+    lua_pushboolean (ls, true);
+    lua_setfield (ls, -2, "read");
+    return 0;
+}
+
+/* Find the globals a script defines by running it with an empty globals
+ * table. A script that reads no globals while it runs can do nothing but
+ * define them, so it can be deferred. Anything else, such as a call to
+ * apteryx.watch or a read of another module's table, must run at startup.
+ * The result is kept in the attributes, and so in the schema cache, which
+ * lazy mode requires so that this only happens when a file changes.
+ */
+static void
+script_survey (alfred_instance alfred, alfred_module_t *module,
+               alfred_action_t *action, const char *path)
+{
+    lua_State *ls = alfred->ls;
+    int s_0 = lua_gettop (ls);
+    bool deferrable = false;
+
+    if (action_attr (action, "defines") || action_attr (action, "eager"))
+        return;
+
+    alfred->surveys++;
+    if (script_load (alfred, module, action, path) == 0)
+    {
+        /* Chunk, then its globals table with the read detector */
+        lua_newtable (ls);
+        lua_newtable (ls);
+        lua_pushcfunction (ls, alfred_survey_index);
+        lua_setfield (ls, -2, "__index");
+        lua_setmetatable (ls, -2);
+        lua_pushvalue (ls, -1);
+#if LUA_VERSION_NUM < 502
+        lua_setfenv (ls, -3);
+#else
+        if (!lua_setupvalue (ls, -3, 1))
+            lua_pop (ls, 1);
+#endif
+        lua_pushvalue (ls, -2);
+        if (lua_pcall (ls, 0, 0, 0) == 0)
+        {
+            lua_getmetatable (ls, -1);
+            lua_getfield (ls, -1, "read");
+            deferrable = !lua_toboolean (ls, -1);
+            lua_pop (ls, 2);
+        }
+    }
+
+    if (deferrable)
+    {
+        GString *defines = g_string_new (NULL);
+
+        lua_pushnil (ls);
+        while (lua_next (ls, -2))
+        {
+            if (lua_type (ls, -2) == LUA_TSTRING)
+            {
+                if (defines->len)
+                    g_string_append_c (defines, ' ');
+                g_string_append (defines, lua_tostring (ls, -2));
+            }
+            lua_pop (ls, 1);
+        }
+        action_add_attr (action, "defines", defines->str);
+        g_string_free (defines, true);
+    }
+    else
+    {
+        action_add_attr (action, "eager", "true");
+    }
+    lua_settop (ls, s_0);
+}
+
+/* Work out if a module can be deferred in lazy mode, and which globals
+ * will load it when they are first read.
+ */
+static bool
+module_survey (alfred_instance alfred, alfred_module_t *module, const char *path)
+{
+    GHashTable *defines = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (GList *iter = module->actions; iter; iter = g_list_next (iter))
+    {
+        alfred_action_t *action = (alfred_action_t *) iter->data;
+        char **names;
+
+        if (action->type != ALFRED_SCRIPT)
+            continue;
+        script_survey (alfred, module, action, path);
+        if (action_attr (action, "eager"))
+        {
+            DEBUG ("ALFRED: \"%s\" has side effects, not deferring\n", module->filename);
+            g_hash_table_destroy (defines);
+            return false;
+        }
+        names = g_strsplit (action_attr (action, "defines"), " ", -1);
+        for (int i = 0; names[i]; i++)
+        {
+            if (names[i][0])
+                g_hash_table_add (defines, g_strdup (names[i]));
+        }
+        g_strfreev (names);
+    }
+    if (module->defines)
+        g_hash_table_destroy (module->defines);
+    module->defines = defines;
+    return true;
+}
+
+/* Run the scripts and create the callbacks of a module in file order */
+static bool
+apply_module (alfred_instance alfred, alfred_module_t *module, const char *path)
+{
+    bool defer = alfred_lazy && module_survey (alfred, module, path);
+
+    module->loaded = !defer;
+    for (GList *iter = module->actions; iter; iter = g_list_next (iter))
+    {
+        alfred_action_t *action = (alfred_action_t *) iter->data;
+
+        action->module = module;
+        if (action->type == ALFRED_SCRIPT)
+        {
+            if (!defer && !run_script (alfred, module, action, path))
+                return false;
+        }
+        else
+        {
+            add_callback (alfred, action);
+        }
+    }
+    return true;
+}
+
+/* Run the scripts of a module that was deferred in lazy mode */
+static void
+alfred_module_load (alfred_instance alfred, alfred_module_t *module)
+{
+    /* Mark first, the scripts may need other modules loaded */
+    module->loaded = true;
+    DEBUG ("ALFRED: Lazy load \"%s\"\n", module->filename);
+    for (GList *iter = module->actions; iter; iter = g_list_next (iter))
+    {
+        alfred_action_t *action = (alfred_action_t *) iter->data;
+        if (action->type == ALFRED_SCRIPT)
+            run_script (alfred, module, action, alfred->path);
+    }
+}
+
+/* Load the deferred modules that define a global */
+static void
+alfred_lazy_load (const char *name)
+{
+    for (GList *iter = alfred_inst->modules; iter; iter = g_list_next (iter))
+    {
+        alfred_module_t *module = (alfred_module_t *) iter->data;
+        if (!module->loaded && module->defines &&
+            g_hash_table_contains (module->defines, name))
+        {
+            alfred_module_load (alfred_inst, module);
+        }
+    }
+}
+
+/* __index for the globals table. The _keys and _segments of the running
+ * callback are built the first time they are read. In lazy mode a module
+ * can use functions defined by a library or another module, so reading an
+ * undefined global loads the deferred modules that define it. Other
+ * undefined globals are just nil.
+ */
+static int
+alfred_globals_index (lua_State *ls)
+{
+    if (lua_type (ls, 2) == LUA_TSTRING)
+    {
+        const char *name = lua_tostring (ls, 2);
+
+        if (alfred_inst->args_path && !alfred_inst->args_built &&
+            (strcmp (name, "_keys") == 0 || strcmp (name, "_segments") == 0))
+        {
+            alfred_path_tables (alfred_inst, 1);
+        }
+        else if (alfred_lazy)
+        {
+            alfred_lazy_load (name);
+        }
+    }
+    lua_rawget (ls, 1);
+    return 1;
+}
+
+/* The apteryx-xml api module parses every schema file again, so it is
+ * only loaded when a script first uses the api global. Until then api is
+ * a stub that loads the module, replaces itself in the globals table and
+ * passes the access through. Pushes the module, or nil if it failed.
+ */
+static void
+alfred_api_load (lua_State *ls)
+{
+    if (alfred_inst->api_ref != LUA_NOREF)
+    {
+        lua_rawgeti (ls, LUA_REGISTRYINDEX, alfred_inst->api_ref);
+        return;
+    }
+
+    /* Take the stub out so the module can set the global itself */
+    lua_pushglobaltable (ls);
+    lua_pushstring (ls, "api");
+    lua_pushnil (ls);
+    lua_rawset (ls, -3);
+
+    lua_getglobal (ls, "require");
+    lua_pushstring (ls, "api");
+    if (lua_pcall (ls, 1, 1, 0) != 0)
+    {
+        ERROR ("Lua: Failed to require('api'): %s\n", lua_tostring (ls, -1));
+        lua_pop (ls, 1);
+        lua_pushnil (ls);
+    }
+    else
+    {
+        lua_pushstring (ls, "api");
+        lua_rawget (ls, -3);
+        if (lua_isnil (ls, -1))
+            lua_pop (ls, 1);
+        else
+            lua_remove (ls, -2);
+    }
+    lua_pushstring (ls, "api");
+    lua_pushvalue (ls, -2);
+    lua_rawset (ls, -4);
+    lua_remove (ls, -2);
+
+    lua_pushvalue (ls, -1);
+    alfred_inst->api_ref = luaL_ref (ls, LUA_REGISTRYINDEX);
+}
+
+static int
+alfred_api_index (lua_State *ls)
+{
+    alfred_api_load (ls);
+    if (lua_isnil (ls, -1))
+        return 1;
+    lua_pushvalue (ls, 2);
+    lua_gettable (ls, -2);
+    return 1;
+}
+
+static int
+alfred_api_newindex (lua_State *ls)
+{
+    alfred_api_load (ls);
+    if (lua_isnil (ls, -1))
+        return luaL_error (ls, "api is not available");
+    lua_pushvalue (ls, 2);
+    lua_pushvalue (ls, 3);
+    lua_settable (ls, -3);
+    return 0;
+}
+
+static int
+alfred_api_call (lua_State *ls)
+{
+    alfred_api_load (ls);
+    if (lua_isnil (ls, -1))
+        return luaL_error (ls, "api is not available");
+    lua_replace (ls, 1);
+    lua_call (ls, lua_gettop (ls) - 1, LUA_MULTRET);
+    return lua_gettop (ls);
+}
+
+/* Whether require('api') could find the module, without loading it */
+static bool
+alfred_api_available (lua_State *ls)
+{
+    const char *paths[] = { "path", "cpath", NULL };
+    bool found = false;
+
+    lua_getglobal (ls, "package");
+    if (!lua_istable (ls, -1))
+    {
+        lua_pop (ls, 1);
+        return false;
+    }
+    lua_getfield (ls, -1, "preload");
+    if (lua_istable (ls, -1))
+    {
+        lua_getfield (ls, -1, "api");
+        found = !lua_isnil (ls, -1);
+        lua_pop (ls, 1);
+    }
+    lua_pop (ls, 1);
+
+    for (int i = 0; !found && paths[i]; i++)
+    {
+        char **templates;
+
+        lua_getfield (ls, -1, paths[i]);
+        templates = g_strsplit (lua_isstring (ls, -1) ? lua_tostring (ls, -1) : "", ";", -1);
+        lua_pop (ls, 1);
+        for (int j = 0; !found && templates[j]; j++)
+        {
+            char **parts;
+            char *filename;
+
+            if (templates[j][0] == '\0')
+                continue;
+            parts = g_strsplit (templates[j], "?", -1);
+            filename = g_strjoinv ("api", parts);
+            found = access (filename, R_OK) == 0;
+            g_free (filename);
+            g_strfreev (parts);
+        }
+        g_strfreev (templates);
+    }
+    lua_pop (ls, 1);
+    return found;
+}
+
+/* Leave api nil if there is no module, so "if api then" guards still work */
+static void
+alfred_api_stub (lua_State *ls)
+{
+    if (!alfred_api_available (ls))
+    {
+        DEBUG ("Lua: No api module, leaving api unset\n");
+        return;
+    }
+    lua_newtable (ls);
+    lua_newtable (ls);
+    lua_pushcfunction (ls, alfred_api_index);
+    lua_setfield (ls, -2, "__index");
+    lua_pushcfunction (ls, alfred_api_newindex);
+    lua_setfield (ls, -2, "__newindex");
+    lua_pushcfunction (ls, alfred_api_call);
+    lua_setfield (ls, -2, "__call");
+    lua_setmetatable (ls, -2);
+    lua_setglobal (ls, "api");
+}
+
+/* Whether a schema file belongs to this worker. Libraries are loaded by
+ * every worker, as any schema file may use them.
+ */
+static bool
+alfred_shard_owns (const char *name)
+{
+    unsigned int index, count;
+
+    if (!alfred_shard)
+        return true;
+    if (sscanf (alfred_shard, "%u/%u", &index, &count) == 2 && count)
+        return g_str_hash (name) % count == index;
+    return strcmp (alfred_shard, name) == 0;
+}
+
+/* Create a module for a library or schema file, NULL for other files
+ * and for schema files that another worker runs.
+ */
+static alfred_module_t *
+module_new (const char *path, const char *name)
+{
+    const char *lib_ext = strrchr (name, '.');
+    const char *xml_ext = strchr (name, '.');
+    bool library = lib_ext && (strcmp (".lua", lib_ext) == 0 || strcmp (".luac", lib_ext) == 0);
+    alfred_module_t *module;
+    struct stat st;
+    char *filename;
+
+    if (!library &&
+        !(xml_ext && ((strcmp (".xml", xml_ext) == 0) || (strcmp (".xml.gz", xml_ext) == 0))))
+    {
+        return NULL;
+    }
+    if (!library && !alfred_shard_owns (name))
+        return NULL;
+
+    module = g_malloc0 (sizeof (alfred_module_t));
+    module->filename = g_strdup (name);
+    module->library = library;
+    if (library && strcmp (".luac", lib_ext) == 0)
+    {
+        /* Remember the source to fall back to */
+        char *source = g_strndup (name, strlen (name) - 1);
+        filename = g_strdup_printf ("%s%s%s", path,
+                                    path[strlen (path) - 1] == '/' ? "" : "/", source);
+        if (g_file_test (filename, G_FILE_TEST_EXISTS))
+            module->source = source;
+        else
+            g_free (source);
+        g_free (filename);
+    }
+    filename = module_path (path, module);
+    if (stat (filename, &st) == 0)
+    {
+        module->mtime_sec = st.st_mtim.tv_sec;
+        module->mtime_nsec = st.st_mtim.tv_nsec;
+        module->size = st.st_size;
+    }
+    g_free (filename);
+    return module;
+}
+
+/* Libraries first, as the schema scripts may depend on them, then by name */
+static gint
+module_cmp (alfred_module_t *a, alfred_module_t *b)
+{
+    if (a->library != b->library)
+        return a->library ? -1 : 1;
+    return strcmp (a->filename, b->filename);
+}
+
+/* Whether a library source file is replaced by its bytecode */
+static bool
+module_shadowed (GList *modules, const char *name)
+{
+    const char *ext = strrchr (name, '.');
+
+    if (!ext || strcmp (".lua", ext) != 0)
+        return false;
+    for (GList *iter = modules; iter; iter = g_list_next (iter))
+    {
+        alfred_module_t *module = (alfred_module_t *) iter->data;
+        if (module->source && strcmp (module->source, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* Find all libraries and schema files in the config directory */
+static bool
+find_modules (const char *path, GList **modules)
+{
+    GList *found = NULL;
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir (path);
+    if (dir == NULL)
+    {
+        DEBUG ("XML: Failed to open \"%s\"", path);
+        return false;
+    }
+
+    for (entry = readdir (dir); entry; entry = readdir (dir))
+    {
+        alfred_module_t *module = module_new (path, entry->d_name);
+
+        if (module)
+            found = g_list_prepend (found, module);
+    }
+    closedir (dir);
+
+    /* Load the bytecode rather than the source of a library */
+    for (GList *iter = found, *next; iter; iter = next)
+    {
+        alfred_module_t *module = (alfred_module_t *) iter->data;
+
+        next = g_list_next (iter);
+        if (module_shadowed (found, module->filename))
+        {
+            module_free (module);
+            found = g_list_delete_link (found, iter);
+        }
+    }
+
+    /* Sort so callbacks are registered in the same order on every start */
+    *modules = g_list_sort (found, (GCompareFunc) module_cmp);
+    return true;
+}
+
+/* Schema cache file format (integers are little endian).
+ * Header: magic, version, Lua ABI, native validation, config directory
+ * Then for each module: name, flags, mtime, size, actions
+ * Then for each action: type, path, script, compiled chunk, attributes
+ */
+#define ALFRED_CACHE_MAGIC      0x43464c41
+#define ALFRED_CACHE_VERSION    3
+#define ALFRED_CACHE_NULL       UINT32_MAX
+
+typedef struct cache_reader_t
+{
+    const char *data;
+    size_t len;
+    size_t pos;
+    bool error;
+} cache_reader_t;
+
+static void
+cache_put_u32 (GByteArray *buf, uint32_t value)
+{
+    value = htol32 (value);
+    g_byte_array_append (buf, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+cache_put_u64 (GByteArray *buf, uint64_t value)
+{
+    cache_put_u32 (buf, (uint32_t) value);
+    cache_put_u32 (buf, (uint32_t) (value >> 32));
+}
+
+static void
+cache_put_data (GByteArray *buf, const char *data, size_t len)
+{
+    if (!data)
+    {
+        cache_put_u32 (buf, ALFRED_CACHE_NULL);
+        return;
+    }
+    cache_put_u32 (buf, len);
+    g_byte_array_append (buf, (const guint8 *) data, len);
+}
+
+static void
+cache_put_str (GByteArray *buf, const char *str)
+{
+    cache_put_data (buf, str, str ? strlen (str) : 0);
+}
+
+static uint32_t
+cache_get_u32 (cache_reader_t *reader)
+{
+    uint32_t value;
+
+    if (reader->error || reader->pos + sizeof (value) > reader->len)
+    {
+        reader->error = true;
+        return 0;
+    }
+    memcpy (&value, reader->data + reader->pos, sizeof (value));
+    reader->pos += sizeof (value);
+    return ltoh32 (value);
+}
+
+static uint64_t
+cache_get_u64 (cache_reader_t *reader)
+{
+    uint64_t value = cache_get_u32 (reader);
+    return value | ((uint64_t) cache_get_u32 (reader) << 32);
+}
+
+static char *
+cache_get_data (cache_reader_t *reader, size_t *len)
+{
+    uint32_t size = cache_get_u32 (reader);
+    char *data;
+
+    if (reader->error || size == ALFRED_CACHE_NULL)
+        return NULL;
+    if (reader->pos + size > reader->len)
+    {
+        reader->error = true;
+        return NULL;
+    }
+    data = g_malloc (size + 1);
+    memcpy (data, reader->data + reader->pos, size);
+    data[size] = '\0';
+    reader->pos += size;
+    if (len)
+        *len = size;
+    return data;
+}
+
+static void
+cache_put_header (GByteArray *buf, const char *path)
+{
+    cache_put_u32 (buf, ALFRED_CACHE_MAGIC);
+    cache_put_u32 (buf, ALFRED_CACHE_VERSION);
+    cache_put_u32 (buf, ALFRED_LUA_ABI);
+    cache_put_u32 (buf, sizeof (void *));
+    cache_put_u32 (buf, sizeof (lua_Number));
+    cache_put_u32 (buf, sizeof (lua_Integer));
+    cache_put_u32 (buf, alfred_native_validate);
+    cache_put_str (buf, path);
+}
+
+static bool
+cache_check_header (cache_reader_t *reader, const char *path)
+{
+    GByteArray *expected = g_byte_array_new ();
+    bool res;
+
+    cache_put_header (expected, path);
+    res = reader->len >= expected->len &&
+          memcmp (reader->data, expected->data, expected->len) == 0;
+    reader->pos = expected->len;
+    g_byte_array_free (expected, true);
+    return res;
+}
+
+static void
+cache_save (GList *modules, const char *path)
+{
+    GByteArray *buf = g_byte_array_new ();
+    GError *error = NULL;
+
+    cache_put_header (buf, path);
+    cache_put_u32 (buf, g_list_length (modules));
+    for (GList *iter = modules; iter; iter = g_list_next (iter))
+    {
+        alfred_module_t *module = (alfred_module_t *) iter->data;
+
+        cache_put_str (buf, module->filename);
+        cache_put_u32 (buf, module->library);
+        cache_put_u64 (buf, module->mtime_sec);
+        cache_put_u64 (buf, module->mtime_nsec);
+        cache_put_u64 (buf, module->size);
+        cache_put_u32 (buf, g_list_length (module->actions));
+        for (GList *a = module->actions; a; a = g_list_next (a))
+        {
+            alfred_action_t *action = (alfred_action_t *) a->data;
+
+            /* Scripts must have been compiled to be cached */
+            if (action->type == ALFRED_SCRIPT && !action->code)
+            {
+                DEBUG ("ALFRED: Not caching, \"%s\" was not compiled\n", module->filename);
+                g_byte_array_free (buf, true);
+                return;
+            }
+            cache_put_u32 (buf, action->type);
+            cache_put_str (buf, action->path);
+            cache_put_str (buf, action->type == ALFRED_SCRIPT ? NULL : action->script);
+            cache_put_data (buf, action->code, action->code_len);
+            cache_put_u32 (buf, action->attrs ? g_hash_table_size (action->attrs) : 0);
+            if (action->attrs)
+            {
+                GHashTableIter attr;
+                gpointer name, value;
+
+                g_hash_table_iter_init (&attr, action->attrs);
+                while (g_hash_table_iter_next (&attr, &name, &value))
+                {
+                    cache_put_str (buf, (const char *) name);
+                    cache_put_str (buf, (const char *) value);
+                }
+            }
+        }
+    }
+
+    if (!g_file_set_contents (alfred_cache_file, (const gchar *) buf->data, buf->len, &error))
+    {
+        ERROR ("ALFRED: Failed to write schema cache \"%s\": %s\n",
+               alfred_cache_file, error->message);
+        g_error_free (error);
+    }
+    else
+    {
+        DEBUG ("ALFRED: Wrote schema cache \"%s\" (%u bytes)\n", alfred_cache_file, buf->len);
+    }
+    g_byte_array_free (buf, true);
+}
+
+/* Restore the actions of every module from the cache. The cache is only
+ * used if it describes exactly the files currently in the directory.
+ */
+static bool
+cache_load (GList *modules, const char *path)
+{
+    cache_reader_t reader = { 0 };
+    GList *cached = NULL;
+    gsize len = 0;
+    char *data = NULL;
+    bool res = false;
+    uint32_t count;
+
+    if (!g_file_get_contents (alfred_cache_file, &data, &len, NULL))
+        return false;
+    reader.data = data;
+    reader.len = len;
+
+    if (!cache_check_header (&reader, path))
+    {
+        DEBUG ("ALFRED: Schema cache \"%s\" is for a different build or directory\n",
+               alfred_cache_file);
+        goto exit;
+    }
+
+    count = cache_get_u32 (&reader);
+    if (count != g_list_length (modules))
+        goto exit;
+
+    for (GList *iter = modules; iter && !reader.error; iter = g_list_next (iter))
+    {
+        alfred_module_t *module = (alfred_module_t *) iter->data;
+        alfred_module_t *entry = g_malloc0 (sizeof (alfred_module_t));
+        uint32_t actions;
+
+        cached = g_list_prepend (cached, entry);
+        entry->filename = cache_get_data (&reader, NULL);
+        entry->library = cache_get_u32 (&reader);
+        entry->mtime_sec = cache_get_u64 (&reader);
+        entry->mtime_nsec = cache_get_u64 (&reader);
+        entry->size = cache_get_u64 (&reader);
+        if (reader.error || g_strcmp0 (entry->filename, module->filename) != 0 ||
+            entry->library != module->library || entry->mtime_sec != module->mtime_sec ||
+            entry->mtime_nsec != module->mtime_nsec || entry->size != module->size)
+        {
+            DEBUG ("ALFRED: Schema cache is stale (%s)\n", module->filename);
+            goto exit;
+        }
+
+        actions = cache_get_u32 (&reader);
+        for (uint32_t i = 0; i < actions && !reader.error; i++)
+        {
+            alfred_action_t *action = action_new (cache_get_u32 (&reader), NULL, NULL);
+
+            entry->actions = g_list_prepend (entry->actions, action);
+            action->path = cache_get_data (&reader, NULL);
+            action->script = cache_get_data (&reader, NULL);
+            action->code = cache_get_data (&reader, &action->code_len);
+            for (uint32_t attrs = cache_get_u32 (&reader); attrs && !reader.error; attrs--)
+            {
+                char *name = cache_get_data (&reader, NULL);
+                char *value = cache_get_data (&reader, NULL);
+                if (name && value)
+                    action_add_attr (action, name, value);
+                g_free (name);
+                g_free (value);
+            }
+            action_setup (action);
+            if (action->type > ALFRED_VALIDATE ||
+                (action->type == ALFRED_SCRIPT && !action->code) ||
+                (action->type != ALFRED_SCRIPT && (!action->path || !action->script)))
+            {
+                reader.error = true;
+            }
+        }
+        entry->actions = g_list_reverse (entry->actions);
+    }
+    if (reader.error)
+    {
+        ERROR ("ALFRED: Corrupt schema cache \"%s\"\n", alfred_cache_file);
+        goto exit;
+    }
+
+    /* Everything matches, hand over the actions */
+    cached = g_list_reverse (cached);
+    for (GList *m = modules, *c = cached; m && c; m = m->next, c = c->next)
+    {
+        alfred_module_t *module = (alfred_module_t *) m->data;
+        alfred_module_t *entry = (alfred_module_t *) c->data;
+
+        module->actions = entry->actions;
+        entry->actions = NULL;
+    }
+    res = true;
+
+  exit:
+    g_list_free_full (cached, (GDestroyNotify) module_free);
+    g_free (data);
+    return res;
+}
+
+static bool
+load_config_files (alfred_instance alfred, const char *path)
+{
+    GList *modules = NULL;
+    bool res = true;
+
+    /* Find all the libraries and XML files in this folder */
+    if (!find_modules (path, &modules))
+    {
+        return false;
+    }
+    alfred->modules = modules;
+
+    /* Skip parsing if nothing has changed since the cache was written */
+    if (alfred_cache_file && cache_load (modules, path))
+    {
+        DEBUG ("ALFRED: Loaded %d modules from schema cache\n", g_list_length (modules));
+        alfred->cached = true;
+    }
+    else
+    {
+        if (!parse_modules (modules, path))
+            return false;
+    }
+
+    /* Load all libraries first, then the schema files */
+    for (GList *iter = modules; iter; iter = g_list_next (iter))
+    {
+        /* Stop processing files if there has been an error */
+        if (!apply_module (alfred, (alfred_module_t *) iter->data, path))
+        {
+            res = false;
+            break;
+        }
+    }
+
+    if (res && alfred_cache_file && !alfred->cached)
+    {
+        cache_save (modules, path);
+    }
+    return res;
+}
+
+static GList **
+callback_list (alfred_instance alfred, alfred_action_t *action)
+{
+    switch (action->type)
+    {
+    case ALFRED_WATCH:
+        return action->watch_tree ? &alfred->tree_watches : &alfred->watches;
+    case ALFRED_REFRESH:
+        return &alfred->refreshers;
+    case ALFRED_PROVIDE:
+        return &alfred->provides;
+    case ALFRED_INDEX:
+        return &alfred->indexes;
+    case ALFRED_VALIDATE:
+        return &alfred->validates;
+    default:
+        return NULL;
+    }
+}
+
+static void
+register_callback (cb_info_t *cb, alfred_action_t *action, int install)
+{
+    switch (action->type)
+    {
+    case ALFRED_WATCH:
+        if (action->watch_tree)
+            alfred_register_tree_watches (cb, GINT_TO_POINTER (install));
+        else
+            alfred_register_watches (cb, GINT_TO_POINTER (install));
+        break;
+    case ALFRED_REFRESH:
+        alfred_register_refresh (cb, GINT_TO_POINTER (install));
+        break;
+    case ALFRED_PROVIDE:
+        alfred_register_provide (cb, GINT_TO_POINTER (install));
+        break;
+    case ALFRED_INDEX:
+        alfred_register_index (cb, GINT_TO_POINTER (install));
+        break;
+    case ALFRED_VALIDATE:
+        alfred_register_validate (cb, GINT_TO_POINTER (install));
+        break;
+    default:
+        break;
+    }
+}
+
+/* Find the callback that runs an action */
+static cb_info_t *
+find_callback (alfred_instance alfred, alfred_action_t *action)
+{
+    GList **list = callback_list (alfred, action);
+
+    for (GList *iter = list ? *list : NULL; iter; iter = g_list_next (iter))
+    {
+        cb_info_t *cb = (cb_info_t *) iter->data;
+
+        if (!cb->active)
+            continue;
+        if (action->type == ALFRED_WATCH)
+        {
+            if (g_list_find ((GList *) (long) cb->cb, action))
+                return cb;
+        }
+        else if ((alfred_action_t *) (long) cb->cb == action)
+        {
+            return cb;
+        }
+    }
+    return NULL;
+}
+
+/* Point the callback of an action at a new version of the action.
+ * The path is the same so Apteryx does not need to know.
+ */
+static void
+replace_callback (alfred_instance alfred, alfred_action_t *old, alfred_action_t *action)
+{
+    cb_info_t *cb = find_callback (alfred, old);
+
+    if (!cb)
+        return;
+    if (action->type == ALFRED_WATCH)
+    {
+        g_list_find ((GList *) (long) cb->cb, old)->data = action;
+        coalesce_event_move (old, action);
+    }
+    else
+    {
+        cb->cb = (uint64_t) (long) action;
+    }
+
+    if (action->type == ALFRED_VALIDATE)
+        action_compile_pattern (alfred, action);
+
+    /* Add first so unchanged dependencies stay registered */
+    if (action->type == ALFRED_INDEX)
+    {
+        index_deps_add (alfred, action);
+        index_deps_remove (alfred, old);
+    }
+}
+
+static void
+remove_callback (alfred_instance alfred, alfred_action_t *action)
+{
+    cb_info_t *cb = find_callback (alfred, action);
+
+    if (!cb)
+        return;
+    if (action->type == ALFRED_WATCH)
+    {
+        GList *actions = g_list_remove ((GList *) (long) cb->cb, action);
+
+        /* Other actions are still watching this path */
+        cb->cb = (uint64_t) (long) actions;
+        if (actions)
+            return;
+    }
+    DEBUG ("ALFRED: Remove callback for path %s\n", cb->path);
+    if (action->type == ALFRED_INDEX)
+        index_deps_remove (alfred, action);
+    register_callback (cb, action, 0);
+    cb_destroy (cb);
+    cb_release (cb);
+}
+
+/* Reload a single library or schema file. Callbacks on paths that are in
+ * both versions are switched to the new action without touching Apteryx,
+ * so only added and removed paths are (un)registered.
+ */
+static bool
+alfred_reload_module (alfred_instance alfred, const char *name)
+{
+    alfred_module_t *module = NULL;
+    GList *link = NULL;
+    GList *stale = NULL;
+    GList *added = NULL;
+    char *filename;
+
+    /* The bytecode of this library is loaded instead */
+    if (module_shadowed (alfred->modules, name))
+        return true;
+
+    for (link = alfred->modules; link; link = g_list_next (link))
+    {
+        if (strcmp (((alfred_module_t *) link->data)->filename, name) == 0)
+            break;
+    }
+
+    filename = g_strdup_printf ("%s%s%s", alfred->path,
+                                alfred->path[strlen (alfred->path) - 1] == '/' ? "" : "/",
+                                name);
+    if (g_file_test (filename, G_FILE_TEST_EXISTS))
+        module = module_new (alfred->path, name);
+    g_free (filename);
+
+    /* Not a library or schema file */
+    if (!module && !link)
+        return true;
+
+    DEBUG ("ALFRED: Reload \"%s\"\n", name);
+    if (module && !parse_module (module, alfred->path))
+    {
+        ERROR ("ALFRED: Keeping the previous version of \"%s\"\n", name);
+        module_free (module);
+        return false;
+    }
+
+    /* Match the new actions with the old ones by type and path */
+    if (link)
+    {
+        alfred_module_t *old = (alfred_module_t *) link->data;
+        for (GList *iter = old->actions; iter; iter = g_list_next (iter))
+        {
+            if (((alfred_action_t *) iter->data)->type != ALFRED_SCRIPT)
+                stale = g_list_prepend (stale, iter->data);
+        }
+        stale = g_list_reverse (stale);
+    }
+    for (GList *iter = module ? module->actions : NULL; iter; iter = g_list_next (iter))
+    {
+        alfred_action_t *action = (alfred_action_t *) iter->data;
+        GList *match;
+
+        if (action->type == ALFRED_SCRIPT)
+            continue;
+        for (match = stale; match; match = g_list_next (match))
+        {
+            alfred_action_t *old = (alfred_action_t *) match->data;
+            if (old->type == action->type && old->watch_tree == action->watch_tree &&
+                strcmp (old->path, action->path) == 0)
+                break;
+        }
+        if (match)
+        {
+            replace_callback (alfred, (alfred_action_t *) match->data, action);
+            stale = g_list_delete_link (stale, match);
+        }
+        else
+        {
+            added = g_list_prepend (added, action);
+        }
+    }
+
+    /* Redefine the module's Lua before any new callbacks can use it */
+    if (module)
+    {
+        for (GList *iter = module->actions; iter; iter = g_list_next (iter))
+            ((alfred_action_t *) iter->data)->module = module;
+        alfred_module_load (alfred, module);
+    }
+
+    for (GList *iter = stale; iter; iter = g_list_next (iter))
+        remove_callback (alfred, (alfred_action_t *) iter->data);
+    g_list_free (stale);
+
+    added = g_list_reverse (added);
+    for (GList *iter = added; iter; iter = g_list_next (iter))
+    {
+        alfred_action_t *action = (alfred_action_t *) iter->data;
+        cb_info_t *cb = add_callback (alfred, action);
+        if (cb)
+            register_callback (cb, action, 1);
+    }
+    g_list_free (added);
+
+    /* Swap in the new version of the module */
+    if (link)
+    {
+        module_free ((alfred_module_t *) link->data);
+        if (module)
+            link->data = module;
+        else
+            alfred->modules = g_list_delete_link (alfred->modules, link);
+    }
+    else
+    {
+        alfred->modules = g_list_insert_sorted (alfred->modules, module,
+                                                (GCompareFunc) module_cmp);
+    }
+
+    if (alfred_cache_file)
+        cache_save (alfred->modules, alfred->path);
+    return true;
+}
+
+static gint
+reload_cmp (const char *a, const char *b)
+{
+    bool a_lib = g_str_has_suffix (a, ".lua");
+    bool b_lib = g_str_has_suffix (b, ".lua");
+
+    if (a_lib != b_lib)
+        return a_lib ? -1 : 1;
+    return strcmp (a, b);
+}
+
+static gboolean
+alfred_reload_process (gpointer data)
+{
+    alfred_instance alfred = (alfred_instance) data;
+    GList *names = g_hash_table_get_keys (alfred->reload_pending);
+
+    /* Libraries first, in the same order as at startup */
+    names = g_list_sort (names, (GCompareFunc) reload_cmp);
+    for (GList *iter = names; iter; iter = g_list_next (iter))
+        alfred_reload_module (alfred, (const char *) iter->data);
+    g_list_free (names);
+    g_hash_table_remove_all (alfred->reload_pending);
+
+    alfred->reload_timer = 0;
+    alfred_gc_check (alfred);
+    return false;
+}
+
+static gboolean
+alfred_reload_event (gint fd, GIOCondition condition, gpointer data)
+{
+    alfred_instance alfred = (alfred_instance) data;
+    char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+
+    while ((len = read (fd, buf, sizeof (buf))) > 0)
+    {
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof (struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event *) ptr;
+            if (event->len && event->name[0] != '.')
+                g_hash_table_add (alfred->reload_pending, g_strdup (event->name));
+        }
+    }
+
+    /* Wait for an editor or package manager to finish with the files */
+    if (g_hash_table_size (alfred->reload_pending))
+    {
+        if (alfred->reload_timer)
+            g_source_remove (alfred->reload_timer);
+        alfred->reload_timer = g_timeout_add (ALFRED_RELOAD_DELAY_MS,
+                                              alfred_reload_process, alfred);
+    }
+    return true;
+}
+
+static bool
+alfred_reload_start (alfred_instance alfred)
+{
+    alfred->reload_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (alfred->reload_fd < 0)
+    {
+        ERROR ("ALFRED: Failed to create inotify instance: %s\n", strerror (errno));
+        return false;
+    }
+    if (inotify_add_watch (alfred->reload_fd, alfred->path,
+                           IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+    {
+        ERROR ("ALFRED: Failed to watch \"%s\": %s\n", alfred->path, strerror (errno));
+        close (alfred->reload_fd);
+        alfred->reload_fd = -1;
+        return false;
+    }
+    alfred->reload_pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    alfred->reload_source = g_unix_fd_add (alfred->reload_fd, G_IO_IN,
+                                           alfred_reload_event, alfred);
+    return true;
+}
+
+/* Event trace file format (integers are little endian).
+ * Header: magic, version
+ * Then for each event: type, timestamp (us), path, value
+ */
+#define ALFRED_TRACE_MAGIC      0x54464c41
+#define ALFRED_TRACE_VERSION    1
+
+typedef struct trace_event_t
+{
+    alfred_action_type type;
+    uint64_t time;
+    char *path;
+    char *value;
+} trace_event_t;
+
+static const char *trace_names[] = { "script", "watch", "refresh", "provide", "index" };
+
+static bool
+alfred_trace_start (const char *filename)
+{
+    GByteArray *buf;
+
+    alfred_trace_fp = fopen (filename, "w");
+    if (!alfred_trace_fp)
+    {
+        ERROR ("ALFRED: Failed to create trace file \"%s\"\n", filename);
+        return false;
+    }
+    buf = g_byte_array_new ();
+    cache_put_u32 (buf, ALFRED_TRACE_MAGIC);
+    cache_put_u32 (buf, ALFRED_TRACE_VERSION);
+    fwrite (buf->data, 1, buf->len, alfred_trace_fp);
+    g_byte_array_free (buf, true);
+    return true;
+}
+
+static void
+alfred_trace_stop (void)
+{
+    if (alfred_trace_fp)
+        fclose (alfred_trace_fp);
+    alfred_trace_fp = NULL;
+}
+
+/* Record an incoming event */
+static void
+alfred_trace (alfred_action_type type, const char *path, const char *value)
+{
+    GByteArray *buf = g_byte_array_sized_new (64);
+
+    cache_put_u32 (buf, type);
+    cache_put_u64 (buf, get_time_us ());
+    cache_put_str (buf, path);
+    cache_put_str (buf, value);
+    if (fwrite (buf->data, 1, buf->len, alfred_trace_fp) != buf->len)
+    {
+        ERROR ("ALFRED: Failed to write trace, stopping capture\n");
+        alfred_trace_stop ();
+    }
+    g_byte_array_free (buf, true);
+}
+
+static void
+trace_event_free (trace_event_t *event)
+{
+    g_free (event->path);
+    g_free (event->value);
+    g_free (event);
+}
+
+static GList *
+trace_read (const char *filename, bool *ok)
+{
+    cache_reader_t reader = { 0 };
+    GList *events = NULL;
+    gchar *data = NULL;
+    gsize len = 0;
+
+    *ok = false;
+    if (!g_file_get_contents (filename, &data, &len, NULL))
+    {
+        ERROR ("ALFRED: Failed to read trace file \"%s\"\n", filename);
+        return NULL;
+    }
+    reader.data = data;
+    reader.len = len;
+    if (cache_get_u32 (&reader) != ALFRED_TRACE_MAGIC ||
+        cache_get_u32 (&reader) != ALFRED_TRACE_VERSION)
+    {
+        ERROR ("ALFRED: \"%s\" is not a trace file\n", filename);
+        g_free (data);
+        return NULL;
+    }
+    while (!reader.error && reader.pos < reader.len)
+    {
+        trace_event_t *event = g_malloc0 (sizeof (trace_event_t));
+
+        event->type = cache_get_u32 (&reader);
+        event->time = cache_get_u64 (&reader);
+        event->path = cache_get_data (&reader, NULL);
+        event->value = cache_get_data (&reader, NULL);
+        if (reader.error || !event->path || event->type > ALFRED_INDEX)
+        {
+            ERROR ("ALFRED: Truncated trace file \"%s\"\n", filename);
+            trace_event_free (event);
+            break;
+        }
+        events = g_list_prepend (events, event);
+    }
+    *ok = !reader.error;
+    g_free (data);
+    return g_list_reverse (events);
+}
+
+static int
+latency_cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void
+replay_report (const char *name, GArray *latencies)
+{
+    uint64_t *us = (uint64_t *) latencies->data;
+    guint n = latencies->len;
+
+    if (n == 0)
+        return;
+    qsort (us, n, sizeof (uint64_t), latency_cmp);
+    printf ("  %-8s %8u events  p50 %"PRIu64"us  p90 %"PRIu64"us  p99 %"PRIu64"us  max %"PRIu64"us\n",
+            name, n, us[n * 50 / 100], us[n * 90 / 100], us[n * 99 / 100], us[n - 1]);
+}
+
+/* Feed a captured trace back into the callbacks, either at the rate it was
+ * captured or as fast as possible, and report the throughput and latency.
+ * Returns the number of events replayed, or -1 if the trace is invalid.
+ */
+static int
+alfred_replay (const char *filename, bool max_speed)
+{
+    GArray *latencies[ALFRED_INDEX + 1];
+    GArray *all = g_array_new (false, false, sizeof (uint64_t));
+    FILE *trace_fp = alfred_trace_fp;
+    uint64_t start, first = 0, elapsed;
+    GList *events;
+    int count = 0;
+    bool ok;
+
+    events = trace_read (filename, &ok);
+    if (!ok)
+    {
+        g_list_free_full (events, (GDestroyNotify) trace_event_free);
+        g_array_free (all, true);
+        return -1;
+    }
+
+    /* Don't capture the replay */
+    alfred_trace_fp = NULL;
+    for (int i = 0; i <= ALFRED_INDEX; i++)
+        latencies[i] = g_array_new (false, false, sizeof (uint64_t));
+
+    start = get_time_us ();
+    for (GList *iter = events; iter; iter = g_list_next (iter))
+    {
+        trace_event_t *event = (trace_event_t *) iter->data;
+        uint64_t t0, latency;
+
+        if (iter == events)
+            first = event->time;
+        if (!max_speed && event->time > first)
+        {
+            uint64_t due = start + (event->time - first);
+            uint64_t now = get_time_us ();
+            if (due > now)
+                g_usleep (due - now);
+        }
+
+        t0 = get_time_us ();
+        switch (event->type)
+        {
+        case ALFRED_WATCH:
+            watch_node_changed (event->path, event->value);
+            break;
+        case ALFRED_REFRESH:
+            refresh_node_changed (event->path);
+            break;
+        case ALFRED_PROVIDE:
+            g_free (provide_node_changed (event->path));
+            break;
+        case ALFRED_INDEX:
+            g_list_free_full (index_node_changed (event->path), free);
+            break;
+        default:
+            continue;
+        }
+        latency = get_time_us () - t0;
+        g_array_append_val (latencies[event->type], latency);
+        g_array_append_val (all, latency);
+        count++;
+
+        /* Let any delayed work run */
+        while (g_main_context_iteration (NULL, false));
+    }
+    elapsed = get_time_us () - start;
+
+    printf ("Replayed %d events in %.3fs (%.0f events/s)\n", count,
+            elapsed / 1000000.0, elapsed ? count * 1000000.0 / elapsed : 0);
+    for (int i = ALFRED_WATCH; i <= ALFRED_INDEX; i++)
+    {
+        replay_report (trace_names[i], latencies[i]);
+        g_array_free (latencies[i], true);
+    }
+    replay_report ("total", all);
+    g_array_free (all, true);
+    printf ("Skipped %"PRIu64" Apteryx writes and %"PRIu64" commands\n",
+            alfred_inst->offline_writes, alfred_inst->offline_execs);
+
+    g_list_free_full (events, (GDestroyNotify) trace_event_free);
+    alfred_trace_fp = trace_fp;
+    return count;
+}
+
+GList *delayed_work = NULL;
+struct delayed_work_s {
+    guint id;
+    int call;
+    char *script;
+};
+
+static void
+dw_destroy (gpointer arg1)
+{
+    struct delayed_work_s *dw = (struct delayed_work_s *) arg1;
+    luaL_unref (alfred_inst->ls, LUA_REGISTRYINDEX, dw->call);
+    dw->call = LUA_NOREF;
+    g_free (dw->script);
+    g_free (dw);
+}
+
+static void
+delayed_work_run (const char *script, int call)
+{
+    alfred_memo_begin (alfred_inst);
+    if (script)
+    {
+        /* Execute the script */
+        alfred_exec (alfred_inst->ls, script, 0);
+    }
+    else
+    {
+        lua_rawgeti (alfred_inst->ls, LUA_REGISTRYINDEX, call);
+        alfred_call (alfred_inst->ls, 0);
+        lua_pop (alfred_inst->ls, 0);
+    }
+    alfred_memo_end (alfred_inst);
+    alfred_gc_check (alfred_inst);
+}
+
+static gboolean
+delayed_work_process (gpointer arg1)
+{
+    struct delayed_work_s *dw = (struct delayed_work_s *) arg1;
+
+    /* Remove the script to be run */
+    delayed_work = g_list_remove (delayed_work, dw);
+
+    if (alfred_lanes)
+    {
+        alfred_lane_work_t *work = g_malloc0 (sizeof (alfred_lane_work_t));
+
+        /* The queued work takes over the script or call */
+        work->lane = ALFRED_LANE_DELAYED;
+        work->script = dw->script;
+        work->call = dw->call;
+        dw->script = NULL;
+        dw->call = LUA_NOREF;
+        alfred_lane_push (alfred_inst, work);
+        return false;
+    }
+    delayed_work_run (dw->script, dw->call);
+    return false;
+}
+
+static void
+alfred_lane_work_free (alfred_lane_work_t *work)
+{
+    if (alfred_inst)
+        luaL_unref (alfred_inst->ls, LUA_REGISTRYINDEX, work->call);
+    g_free (work->path);
+    g_free (work->value);
+    g_free (work->script);
+    g_free (work);
+}
+
+/* Run queued work by weighted round robin, one round per call. The idle
+ * priority lets the Apteryx socket and timers in between rounds.
+ */
+static gboolean
+alfred_lane_dispatch (gpointer data)
+{
+    alfred_instance alfred = (alfred_instance) data;
+    bool pending = false;
+
+    for (int i = 0; i < ALFRED_LANES; i++)
+    {
+        alfred_lane_t *lane = &alfred->lanes[i];
+
+        for (int n = 0; n < alfred_lane_weight[i] && !g_queue_is_empty (&lane->queue); n++)
+        {
+            alfred_lane_work_t *work = g_queue_pop_head (&lane->queue);
+            uint64_t wait = get_time_us () - work->queued;
+
+            lane->runs++;
+            lane->wait_us += wait;
+            if (wait > lane->max_wait_us)
+                lane->max_wait_us = wait;
+            if (work->lane == ALFRED_LANE_WATCH)
+                watch_node_run (work->path, work->value);
+            else
+                delayed_work_run (work->script, work->call);
+            alfred_lane_work_free (work);
+        }
+        pending |= !g_queue_is_empty (&lane->queue);
+    }
+    if (!pending)
+        alfred->lane_idle = 0;
+    return pending;
+}
+
+static void
+alfred_lane_push (alfred_instance alfred, alfred_lane_work_t *work)
+{
+    alfred_lane_t *lane = &alfred->lanes[work->lane];
+
+    work->queued = get_time_us ();
+    g_queue_push_tail (&lane->queue, work);
+    if (lane->queue.length > lane->peak)
+        lane->peak = lane->queue.length;
+    if (!alfred->lane_idle)
+    {
+        alfred->lane_idle = g_idle_add_full (G_PRIORITY_HIGH_IDLE,
+                                             alfred_lane_dispatch, alfred, NULL);
+    }
+}
+
+static void
+delayed_work_add (lua_State *ls, bool reset_timer)
+{
+    int call_args = 0;
+    bool found = false;
+    const char *script = NULL;
+    struct delayed_work_s *dw = NULL;
+
+    if (lua_isstring (ls, 2))
+    {
+        script = lua_tostring(ls, 2);
+    }
+    else /* lua_isfunction(ls, 2) */
+    {
+        call_args = lua_gettop (ls) - 1;
+    }
+
+    for (GList * iter = delayed_work; iter && !found; iter = g_list_next (iter))
+    {
+        dw = (struct delayed_work_s *) iter->data;
+        if (script)
+        {
+            found = dw->script && strcmp (script, dw->script) == 0;
+        }
+        else if (lua_isfunction (ls, 2)
+                 && dw->call != LUA_NOREF && dw->call != LUA_REFNIL)
+        {
+            size_t len;
+            bool call_same = true;
+
+            lua_rawgeti(ls, LUA_REGISTRYINDEX, dw->call);
+            /* Try to avoid comparing calls */
+            len = lua_rawlen(ls, -1);
+            if (((size_t)call_args) != len)
+            {
+                lua_pop(ls, 1);
+                continue;
+            }
+            for (size_t i = 0; call_same && i < call_args; i++)
+            {
+                lua_rawgeti(ls, -1, i + 1);
+                /* lua_compare has the usual meaning in lua, tables with
+                 * the same keys and values will not be counted as the same,
+                 * unless metamethods are changed.
+                 */
+                call_same = lua_compare(ls, i + 2, -1, LUA_OPEQ);
+                lua_pop(ls, 1);
+            }
+            found = call_same;
+            lua_pop(ls, 1);
+        }
+        if (found && reset_timer)
+        {
+            delayed_work = g_list_remove (delayed_work, dw);
+            g_source_remove (dw->id);
+        }
+    }
+
+    if (!found || reset_timer)
+    {
+        struct delayed_work_s *dw = (struct delayed_work_s *) g_malloc0 (sizeof (struct delayed_work_s));
+
+        if (script)
+        {
+            dw->script = g_strdup (script);
+        }
+        else
+        {
+            /* Transfer stack (past delay) into the argument table */
+            lua_newtable(ls);
+            lua_pushvalue(ls, 2);
+            lua_rawseti(ls, -2, 1);
+            lua_replace(ls, 2);
+            for (int i = lua_gettop (ls); i > 2; i--)
+            {
+                lua_rawseti(ls, 2, i - 1);
+            }
+            dw->call = luaL_ref(ls, LUA_REGISTRYINDEX);
+        }
+        delayed_work = g_list_append (delayed_work, dw);
+        dw->id = g_timeout_add_full (G_PRIORITY_DEFAULT,
+                                     lua_tonumber (ls, 1) * SECONDS_TO_MILLI,
+                                     delayed_work_process, (gpointer) dw, dw_destroy);
+    }
+}
+
+static int
+validate_script_or_function_args (lua_State *ls, const char *funct)
+{
+    bool success = true;
+
+    if (!lua_isnumber (ls, 1))
+    {
+        ERROR ("First argument to %s must be a number\n", funct);
+        success = false;
+    }
+    if (lua_isstring (ls, 2))
+    {
+        if (lua_gettop (ls) != 2)
+        {
+            ERROR ("%s takes 2 arguements\n", funct);
+            success = false;
+        }
+    }
+    else if (!lua_isfunction (ls, 2))
+    {
+        ERROR ("Second argument to %s must be a string or Lua function\n", funct);
+        success = false;
+    }
+    return success;
+}
+
+static int
+rate_limit (lua_State *ls)
+{
+    if (validate_script_or_function_args (ls, "Alfred.rate_limit()"))
+    {
+        delayed_work_add (ls, false);
+    }
+    return 0;
+}
+
+static int
+after_quiet (lua_State *ls)
+{
+    if (validate_script_or_function_args (ls, "Alfred.after_quiet()"))
+    {
+        delayed_work_add (ls, true);
+    }
+    return 0;
+}
+
+/* Helper processes for Alfred.exec. They are forked at startup while alfred
+ * is still small, so running a command forks a small helper rather than
+ * the whole daemon with its Lua heap. Each helper runs one command at a
+ * time. Requests and replies are length prefixed:
+ *   request: length, command
+ *   reply: exit status, length, output
+ */
+typedef struct exec_request_t
+{
+    char *command;
+    int callback;
+} exec_request_t;
+
+typedef struct exec_helper_t
+{
+    int fd;
+    GPid pid;
+    exec_request_t *request;
+    guint source;
+} exec_helper_t;
+
+static int alfred_exec_helpers = 2;
+static exec_helper_t *alfred_helpers = NULL;
+static int alfred_num_helpers = 0;
+static GQueue alfred_exec_pending = G_QUEUE_INIT;
+
+static bool
+exec_read (int fd, void *data, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = read (fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = (char *) data + n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool
+exec_write (int fd, const void *data, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write (fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = (const char *) data + n;
+        len -= n;
+    }
+    return true;
+}
+
+/* The helper process. Runs commands until alfred closes the socket. */
+static void
+exec_helper_run (int fd)
+{
+    uint32_t len;
+
+    prctl (PR_SET_PDEATHSIG, SIGTERM);
+    while (exec_read (fd, &len, sizeof (len)))
+    {
+        char *command = malloc (len + 1);
+        char *output = NULL;
+        size_t size = 0;
+        int32_t status = -1;
+        FILE *fp;
+
+        if (!command || !exec_read (fd, command, len))
+            break;
+        command[len] = '\0';
+        fp = popen (command, "r");
+        if (fp)
+        {
+            char buf[4096];
+            size_t n;
+
+            while ((n = fread (buf, 1, sizeof (buf), fp)) > 0)
+            {
+                output = realloc (output, size + n);
+                memcpy (output + size, buf, n);
+                size += n;
+            }
+            status = pclose (fp);
+            status = WIFEXITED (status) ? WEXITSTATUS (status) : -1;
+        }
+        len = size;
+        if (!exec_write (fd, &status, sizeof (status)) ||
+            !exec_write (fd, &len, sizeof (len)) ||
+            !exec_write (fd, output, size))
+        {
+            break;
+        }
+        free (output);
+        free (command);
+    }
+    _exit (0);
+}
+
+/* Fork the helpers. Call before anything else is set up. */
+static void
+alfred_exec_start (void)
+{
+    alfred_helpers = g_malloc0 (sizeof (exec_helper_t) * MAX (alfred_exec_helpers, 1));
+    for (int i = 0; i < alfred_exec_helpers; i++)
+    {
+        int sv[2];
+        pid_t pid;
+
+        if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+        {
+            ERROR ("ALFRED: Failed to create exec helper socket: %s\n", strerror (errno));
+            break;
+        }
+        pid = fork ();
+        if (pid == 0)
+        {
+            close (sv[0]);
+            for (int j = 0; j < alfred_num_helpers; j++)
+                close (alfred_helpers[j].fd);
+            exec_helper_run (sv[1]);
+        }
+        close (sv[1]);
+        if (pid < 0)
+        {
+            ERROR ("ALFRED: Failed to fork exec helper: %s\n", strerror (errno));
+            close (sv[0]);
+            break;
+        }
+        alfred_helpers[alfred_num_helpers].fd = sv[0];
+        alfred_helpers[alfred_num_helpers].pid = pid;
+        alfred_num_helpers++;
+    }
+}
+
+static bool
+exec_send (exec_helper_t *helper, const char *command)
+{
+    uint32_t len = strlen (command);
+
+    return exec_write (helper->fd, &len, sizeof (len)) &&
+           exec_write (helper->fd, command, len);
+}
+
+/* Read a reply. Returns the output, or NULL if the helper has gone. */
+static char *
+exec_receive (exec_helper_t *helper, int *status, size_t *size)
+{
+    int32_t code;
+    uint32_t len;
+    char *output;
+
+    if (!exec_read (helper->fd, &code, sizeof (code)) ||
+        !exec_read (helper->fd, &len, sizeof (len)))
+    {
+        return NULL;
+    }
+    output = g_malloc (len + 1);
+    if (!exec_read (helper->fd, output, len))
+    {
+        g_free (output);
+        return NULL;
+    }
+    output[len] = '\0';
+    *status = code;
+    *size = len;
+    return output;
+}
+
+/* Run a command in this process, when there is no helper to use */
+static char *
+exec_local (const char *command, int *status, size_t *size)
+{
+    char *argv[] = { "/bin/sh", "-c", (char *) command, NULL };
+    char *output = NULL;
+    GError *error = NULL;
+    int code = -1;
+
+    if (!g_spawn_sync (NULL, argv, NULL, G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL,
+                       &output, NULL, &code, &error))
+    {
+        ERROR ("ALFRED: Failed to run \"%s\": %s\n", command, error->message);
+        g_error_free (error);
+        output = g_strdup ("");
+    }
+    *status = WIFEXITED (code) ? WEXITSTATUS (code) : -1;
+    *size = strlen (output);
+    return output;
+}
+
+static exec_helper_t *
+exec_idle_helper (void)
+{
+    for (int i = 0; i < alfred_num_helpers; i++)
+    {
+        if (alfred_helpers[i].fd >= 0 && !alfred_helpers[i].request)
+            return &alfred_helpers[i];
+    }
+    return NULL;
+}
+
+static bool
+exec_alive (void)
+{
+    for (int i = 0; i < alfred_num_helpers; i++)
+    {
+        if (alfred_helpers[i].fd >= 0)
+            return true;
+    }
+    return false;
+}
+
+static void
+exec_request_free (exec_request_t *request)
+{
+    if (alfred_inst)
+        luaL_unref (alfred_inst->ls, LUA_REGISTRYINDEX, request->callback);
+    g_free (request->command);
+    g_free (request);
+}
+
+static void exec_dispatch (void);
+
+/* The reply to an asynchronous request is ready, pass it to the callback */
+static gboolean
+exec_reply (gint fd, GIOCondition condition, gpointer data)
+{
+    exec_helper_t *helper = (exec_helper_t *) data;
+    exec_request_t *request = helper->request;
+    lua_State *ls = alfred_inst->ls;
+    size_t size = 0;
+    int status = -1;
+    char *output;
+
+    helper->source = 0;
+    helper->request = NULL;
+    output = exec_receive (helper, &status, &size);
+    if (!output)
+    {
+        ERROR ("ALFRED: Exec helper %d has gone away\n", helper->pid);
+        close (helper->fd);
+        helper->fd = -1;
+        output = exec_local (request->command, &status, &size);
+    }
+
+    alfred_memo_begin (alfred_inst);
+    lua_rawgeti (ls, LUA_REGISTRYINDEX, request->callback);
+    lua_pushlstring (ls, output, size);
+    lua_pushinteger (ls, status);
+    if (lua_pcall (ls, 2, 0, 0) != 0)
+        alfred_error (ls, LUA_ERRRUN);
+    alfred_memo_end (alfred_inst);
+    alfred_gc_check (alfred_inst);
+    g_free (output);
+    exec_request_free (request);
+
+    exec_dispatch ();
+    return false;
+}
+
+/* Hand queued asynchronous requests to idle helpers */
+static void
+exec_dispatch (void)
+{
+    exec_helper_t *helper;
+
+    while (!g_queue_is_empty (&alfred_exec_pending) && (helper = exec_idle_helper ()))
+    {
+        exec_request_t *request = g_queue_pop_head (&alfred_exec_pending);
+
+        if (!exec_send (helper, request->command))
+        {
+            ERROR ("ALFRED: Exec helper %d has gone away\n", helper->pid);
+            close (helper->fd);
+            helper->fd = -1;
+            g_queue_push_head (&alfred_exec_pending, request);
+            continue;
+        }
+        helper->request = request;
+        helper->source = g_unix_fd_add (helper->fd, G_IO_IN, exec_reply, helper);
+    }
+}
+
+/* Alfred.exec(command) returns the output and exit status of a command.
+ * Alfred.exec(command, function (output, status) ... end) returns at once
+ * and calls the function when the command has finished.
+ */
+static int
+alfred_exec_command (lua_State *ls)
+{
+    const char *command = luaL_checkstring (ls, 1);
+    exec_helper_t *helper;
+    size_t size = 0;
+    int status = -1;
+    char *output = NULL;
+
+    /* Replaying a trace, the command succeeds without output */
+    if (alfred_offline)
+    {
+        alfred_inst->offline_execs++;
+        DEBUG ("ALFRED: Replay skipped exec of %s\n", command);
+        if (lua_isfunction (ls, 2))
+        {
+            lua_pushvalue (ls, 2);
+            lua_pushstring (ls, "");
+            lua_pushinteger (ls, 0);
+            if (lua_pcall (ls, 2, 0, 0) != 0)
+                alfred_error (ls, LUA_ERRRUN);
+            return 0;
+        }
+        lua_pushstring (ls, "");
+        lua_pushinteger (ls, 0);
+        return 2;
+    }
+
+    if (lua_isfunction (ls, 2))
+    {
+        exec_request_t *request = g_malloc0 (sizeof (exec_request_t));
+
+        request->command = g_strdup (command);
+        lua_pushvalue (ls, 2);
+        request->callback = luaL_ref (ls, LUA_REGISTRYINDEX);
+        if (exec_alive ())
+        {
+            g_queue_push_tail (&alfred_exec_pending, request);
+            exec_dispatch ();
+            return 0;
+        }
+
+        /* No helpers, so run it now and call back straight away */
+        output = exec_local (command, &status, &size);
+        lua_rawgeti (ls, LUA_REGISTRYINDEX, request->callback);
+        lua_pushlstring (ls, output, size);
+        lua_pushinteger (ls, status);
+        if (lua_pcall (ls, 2, 0, 0) != 0)
+            alfred_error (ls, LUA_ERRRUN);
+        g_free (output);
+        exec_request_free (request);
+        return 0;
+    }
+
+    helper = exec_idle_helper ();
+    if (helper && exec_send (helper, command))
+        output = exec_receive (helper, &status, &size);
+    if (helper && !output)
+    {
+        ERROR ("ALFRED: Exec helper %d has gone away\n", helper->pid);
+        close (helper->fd);
+        helper->fd = -1;
+    }
+    if (!output)
+        output = exec_local (command, &status, &size);
+    lua_pushlstring (ls, output, size);
+    lua_pushinteger (ls, status);
+    g_free (output);
+    return 2;
+}
+
+/* Wait for outstanding replies so they are not mistaken for the answer
+ * to a later request, then drop the callbacks.
+ */
+static void
+alfred_exec_cancel (void)
+{
+    exec_request_t *request;
+
+    for (int i = 0; i < alfred_num_helpers; i++)
+    {
+        exec_helper_t *helper = &alfred_helpers[i];
+        size_t size;
+        int status;
+
+        if (!helper->request)
+            continue;
+        if (helper->source)
+            g_source_remove (helper->source);
+        helper->source = 0;
+        g_free (exec_receive (helper, &status, &size));
+        exec_request_free (helper->request);
+        helper->request = NULL;
+    }
+    while ((request = g_queue_pop_head (&alfred_exec_pending)))
+        exec_request_free (request);
+}
+
+static void
+alfred_exec_stop (void)
+{
+    for (int i = 0; i < alfred_num_helpers; i++)
+    {
+        if (alfred_helpers[i].fd >= 0)
+            close (alfred_helpers[i].fd);
+        waitpid (alfred_helpers[i].pid, NULL, 0);
+    }
+    g_free (alfred_helpers);
+    alfred_helpers = NULL;
+    alfred_num_helpers = 0;
+}
+
+static int
+alfred_stats (lua_State *ls)
+{
+    lua_pool_t *pool = alfred_inst->pool;
+
+    lua_newtable (ls);
+
+    /* Lua memory */
+    lua_newtable (ls);
+    lua_pushinteger (ls, lua_gc (ls, LUA_GCCOUNT, 0));
+    lua_setfield (ls, -2, "kb");
+    if (pool)
+    {
+        lua_pushinteger (ls, pool->allocs);
+        lua_setfield (ls, -2, "pool_allocs");
+        lua_pushinteger (ls, pool->frees);
+        lua_setfield (ls, -2, "pool_frees");
+        lua_pushinteger (ls, pool->num_slabs);
+        lua_setfield (ls, -2, "pool_slabs");
+        lua_pushinteger (ls, pool->peak_slabs);
+        lua_setfield (ls, -2, "pool_peak_slabs");
+        lua_pushinteger (ls, pool->large_allocs);
+        lua_setfield (ls, -2, "large_allocs");
+        lua_pushinteger (ls, pool->large_frees);
+        lua_setfield (ls, -2, "large_frees");
+        lua_pushinteger (ls, pool->large_bytes);
+        lua_setfield (ls, -2, "large_bytes");
+    }
+    lua_setfield (ls, -2, "memory");
+
+    /* Watch coalescing */
+    lua_newtable (ls);
+    lua_pushinteger (ls, alfred_inst->coalesced);
+    lua_setfield (ls, -2, "coalesced");
+    lua_setfield (ls, -2, "watch");
+
+    /* Provide prefetching */
+    lua_newtable (ls);
+    lua_pushinteger (ls, alfred_inst->prefetch_fills);
+    lua_setfield (ls, -2, "prefetches");
+    lua_pushinteger (ls, alfred_inst->prefetch_hits);
+    lua_setfield (ls, -2, "prefetch_hits");
+    lua_setfield (ls, -2, "provide");
+
+    /* Validation */
+    lua_newtable (ls);
+    lua_pushinteger (ls, alfred_inst->validate_checks);
+    lua_setfield (ls, -2, "checks");
+    lua_pushinteger (ls, alfred_inst->validate_rejects);
+    lua_setfield (ls, -2, "rejected");
+    lua_pushinteger (ls, alfred_inst->validate_scripts);
+    lua_setfield (ls, -2, "scripts");
+    lua_setfield (ls, -2, "validate");
+
+    /* Apteryx callback dispatch */
+    lua_newtable (ls);
+    lua_pushinteger (ls, alfred_inst->process_events);
+    lua_setfield (ls, -2, "events");
+    lua_pushinteger (ls, alfred_inst->process_wakeups);
+    lua_setfield (ls, -2, "wakeups");
+    lua_setfield (ls, -2, "apteryx");
+
+    /* Priority lanes */
+    if (alfred_lanes)
+    {
+        lua_newtable (ls);
+        for (int i = 0; i < ALFRED_LANES; i++)
+        {
+            alfred_lane_t *lane = &alfred_inst->lanes[i];
+
+            lua_newtable (ls);
+            lua_pushinteger (ls, lane->queue.length);
+            lua_setfield (ls, -2, "depth");
+            lua_pushinteger (ls, lane->peak);
+            lua_setfield (ls, -2, "peak");
+            lua_pushinteger (ls, lane->runs);
+            lua_setfield (ls, -2, "runs");
+            lua_pushinteger (ls, lane->runs ? lane->wait_us / lane->runs : 0);
+            lua_setfield (ls, -2, "wait_us");
+            lua_pushinteger (ls, lane->max_wait_us);
+            lua_setfield (ls, -2, "max_wait_us");
+            lua_setfield (ls, -2, alfred_lane_names[i]);
+        }
+        lua_setfield (ls, -2, "lanes");
+    }
+
+    /* Read cache */
+    if (alfred_memo)
+    {
+        lua_newtable (ls);
+        lua_pushinteger (ls, alfred_inst->memo_hits);
+        lua_setfield (ls, -2, "hits");
+        lua_pushinteger (ls, alfred_inst->memo_misses);
+        lua_setfield (ls, -2, "misses");
+        lua_setfield (ls, -2, "memo");
+    }
+
+    /* Modules */
+    if (alfred_lazy)
+    {
+        int loaded = 0;
+        for (GList *iter = alfred_inst->modules; iter; iter = g_list_next (iter))
+            loaded += ((alfred_module_t *) iter->data)->loaded;
+        lua_newtable (ls);
+        lua_pushinteger (ls, g_list_length (alfred_inst->modules));
+        lua_setfield (ls, -2, "total");
+        lua_pushinteger (ls, loaded);
+        lua_setfield (ls, -2, "loaded");
+        lua_setfield (ls, -2, "modules");
+    }
+
+    /* Idle garbage collection */
+    if (alfred_idle_gc)
+    {
+        lua_newtable (ls);
+        lua_pushinteger (ls, alfred_inst->gc_steps);
+        lua_setfield (ls, -2, "steps");
+        lua_pushinteger (ls, alfred_inst->gc_cycles);
+        lua_setfield (ls, -2, "cycles");
+        lua_pushinteger (ls, alfred_inst->gc_forced);
+        lua_setfield (ls, -2, "forced");
+        lua_setfield (ls, -2, "gc");
+    }
+    return 1;
+}
+
+static void
+alfred_shutdown (void)
+{
+    assert (alfred_inst);
+
+    if (alfred_inst->watches)
+    {
+        if (alfred_inst->registered)
+            g_list_foreach (alfred_inst->watches, (GFunc) alfred_register_watches,
+                            GINT_TO_POINTER (0));
+        g_list_foreach (alfred_inst->watches, (GFunc) destroy_watches, NULL);
+        g_list_free (alfred_inst->watches);
+    }
+
+    if (alfred_inst->tree_watches)
+    {
+        if (alfred_inst->registered)
+            g_list_foreach (alfred_inst->tree_watches, (GFunc) alfred_register_tree_watches,
+                            GINT_TO_POINTER (0));
+        g_list_foreach (alfred_inst->tree_watches, (GFunc) destroy_watches, NULL);
+        g_list_free (alfred_inst->tree_watches);
+    }
+    if (alfred_inst->tree_idle)
+        g_source_remove (alfred_inst->tree_idle);
+    if (alfred_inst->tree_pending)
+        apteryx_free_tree (alfred_inst->tree_pending);
+
+    if (alfred_inst->refreshers)
+    {
+        if (alfred_inst->registered)
+            g_list_foreach (alfred_inst->refreshers, (GFunc) alfred_register_refresh,
+                            GINT_TO_POINTER (0));
+        g_list_foreach (alfred_inst->refreshers, (GFunc) destroy_refresher, NULL);
+        g_list_free (alfred_inst->refreshers);
+    }
+
+    if (alfred_inst->provides)
+    {
+        if (alfred_inst->registered)
+            g_list_foreach (alfred_inst->provides, (GFunc) alfred_register_provide,
+                            GINT_TO_POINTER (0));
+        g_list_foreach (alfred_inst->provides, (GFunc) destroy_provides, NULL);
+        g_list_free (alfred_inst->provides);
+    }
+
+    if (alfred_inst->indexes)
+    {
+        if (alfred_inst->registered)
+            g_list_foreach (alfred_inst->indexes, (GFunc) alfred_register_index,
+                            GINT_TO_POINTER (0));
+        g_list_foreach (alfred_inst->indexes, (GFunc) destroy_indexes, NULL);
+        g_list_free (alfred_inst->indexes);
+    }
+
+    if (alfred_inst->validates)
+    {
+        if (alfred_inst->registered)
+            g_list_foreach (alfred_inst->validates, (GFunc) alfred_register_validate,
+                            GINT_TO_POINTER (0));
+        g_list_foreach (alfred_inst->validates, (GFunc) destroy_validates, NULL);
+        g_list_free (alfred_inst->validates);
+    }
+
+    if (alfred_inst->index_deps)
+    {
+        if (alfred_inst->registered)
+            g_list_foreach (alfred_inst->index_deps, (GFunc) alfred_register_index_deps,
+                            GINT_TO_POINTER (0));
+        g_list_foreach (alfred_inst->index_deps, (GFunc) destroy_watches, NULL);
+        g_list_free (alfred_inst->index_deps);
+    }
+
+    /* The callbacks are gone, so are the actions they referenced */
+    g_list_free_full (alfred_inst->modules, (GDestroyNotify) module_free);
+
+    alfred_exec_cancel ();
+
+    if (alfred_inst->lane_idle)
+        g_source_remove (alfred_inst->lane_idle);
+    for (int i = 0; i < ALFRED_LANES; i++)
+    {
+        alfred_lane_work_t *work;
+
+        while ((work = g_queue_pop_head (&alfred_inst->lanes[i].queue)))
+            alfred_lane_work_free (work);
+    }
+
+    if (alfred_inst->gc_idle)
+        g_source_remove (alfred_inst->gc_idle);
+
+    if (alfred_inst->reload_source)
+        g_source_remove (alfred_inst->reload_source);
+    if (alfred_inst->reload_timer)
+        g_source_remove (alfred_inst->reload_timer);
+    if (alfred_inst->reload_fd >= 0)
+        close (alfred_inst->reload_fd);
+    if (alfred_inst->reload_pending)
+        g_hash_table_destroy (alfred_inst->reload_pending);
+    g_free (alfred_inst->path);
+
+    if (alfred_inst->ls)
+        lua_close (alfred_inst->ls);
+
+    if (alfred_inst->pool)
+        lua_pool_destroy (alfred_inst->pool);
+
+    g_free (alfred_inst);
+    alfred_inst = NULL;
+    return;
+}
+
+void
+alfred_init (const char *path)
+{
+    assert (path);
+
+    /* Malloc memory for the new service */
+    alfred_inst = (alfred_instance) g_malloc0 (sizeof (*alfred_inst));
+    if (!alfred_inst)
+    {
+        CRITICAL ("ALFRED: No memory for alfred instance\n");
+        goto error;
+    }
+    alfred_inst->path = g_strdup (path);
+    alfred_inst->reload_fd = -1;
+    alfred_inst->api_ref = LUA_NOREF;
+
+    /* Initialise the Lua state */
+#ifdef HAVE_LUAJIT
+    /* LuaJIT does not take a custom allocator on 64 bit targets */
+    if (alfred_lua_pool)
+    {
+        ERROR ("LUA: The pooled allocator is not available with LuaJIT\n");
+        alfred_lua_pool = false;
+    }
+#endif
+    if (alfred_lua_pool)
+    {
+        alfred_inst->pool = (lua_pool_t *) g_malloc0 (sizeof (lua_pool_t));
+        alfred_inst->ls = lua_newstate (lua_pool_alloc, alfred_inst->pool);
+        if (alfred_inst->ls)
+            lua_atpanic (alfred_inst->ls, alfred_panic);
+    }
+    else
+    {
+        alfred_inst->ls = luaL_newstate ();
+    }
+    if (!alfred_inst->ls)
+    {
+        CRITICAL ("XML: Failed to instantiate Lua interpreter\n");
+        goto error;
+    }
+
+    /* Load required libraries */
+    luaL_openlibs (alfred_inst->ls);
+    if (luaopen_apteryx (alfred_inst->ls))
+    {
+        /* Provide global access to the Apteryx library */
+        lua_setglobal (alfred_inst->ls, "apteryx");
+    }
+#ifdef HAVE_LUAJIT
+    alfred_ffi_init (alfred_inst->ls);
+#endif
+    if (alfred_offline)
+        alfred_offline_init (alfred_inst->ls);
+    if (alfred_memo)
+        alfred_memo_init (alfred_inst);
+
+    /* Load the apteryx-xml API when first used
+       api = require("apteryx.xml").api("/etc/apteryx/schema/")
+     */
+    alfred_api_stub (alfred_inst->ls);
+
+    /* Add the rate_limit,after_quiet,stats,exec functions to a Lua table so it can be called using Lua */
     lua_newtable (alfred_inst->ls);
     lua_pushcfunction (alfred_inst->ls, rate_limit);
     lua_setfield (alfred_inst->ls, -2, "rate_limit");
     lua_pushcfunction (alfred_inst->ls, after_quiet);
     lua_setfield (alfred_inst->ls, -2, "after_quiet");
+    lua_pushcfunction (alfred_inst->ls, alfred_stats);
+    lua_setfield (alfred_inst->ls, -2, "stats");
+    lua_pushcfunction (alfred_inst->ls, alfred_exec_command);
+    lua_setfield (alfred_inst->ls, -2, "exec");
     lua_setglobal (alfred_inst->ls, "Alfred");
 
-    /* Parse files in the config path */
-    if (!load_config_files (alfred_inst, path))
+    /* Build _keys and _segments, and load deferred modules, when their
+     * globals are first needed. Set up first, so modules that run at
+     * startup can use deferred ones.
+     */
+    lua_pushglobaltable (alfred_inst->ls);
+    lua_newtable (alfred_inst->ls);
+    lua_pushcfunction (alfred_inst->ls, alfred_globals_index);
+    lua_setfield (alfred_inst->ls, -2, "__index");
+    lua_setmetatable (alfred_inst->ls, -2);
+    lua_pop (alfred_inst->ls, 1);
+
+    /* Parse files in the config path */
+    if (!load_config_files (alfred_inst, path))
+    {
+        goto error;
+    }
+
+    /* Take over the garbage collector */
+    if (alfred_idle_gc)
+    {
+        lua_gc (alfred_inst->ls, LUA_GCSETPAUSE, alfred_gc_pause);
+        lua_gc (alfred_inst->ls, LUA_GCSETSTEPMUL, alfred_gc_stepmul);
+        lua_gc (alfred_inst->ls, LUA_GCCOLLECT, 0);
+        lua_gc (alfred_inst->ls, LUA_GCSTOP, 0);
+        alfred_inst->gc_base_kb = lua_gc (alfred_inst->ls, LUA_GCCOUNT, 0);
+    }
+
+    /* A replay runs the callbacks itself, and must not take them from a
+     * running alfred */
+    if (alfred_offline)
+        return;
+
+    /* Register watches */
+    g_list_foreach (alfred_inst->watches, (GFunc) alfred_register_watches, GINT_TO_POINTER (1));
+
+    /* Register tree watches */
+    g_list_foreach (alfred_inst->tree_watches, (GFunc) alfred_register_tree_watches,
+                    GINT_TO_POINTER (1));
+
+    /* Register refreshers */
+    g_list_foreach (alfred_inst->refreshers, (GFunc) alfred_register_refresh, GINT_TO_POINTER (1));
+
+    /* Register provides */
+    g_list_foreach (alfred_inst->provides, (GFunc) alfred_register_provide, GINT_TO_POINTER (1));
+
+    /* Register indexes */
+    g_list_foreach (alfred_inst->indexes, (GFunc) alfred_register_index, GINT_TO_POINTER (1));
+    g_list_foreach (alfred_inst->index_deps, (GFunc) alfred_register_index_deps,
+                    GINT_TO_POINTER (1));
+
+    /* Register validates */
+    g_list_foreach (alfred_inst->validates, (GFunc) alfred_register_validate,
+                    GINT_TO_POINTER (1));
+    alfred_inst->registered = true;
+
+    /* Pick up changes to the config directory */
+    if (alfred_reload)
+        alfred_reload_start (alfred_inst);
+
+    return;
+error:
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    return;
+}
+
+void
+test_simple_watch ()
+{
+    FILE *library = NULL;
+    FILE *data = NULL;
+    char *test_str = NULL;
+
+    /* Create library file + XML */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                "function test_library_function(test_str)\n"
+                "  test_value = test_str\n"
+                "end\n"
+                );
+        fclose (library);
+    }
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  function test_node_change(new_value)\n"
+                   "    test_library_function(new_value)\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\">\n"
+                   "      <WATCH>test_node_change(_value)</WATCH>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Trigger Action */
+        apteryx_set ("/test/set_node", "Goodnight moon");
+        sleep (1);
+
+        /* Check output */
+        lua_getglobal (alfred_inst->ls, "test_value");
+        if (!lua_isnil (alfred_inst->ls, -1))
+        {
+            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
+        }
+        lua_pop (alfred_inst->ls, 1);
+
+        g_assert (test_str && strcmp (test_str, "Goodnight moon") == 0);
+        apteryx_set ("/test/set_node", NULL);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.lua");
+    unlink ("alfred_test.xml");
+    free (test_str);
+}
+
+void
+test_native_watch ()
+{
+    FILE *library = NULL;
+    char *test_str = NULL;
+
+    /* Create library file only */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                "function test_node_change(path,value)\n"
+                "  test_value = value\n"
+                "  apteryx.unwatch('/test/set_node', test_node_change)\n"
+                "end\n"
+                "apteryx.watch('/test/set_node', test_node_change)\n"
+                );
+        fclose (library);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Trigger Action */
+        apteryx_set ("/test/set_node", "Goodnight moon");
+        sleep (1);
+
+        /* Check output */
+        lua_getglobal (alfred_inst->ls, "test_value");
+        if (!lua_isnil (alfred_inst->ls, -1))
+        {
+            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
+        }
+        lua_pop (alfred_inst->ls, 1);
+        g_assert (test_str && strcmp (test_str, "Goodnight moon") == 0);
+        apteryx_set ("/test/set_node", NULL);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.lua");
+    free (test_str);
+}
+
+void
+test_dir_watch ()
+{
+    FILE *library = NULL;
+    FILE *data = NULL;
+    char *test_str = NULL;
+    char *test_path = NULL;
+
+    /* Create library file + XML */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                "function test_library_function(p, v)\n"
+                "  test_value = v\n"
+                "  test_path = p\n"
+                "end\n"
+                );
+        fclose (library);
+    }
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  function test_dir_change(path, new_value)\n"
+                   "    test_library_function(path, new_value)\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <WATCH>test_dir_change(_path, _value)</WATCH>\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\"/>\n"
+                   "    <NODE name=\"deeper\">\n"
+                   "      <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the deeper function\"/>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Trigger Action */
+        apteryx_set ("/test/set_node", "Goodnight cow jumping over the moon");
+        sleep (1);
+
+        /* Check output */
+        lua_getglobal (alfred_inst->ls, "test_value");
+        if (!lua_isnil (alfred_inst->ls, -1))
+            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
+        lua_pop (alfred_inst->ls, 1);
+        lua_getglobal (alfred_inst->ls, "test_path");
+        if (!lua_isnil (alfred_inst->ls, -1))
+            test_path = strdup (lua_tostring (alfred_inst->ls, -1));
+        lua_pop (alfred_inst->ls, 1);
+
+        g_assert (test_path && strcmp (test_path, "/test/set_node") == 0);
+        g_assert (test_str && strcmp (test_str, "Goodnight cow jumping over the moon") == 0);
+        free (test_path);
+        free (test_str);
+
+        /* Trigger Action */
+        apteryx_set ("/test/deeper/set_node", "Goodnight bears");
+        sleep (1);
+
+        /* Check output */
+        lua_getglobal (alfred_inst->ls, "test_value");
+        if (!lua_isnil (alfred_inst->ls, -1))
+            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
+        lua_pop (alfred_inst->ls, 1);
+
+        lua_getglobal (alfred_inst->ls, "test_path");
+        if (!lua_isnil (alfred_inst->ls, -1))
+            test_path = strdup (lua_tostring (alfred_inst->ls, -1));
+        lua_pop (alfred_inst->ls, 1);
+
+        g_assert (test_path && strcmp (test_path, "/test/deeper/set_node") == 0);
+        g_assert (test_str && strcmp (test_str, "Goodnight bears") == 0);
+
+        apteryx_set ("/test/set_node", NULL);
+        apteryx_set ("/test/deeper/set_node", NULL);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.lua");
+    unlink ("alfred_test.xml");
+    free (test_str);
+    free (test_path);
+}
+
+void
+test_simple_provide ()
+{
+    FILE *library = NULL;
+    FILE *data = NULL;
+    char *test_str = NULL;
+
+    /* Create library file + XML */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                "function test_library_function(path)\n"
+                "  return \"hello \"..path\n"
+                "end\n"
+                );
+        fclose (library);
+    }
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  function test_provide(path)\n"
+                   "    return test_library_function(path)\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Get this node to test the provide function\">\n"
+                   "      <PROVIDE>return test_provide(_path)</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        sleep (1);
+
+        /* Trigger provide */
+        test_str = apteryx_get ("/test/set_node");
+        g_assert (test_str && strcmp (test_str, "hello /test/set_node") == 0);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.lua");
+    unlink ("alfred_test.xml");
+    free (test_str);
+}
+
+void
+test_native_provide ()
+{
+    FILE *library = NULL;
+    char *test_str = NULL;
+
+    /* Create library file only */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                "function test_node_provide(path)\n"
+                "  apteryx.unprovide('/test/set_node', test_node_provide)\n"
+                "  return \"hello \"..path\n"
+                "end\n"
+                "apteryx.provide('/test/set_node', test_node_provide)\n"
+                );
+        fclose (library);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Trigger provide */
+        test_str = apteryx_get ("/test/set_node");
+        g_assert (test_str && strcmp (test_str, "hello /test/set_node") == 0);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.lua");
+    free (test_str);
+}
+
+void
+test_simple_refresh ()
+{
+    FILE *data = NULL;
+    char *test_str = NULL;
+    GList *paths = NULL;
+
+    /* Create XML */
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  count = 0\n"
+                   "  function test_refresh(path)\n"
+                   "    apteryx.set('/test/eth0/refresh/count', tostring(count))\n"
+                   "    count = count + 1\n"
+                   "    return 500000\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"*\">\n"
+                   "      <NODE name=\"refresh\">\n"
+                   "        <NODE name=\"count\" mode=\"rw\" help=\"Get this node to test the refresh function\" />\n"
+                   "        <REFRESH>return test_refresh(_path)</REFRESH>\n"
+                   "      </NODE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        sleep (1);
+
+        /* Search */
+        paths = apteryx_search ("/test/eth0/refresh/");
+        g_assert (g_list_length (paths) == 1);
+        g_assert (paths && (strcmp ((char *) paths->data, "/test/eth0/refresh/count") == 0));
+        g_list_free_full (paths, free);
+        usleep (500000);
+
+        /* Trigger provide */
+        test_str = apteryx_get ("/test/eth0/refresh/count");
+        g_assert (test_str && strcmp (test_str, "1") == 0);
+        free (test_str);
+        test_str = apteryx_get ("/test/eth0/refresh/count");
+        g_assert (test_str && strcmp (test_str, "1") == 0);
+        free (test_str);
+        usleep (500000);
+        test_str = apteryx_get ("/test/eth0/refresh/count");
+        g_assert (test_str && strcmp (test_str, "2") == 0);
+        free (test_str);
+        apteryx_set ("/test/eth0/refresh/count", NULL);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.xml");
+}
+
+void
+test_native_refresh ()
+{
+    FILE *library = NULL;
+    char *test_str = NULL;
+    GList *paths = NULL;
+
+    /* Create library file only */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                "count = 0\n"
+                "function test_refresh(path)\n"
+                "  if count == 2 then\n"
+                "    apteryx.unrefresh('/test/refresh/*', test_refresh)\n"
+                "  end\n"
+                "  apteryx.set('/test/refresh/count', tostring(count))\n"
+                "  count = count + 1\n"
+                "  return 500000\n"
+                "end\n"
+                "apteryx.refresh('/test/refresh/*', test_refresh)\n"
+                );
+        fclose (library);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Search */
+        paths = apteryx_search ("/test/refresh/");
+        g_assert (g_list_length (paths) == 1);
+        g_assert (paths && (strcmp ((char *) paths->data, "/test/refresh/count") == 0));
+        g_list_free_full (paths, free);
+        usleep (500000);
+
+        /* Get */
+        test_str = apteryx_get ("/test/refresh/count");
+        g_assert (test_str && strcmp (test_str, "1") == 0);
+        free (test_str);
+        test_str = apteryx_get ("/test/refresh/count");
+        g_assert (test_str && strcmp (test_str, "1") == 0);
+        free (test_str);
+        usleep (500000);
+        test_str = apteryx_get ("/test/refresh/count");
+        g_assert (test_str && strcmp (test_str, "2") == 0);
+        free (test_str);
+        apteryx_set ("/test/refresh/count", NULL);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.lua");
+}
+
+void
+test_simple_index ()
+{
+    FILE *library = NULL;
+    FILE *data = NULL;
+    GList *paths = NULL;
+
+    /* Create library file + XML */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+            "function test_library_function()\n"
+            "  return {\"Goodnight light\", \"and the red balloon\"}\n"
+            "end\n"
+            );
+        fclose (library);
+    }
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  function test_index(path)\n"
+                   "    return test_library_function()\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"*\" help=\"Set this node to test the watch function\">\n"
+                   "      <INDEX>return test_index(_path)</INDEX>\n"
+                   "      <NODE name=\"id\" mode=\"rw\"/>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Trigger Action */
+        paths = apteryx_search ("/test/");
+
+        g_assert (g_list_length (paths) == 2);
+        g_assert (paths && (strcmp ((char *) paths->data, "Goodnight light") == 0 ||
+                strcmp ((char *) paths->data, "and the red balloon") == 0));
+        g_assert (paths && paths->next &&
+                (strcmp ((char *) paths->next->data, "and the red balloon") == 0 ||
+                strcmp ((char *) paths->next->data, "Goodnight light") == 0));
+        g_assert (paths && paths->next &&
+                (strcmp ((char *) paths->data, (char *) paths->next->data) != 0));
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+        alfred_inst = NULL;
+    }
+    unlink ("alfred_test.lua");
+    unlink ("alfred_test.xml");
+    if (paths)
+    {
+        g_list_free_full (paths, free);
+    }
+}
+
+void
+test_native_index ()
+{
+    FILE *library = NULL;
+    GList *paths = NULL;
+
+    /* Create library file only */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                "function test_node_index(path)\n"
+                "  apteryx.unindex('/test', test_node_index)\n"
+                "  return {\"Goodnight light\", \"and the red balloon\"}\n"
+                "end\n"
+                "apteryx.index('/test', test_node_index)\n"
+                );
+        fclose (library);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Trigger Action */
+        paths = apteryx_search ("/test/");
+
+        g_assert (g_list_length (paths) == 2);
+        g_assert (paths && (strcmp ((char *) paths->data, "Goodnight light") == 0 ||
+                strcmp ((char *) paths->data, "and the red balloon") == 0));
+        g_assert (paths && paths->next &&
+                (strcmp ((char *) paths->next->data, "and the red balloon") == 0 ||
+                strcmp ((char *) paths->next->data, "Goodnight light") == 0));
+        g_assert (paths && paths->next &&
+                (strcmp ((char *) paths->data, (char *) paths->next->data) != 0));
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+        alfred_inst = NULL;
+    }
+    unlink ("alfred_test.lua");
+    if (paths)
+    {
+        g_list_free_full (paths, free);
+    }
+}
+
+/* Glib unit test */
+void
+test_rate_limit ()
+{
+    FILE *library = NULL;
+    FILE *data = NULL;
+    char *test_str = NULL;
+    lua_Integer test_count;
+
+    apteryx_init (false);
+    /* Create library file + XML */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+            "count = 0\n\n"
+            "function test_library_function(test_str)\n"
+            "  test_value = test_str\n"
+            "  count = count + 1\n"
+            "end\n"
+            );
+        fclose (library);
+    }
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  function test_node_change(new_value)\n"
+                   "    test_library_function(new_value)\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\">\n"
+                   "      <WATCH>Alfred.rate_limit(0.1,'test_node_change(_value)')</WATCH>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Trigger Action */
+        int count = 0;
+
+        while (count < 50)
+        {
+            apteryx_set ("/test/set_node", "Goodnight scoot");
+            count++;
+        }
+
+        sleep (1);
+        /* Check output */
+        lua_getglobal (alfred_inst->ls, "test_value");
+        if (!lua_isnil (alfred_inst->ls, -1))
+        {
+            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
+        }
+        lua_pop (alfred_inst->ls, 1);
+
+        lua_getglobal (alfred_inst->ls, "count");
+        test_count = lua_tointeger(alfred_inst->ls, -1);
+        lua_pop (alfred_inst->ls, 1);
+
+        g_assert (test_str && strcmp (test_str, "Goodnight scoot") == 0);
+        g_assert (test_count < 50);
+        apteryx_set ("/test/set_node", NULL);
+        sleep(1);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.lua");
+    unlink ("alfred_test.xml");
+    free (test_str);
+}
+
+/* Glib unit test */
+void
+test_after_quiet ()
+{
+    FILE *library = NULL;
+    FILE *data = NULL;
+
+    apteryx_init (false);
+    /* Create library file + XML */
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                 "count = 0\n\n"
+                 "function test_library_function(test_str)\n"
+                 "  test_value = test_str\n"
+                 "  count = count + 1\n"
+                 "end\n\n"
+                 "function test_library_function2(...)\n"
+                 "  local args = table.pack(...)\n"
+                 "  test_value = \"CONCATED:\"\n"
+                 "  for i=1, args.n do\n"
+                 "    test_value = test_value .. tostring(args[i])\n"
+                 "  end\n"
+                 "end\n");
+        fclose (library);
+    }
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                    "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                    "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                    "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                    "  <SCRIPT>\n"
+                    "  function test_node_change(new_value)\n"
+                    "    test_library_function(new_value)\n"
+                    "  end\n"
+                    "  </SCRIPT>\n"
+                    "  <NODE name=\"test\">\n"
+                    "    <NODE name=\"set_script_node\" mode=\"rw\">\n"
+                    "      <WATCH>Alfred.after_quiet(0.1, 'test_node_change(_value)')</WATCH>\n"
+                    "    </NODE>\n"
+                    "    <NODE name=\"set_function_node\" mode=\"rw\">\n"
+                    "      <WATCH>Alfred.after_quiet(0.1, test_library_function2)</WATCH>\n"
+                    "    </NODE>\n"
+                    "    <NODE name=\"set_function_arg_node\" mode=\"rw\">\n"
+                    "      <WATCH>Alfred.after_quiet(0.1, test_library_function, _value)</WATCH>\n"
+                    "    </NODE>\n"
+                    "    <NODE name=\"set_function_many_args_node\" mode=\"rw\">\n"
+                    "      <WATCH>Alfred.after_quiet(0.1, test_library_function2, nil, 1, '\\\\2', 3, false, _value, true, nil, 4, '5', 6)</WATCH>\n"
+                    "    </NODE>\n"
+                    "  </NODE>\n"
+                    "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        char *test_str = NULL;
+        lua_Integer test_count;
+        struct {
+            const char *node;
+            const char *check;
+        } tests[4];
+
+        tests[0].node = "/test/set_script_node";
+        tests[0].check = "Goodnight scoot";
+        tests[1].node = "/test/set_function_node";
+        tests[1].check = "CONCATED:";
+        tests[2].node = "/test/set_function_arg_node";
+        tests[2].check = "Goodnight scoot";
+        tests[3].node = "/test/set_function_many_args_node";
+        tests[3].check = "CONCATED:nil1\\23falseGoodnight scoottruenil456";
+
+        for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+        {
+            int count = 0;
+
+            while (count < 50)
+            {
+                apteryx_set (tests[i].node, "Goodnight scoot");
+                count++;
+            }
+
+            sleep (1);
+            /* Check output */
+            lua_getglobal (alfred_inst->ls, "test_value");
+            if (!lua_isnil (alfred_inst->ls, -1))
+            {
+                test_str = strdup (lua_tostring (alfred_inst->ls, -1));
+            }
+            lua_pop (alfred_inst->ls, 1);
+
+            lua_getglobal (alfred_inst->ls, "count");
+            test_count = lua_tointeger(alfred_inst->ls, -1);
+            lua_pop (alfred_inst->ls, 1);
+
+            g_assert (test_str && strcmp (test_str, tests[i].check) == 0);
+            g_assert (test_count == 1);
+
+            /* Reset Lua variables */
+            lua_pushnil(alfred_inst->ls);
+            lua_setglobal(alfred_inst->ls, "test_value");
+            lua_pushinteger (alfred_inst->ls, (lua_Integer)0);
+            lua_setglobal(alfred_inst->ls, "count");
+
+            apteryx_set (tests[i].node, NULL);
+            free (test_str);
+            sleep(1);
+        }
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    unlink ("alfred_test.lua");
+    unlink ("alfred_test.xml");
+}
+
+void
+test_pool_alloc ()
+{
+    FILE *data = NULL;
+    char *test_str = NULL;
+    lua_Integer slabs = 0;
+    bool pool = alfred_lua_pool;
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  function test_node_change(new_value)\n"
+                   "    local t = {}\n"
+                   "    for i = 1, 1000 do t[i] = new_value .. i end\n"
+                   "    test_value = new_value\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\">\n"
+                   "      <WATCH>test_node_change(_value)</WATCH>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init with the pooled allocator */
+    alfred_lua_pool = true;
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        g_assert (alfred_inst->pool != NULL);
+
+        /* Trigger Action */
+        apteryx_set ("/test/set_node", "Goodnight moon");
+        sleep (1);
+
+        /* Check output */
+        lua_getglobal (alfred_inst->ls, "test_value");
+        if (!lua_isnil (alfred_inst->ls, -1))
+        {
+            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
+        }
+        lua_pop (alfred_inst->ls, 1);
+        g_assert (test_str && strcmp (test_str, "Goodnight moon") == 0);
+
+        /* Check stats */
+        g_assert (alfred_exec (alfred_inst->ls, "return Alfred.stats().memory.pool_slabs", 1));
+        slabs = lua_tointeger (alfred_inst->ls, -1);
+        lua_pop (alfred_inst->ls, 1);
+        g_assert (slabs > 0);
+        g_assert (alfred_inst->pool->allocs > 0);
+        apteryx_set ("/test/set_node", NULL);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    alfred_lua_pool = pool;
+    unlink ("alfred_test.xml");
+    free (test_str);
+}
+
+void
+test_idle_gc ()
+{
+    FILE *data = NULL;
+    lua_Integer cycles = 0;
+    bool idle_gc = alfred_idle_gc;
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  function test_node_change(new_value)\n"
+                   "    local t = {}\n"
+                   "    for i = 1, 10000 do t[i] = new_value .. i end\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\">\n"
+                   "      <WATCH>test_node_change(_value)</WATCH>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    /* Init with the collector under alfred's control */
+    alfred_idle_gc = true;
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        /* Make some garbage and give the idle loop a chance to clean it up */
+        apteryx_set ("/test/set_node", "Goodnight moon");
+        sleep (1);
+
+        g_assert (alfred_exec (alfred_inst->ls, "return Alfred.stats().gc.cycles", 1));
+        cycles = lua_tointeger (alfred_inst->ls, -1);
+        lua_pop (alfred_inst->ls, 1);
+        g_assert (cycles > 0);
+        g_assert (!alfred_inst->gc_running);
+        apteryx_set ("/test/set_node", NULL);
+        sleep (1);
+    }
+
+    /* Clean up */
+    if (alfred_inst)
+    {
+        alfred_shutdown ();
+    }
+    alfred_idle_gc = idle_gc;
+    unlink ("alfred_test.xml");
+}
+
+static void
+write_cache_test_files (const char *greeting)
+{
+    FILE *library = NULL;
+    FILE *data = NULL;
+
+    library = fopen ("alfred_test.lua", "w");
+    g_assert (library != NULL);
+    if (library)
+    {
+        fprintf (library,
+                "function test_library_function(path)\n"
+                "  return greeting..\" \"..path\n"
+                "end\n"
+                );
+        fclose (library);
+    }
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  greeting = \"%s\"\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Get this node to test the provide function\">\n"
+                   "      <PROVIDE>return test_library_function(_path)</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n", greeting);
+        fclose (data);
+    }
+}
+
+void
+test_schema_cache ()
+{
+    const char *cache_file = alfred_cache_file;
+    char *test_str = NULL;
+
+    alfred_cache_file = "alfred_test.cache";
+    unlink (alfred_cache_file);
+    write_cache_test_files ("hello");
+
+    /* Cold start writes the cache */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        g_assert (!alfred_inst->cached);
+        test_str = apteryx_get ("/test/set_node");
+        g_assert (test_str && strcmp (test_str, "hello /test/set_node") == 0);
+        free (test_str);
+        alfred_shutdown ();
+    }
+    g_assert (access (alfred_cache_file, F_OK) == 0);
+
+    /* Warm start uses it */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        g_assert (alfred_inst->cached);
+        test_str = apteryx_get ("/test/set_node");
+        g_assert (test_str && strcmp (test_str, "hello /test/set_node") == 0);
+        free (test_str);
+        alfred_shutdown ();
+    }
+
+    /* A changed schema file invalidates it */
+    write_cache_test_files ("goodnight");
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        g_assert (!alfred_inst->cached);
+        test_str = apteryx_get ("/test/set_node");
+        g_assert (test_str && strcmp (test_str, "goodnight /test/set_node") == 0);
+        free (test_str);
+        alfred_shutdown ();
+    }
+
+    /* Clean up */
+    unlink (alfred_cache_file);
+    unlink ("alfred_test.lua");
+    unlink ("alfred_test.xml");
+    alfred_cache_file = cache_file;
+}
+
+void
+test_parallel_load ()
+{
+    const int count = 8;
+    char *filename;
+    char *test_str = NULL;
+    FILE *data = NULL;
+
+    for (int i = 0; i < count; i++)
+    {
+        filename = g_strdup_printf ("alfred_test_%d.xml", i);
+        data = fopen (filename, "w");
+        g_assert (data != NULL);
+        if (data)
+        {
+            fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                       "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                       "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                       "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                       "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                       "  <SCRIPT>\n"
+                       "  load_order = (load_order or \"\")..\"%d\"\n"
+                       "  </SCRIPT>\n"
+                       "  <NODE name=\"test\">\n"
+                       "    <NODE name=\"node%d\" mode=\"r\"  help=\"Get this node to test the provide function\">\n"
+                       "      <PROVIDE>return load_order</PROVIDE>\n"
+                       "    </NODE>\n"
+                       "  </NODE>\n"
+                       "</MODULE>\n", i, i);
+            fclose (data);
+        }
+        g_free (filename);
+    }
+
+    /* Scripts run in file order whichever thread parsed them */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (alfred_inst)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            char *path = g_strdup_printf ("/test/node%d", i);
+            test_str = apteryx_get (path);
+            g_assert (test_str && strcmp (test_str, "01234567") == 0);
+            free (test_str);
+            g_free (path);
+        }
+        alfred_shutdown ();
+    }
+
+    /* Clean up */
+    for (int i = 0; i < count; i++)
+    {
+        filename = g_strdup_printf ("alfred_test_%d.xml", i);
+        unlink (filename);
+        g_free (filename);
+    }
+}
+
+void
+test_hot_reload ()
+{
+    const char *schema = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"r\"  help=\"Get this node to test the provide function\">\n"
+                   "      <PROVIDE>return \"%s\"</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "    <NODE name=\"%s\" mode=\"r\"  help=\"Get this node to test the provide function\">\n"
+                   "      <PROVIDE>return \"%s\"</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n";
+    char *test_str = NULL;
+    FILE *data = NULL;
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, schema, "one", "old_node", "old");
+        fclose (data);
+    }
+
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    test_str = apteryx_get ("/test/old_node");
+    g_assert (test_str && strcmp (test_str, "old") == 0);
+    free (test_str);
+
+    /* Changed body, removed path and added path */
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, schema, "two", "new_node", "new");
+        fclose (data);
+    }
+    g_assert (alfred_reload_module (alfred_inst, "alfred_test.xml"));
+    test_str = apteryx_get ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "two") == 0);
+    free (test_str);
+    test_str = apteryx_get ("/test/new_node");
+    g_assert (test_str && strcmp (test_str, "new") == 0);
+    free (test_str);
+    test_str = apteryx_get ("/test/old_node");
+    g_assert (test_str == NULL);
+    g_assert (g_list_length (alfred_inst->provides) == 2);
+
+    /* Deleted file */
+    unlink ("alfred_test.xml");
+    g_assert (alfred_reload_module (alfred_inst, "alfred_test.xml"));
+    test_str = apteryx_get ("/test/set_node");
+    g_assert (test_str == NULL);
+    g_assert (alfred_inst->provides == NULL);
+    g_assert (alfred_inst->modules == NULL);
+    alfred_shutdown ();
+
+  exit:
+    unlink ("alfred_test.xml");
+}
+
+static bool
+test_global_defined (const char *name)
+{
+    bool defined;
+
+    /* Avoid triggering the lazy loader */
+    lua_pushglobaltable (alfred_inst->ls);
+    lua_pushstring (alfred_inst->ls, name);
+    lua_rawget (alfred_inst->ls, -2);
+    defined = !lua_isnil (alfred_inst->ls, -1);
+    lua_pop (alfred_inst->ls, 2);
+    return defined;
+}
+
+static char *
+test_global_string (const char *name)
+{
+    char *value = NULL;
+
+    lua_getglobal (alfred_inst->ls, name);
+    if (lua_isstring (alfred_inst->ls, -1))
+        value = g_strdup (lua_tostring (alfred_inst->ls, -1));
+    lua_pop (alfred_inst->ls, 1);
+    return value;
+}
+
+void
+test_lazy_load ()
+{
+    const char *header = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n";
+    const char *cache_file = alfred_cache_file;
+    bool lazy = alfred_lazy;
+    char *test_str = NULL;
+    FILE *data = NULL;
+
+    data = fopen ("alfred_test.lua", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "function test_lib_value() return \"library\" end\n");
+        fclose (data);
+    }
+    data = fopen ("alfred_test_0.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "%s"
+                   "  <SCRIPT>\n"
+                   "  function test_lazy_value() return \"lazy\" end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"lazy_node\" mode=\"r\"  help=\"Get this node to test the provide function\">\n"
+                   "      <PROVIDE>test_count = (test_count or 0) + 1 return test_lazy_value()</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n", header);
+        fclose (data);
+    }
+    data = fopen ("alfred_test_1.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "%s"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"lib_node\" mode=\"r\"  help=\"Get this node to test the provide function\">\n"
+                   "      <PROVIDE>return test_lib_value()</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n", header);
+        fclose (data);
+    }
+    data = fopen ("alfred_test_2.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "%s"
+                   "  <SCRIPT>\n"
+                   "  test_side_value = 1\n"
+                   "  apteryx.set(\"/test/lazy_side\", \"set\")\n"
+                   "  </SCRIPT>\n"
+                   "</MODULE>\n", header);
+        fclose (data);
+    }
+
+    alfred_lazy = true;
+    alfred_cache_file = "alfred_test.cache";
+    unlink (alfred_cache_file);
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    g_assert (!alfred_inst->cached && alfred_inst->surveys > 0);
+
+    /* Nothing has run yet, except scripts with side effects */
+    g_assert (!test_global_defined ("test_lib_value"));
+    g_assert (!test_global_defined ("test_lazy_value"));
+    g_assert (test_global_defined ("test_side_value"));
+    test_str = apteryx_get ("/test/lazy_side");
+    g_assert (test_str && strcmp (test_str, "set") == 0);
+    free (test_str);
+    apteryx_set ("/test/lazy_side", NULL);
+
+    /* Only the module that was used is loaded, reading other undefined
+     * globals does not load anything */
+    test_str = apteryx_get ("/test/lazy_node");
+    g_assert (test_str && strcmp (test_str, "lazy") == 0);
+    free (test_str);
+    g_assert (test_global_defined ("test_lazy_value"));
+    g_assert (!test_global_defined ("test_lib_value"));
+
+    /* Library functions are loaded when they are first needed */
+    test_str = apteryx_get ("/test/lib_node");
+    g_assert (test_str && strcmp (test_str, "library") == 0);
+    free (test_str);
+    g_assert (test_global_defined ("test_lib_value"));
+    alfred_shutdown ();
+
+    /* With the schema cache nothing is run again to find the defines */
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    g_assert (alfred_inst->cached && alfred_inst->surveys == 0);
+    g_assert (!test_global_defined ("test_lazy_value"));
+    test_str = apteryx_get ("/test/lazy_node");
+    g_assert (test_str && strcmp (test_str, "lazy") == 0);
+    free (test_str);
+    apteryx_set ("/test/lazy_side", NULL);
+    alfred_shutdown ();
+
+  exit:
+    unlink (alfred_cache_file);
+    unlink ("alfred_test.lua");
+    unlink ("alfred_test_0.xml");
+    unlink ("alfred_test_1.xml");
+    unlink ("alfred_test_2.xml");
+    alfred_cache_file = cache_file;
+    alfred_lazy = lazy;
+}
+
+void
+test_trace_replay ()
+{
+    const char *trace_file = "alfred_test.trace";
+    char *test_str = NULL;
+    FILE *data = NULL;
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  test_watch_count = 0\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\">\n"
+                   "      <WATCH>\n"
+                   "        test_watch_count = test_watch_count + 1\n"
+                   "        apteryx.set(\"/test/replay_out\", _value)\n"
+                   "        Alfred.exec(\"touch alfred_test.out\")\n"
+                   "        os.execute(\"touch alfred_test.out\")\n"
+                   "        local f = io.popen(\"touch alfred_test.out\")\n"
+                   "        test_popen_out = f:read(\"*a\")\n"
+                   "        f:close()\n"
+                   "      </WATCH>\n"
+                   "      <PROVIDE>return tostring(test_watch_count)</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+
+    /* Capture */
+    g_assert (alfred_trace_start (trace_file));
+    watch_node_changed ("/test/set_node", "1");
+    watch_node_changed ("/test/set_node", "2");
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "2") == 0);
+    g_free (test_str);
+    alfred_trace_stop ();
+    alfred_shutdown ();
+    apteryx_set ("/test/replay_out", NULL);
+    unlink ("alfred_test.out");
+
+    /* Replay, without registering or writing to Apteryx */
+    alfred_offline = true;
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    g_assert (alfred_replay (trace_file, true) == 3);
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "2") == 0);
+    g_free (test_str);
+    g_assert (alfred_inst->offline_writes == 2);
+    g_assert (alfred_inst->offline_execs == 6);
+    test_str = test_global_string ("test_popen_out");
+    g_assert (test_str && strcmp (test_str, "") == 0);
+    g_free (test_str);
+    g_assert (access ("alfred_test.out", F_OK) != 0);
+    test_str = apteryx_get ("/test/replay_out");
+    g_assert (test_str == NULL);
+    test_str = apteryx_get ("/test/set_node");
+    g_assert (test_str == NULL);
+    alfred_shutdown ();
+
+  exit:
+    alfred_offline = false;
+    unlink (trace_file);
+    unlink ("alfred_test.out");
+    unlink ("alfred_test.xml");
+}
+
+void
+test_memo_get ()
+{
+    bool memo = alfred_memo;
+    char *test_str = NULL;
+    FILE *data = NULL;
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"memo_node\" mode=\"r\"  help=\"Get this node to test the read cache\">\n"
+                   "      <PROVIDE>\n"
+                   "        local a = apteryx.get(\"/test/value\")\n"
+                   "        local b = apteryx.get(\"/test/value\")\n"
+                   "        apteryx.set(\"/test/value\", \"2\")\n"
+                   "        local c = apteryx.get(\"/test/value\")\n"
+                   "        return a..b..c\n"
+                   "      </PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+    apteryx_set ("/test/value", "1");
+
+    alfred_memo = true;
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+
+    /* The second get is cached, the set invalidates the cache */
+    test_str = provide_node_changed ("/test/memo_node");
+    g_assert (test_str && strcmp (test_str, "112") == 0);
+    g_free (test_str);
+    g_assert (alfred_inst->memo_hits == 1);
+    g_assert (alfred_inst->memo_misses == 2);
+
+    /* Nothing is kept between callbacks */
+    apteryx_set ("/test/value", "3");
+    test_str = provide_node_changed ("/test/memo_node");
+    g_assert (test_str && strcmp (test_str, "332") == 0);
+    g_free (test_str);
+    alfred_shutdown ();
+
+  exit:
+    apteryx_set ("/test/value", NULL);
+    unlink ("alfred_test.xml");
+    alfred_memo = memo;
+}
+
+static int
+test_global_int (const char *name)
+{
+    int value;
+
+    lua_getglobal (alfred_inst->ls, name);
+    value = lua_tointeger (alfred_inst->ls, -1);
+    lua_pop (alfred_inst->ls, 1);
+    return value;
+}
+
+void
+test_index_depends ()
+{
+    GList *paths = NULL;
+    FILE *data = NULL;
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
     {
-        goto error;
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  test_index_runs = 0\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"list\" help=\"Search this node to test the index cache\">\n"
+                   "      <INDEX depends=\"/test/deps/*\">\n"
+                   "        test_index_runs = test_index_runs + 1\n"
+                   "        return {\"/test/list/a\", \"/test/list/b\"}\n"
+                   "      </INDEX>\n"
+                   "      <NODE name=\"*\" mode=\"r\" help=\"List entry\"/>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
     }
 
-    /* Register watches */
-    g_list_foreach (alfred_inst->watches, (GFunc) alfred_register_watches, GINT_TO_POINTER (1));
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    g_assert (g_list_length (alfred_inst->index_deps) == 1);
 
-    /* Register refreshers */
-    g_list_foreach (alfred_inst->refreshers, (GFunc) alfred_register_refresh, GINT_TO_POINTER (1));
+    /* The second search is answered from the cache */
+    for (int i = 0; i < 2; i++)
+    {
+        paths = index_node_changed ("/test/list/");
+        g_assert (g_list_length (paths) == 2);
+        g_assert (strcmp ((char *) paths->data, "/test/list/a") == 0);
+        g_list_free_full (paths, free);
+    }
+    g_assert (test_global_int ("test_index_runs") == 1);
 
-    /* Register provides */
-    g_list_foreach (alfred_inst->provides, (GFunc) alfred_register_provide, GINT_TO_POINTER (1));
+    /* A change to a dependency runs the index again */
+    index_dep_changed ("/test/deps/x", "1");
+    paths = index_node_changed ("/test/list/");
+    g_assert (g_list_length (paths) == 2);
+    g_list_free_full (paths, free);
+    g_assert (test_global_int ("test_index_runs") == 2);
+    alfred_shutdown ();
 
-    /* Register indexes */
-    g_list_foreach (alfred_inst->indexes, (GFunc) alfred_register_index, GINT_TO_POINTER (1));
+  exit:
+    unlink ("alfred_test.xml");
+}
 
-    return;
-error:
-    if (alfred_inst)
+static void
+test_index_check (int size)
+{
+    GList *paths;
+    char *last;
+
+    lua_pushinteger (alfred_inst->ls, size);
+    lua_setglobal (alfred_inst->ls, "test_index_size");
+    paths = index_node_changed ("/test/big/");
+
+    /* Entries are returned in table order */
+    last = g_strdup_printf ("/test/big/%d", size);
+    g_assert (g_list_length (paths) == size);
+    g_assert (strcmp ((char *) g_list_first (paths)->data, "/test/big/1") == 0);
+    g_assert (strcmp ((char *) g_list_last (paths)->data, last) == 0);
+    g_free (last);
+    g_list_free_full (paths, free);
+}
+
+/* Best of three runs, to keep scheduling noise out of the ratio */
+static uint64_t
+test_index_time (int size)
+{
+    uint64_t best = UINT64_MAX;
+
+    for (int i = 0; i < 3; i++)
     {
-        alfred_shutdown ();
+        uint64_t start = get_time_us ();
+        test_index_check (size);
+        start = get_time_us () - start;
+        if (start < best)
+            best = start;
     }
-    return;
+    return best;
 }
 
 void
-test_simple_watch ()
+test_index_scaling ()
 {
-    FILE *library = NULL;
+    GList *paths = NULL;
     FILE *data = NULL;
-    char *test_str = NULL;
+    uint64_t small, large;
 
-    /* Create library file + XML */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
     {
-        fprintf (library,
-                "function test_library_function(test_str)\n"
-                "  test_value = test_str\n"
-                "end\n"
-                );
-        fclose (library);
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"big\" help=\"Search this node to test a large index\">\n"
+                   "      <INDEX>\n"
+                   "        local t = {}\n"
+                   "        for i = 1, test_index_size do t[i] = \"/test/big/\"..i end\n"
+                   "        return t\n"
+                   "      </INDEX>\n"
+                   "      <NODE name=\"*\" mode=\"r\" help=\"List entry\"/>\n"
+                   "    </NODE>\n"
+                   "    <NODE name=\"mixed\" help=\"Search this node to test a mixed index\">\n"
+                   "      <INDEX>\n"
+                   "        return { \"/test/mixed/a\", \"/test/mixed/b\", c = \"/test/mixed/c\" }\n"
+                   "      </INDEX>\n"
+                   "      <NODE name=\"*\" mode=\"r\" help=\"List entry\"/>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
     }
 
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+
+    test_index_check (1);
+    test_index_check (1000);
+
+    /* Eight times the entries should take about eight times as long. A
+     * quadratic conversion would take sixty four times as long.
+     */
+    small = test_index_time (10000);
+    large = test_index_time (80000);
+    g_assert (large < small * 24);
+
+    /* Hash entries follow the array part */
+    paths = index_node_changed ("/test/mixed/");
+    g_assert (g_list_length (paths) == 3);
+    g_assert (strcmp ((char *) g_list_nth_data (paths, 0), "/test/mixed/a") == 0);
+    g_assert (strcmp ((char *) g_list_nth_data (paths, 1), "/test/mixed/b") == 0);
+    g_assert (strcmp ((char *) g_list_nth_data (paths, 2), "/test/mixed/c") == 0);
+    g_list_free_full (paths, free);
+    alfred_shutdown ();
+
+  exit:
+    unlink ("alfred_test.xml");
+}
+
+void
+test_path_keys ()
+{
+    char *test_str = NULL;
+    FILE *data = NULL;
+    uint64_t tables;
+
     data = fopen ("alfred_test.xml", "w");
     g_assert (data != NULL);
     if (data)
@@ -996,122 +6976,240 @@ test_simple_watch ()
                    "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
                    "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
                    "  <SCRIPT>\n"
-                   "  function test_node_change(new_value)\n"
-                   "    test_library_function(new_value)\n"
-                   "  end\n"
+                   "  function test_key() return _keys[1] end\n"
                    "  </SCRIPT>\n"
                    "  <NODE name=\"test\">\n"
-                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\">\n"
-                   "      <WATCH>test_node_change(_value)</WATCH>\n"
+                   "    <NODE name=\"if\" help=\"Interfaces\">\n"
+                   "      <NODE name=\"*\" help=\"Interface\">\n"
+                   "        <NODE name=\"name\" mode=\"r\" help=\"Get this node to test the path keys\">\n"
+                   "          <PROVIDE>return _keys[1]..\":\"..#_keys..\":\"..#_segments..\":\".._segments[2]</PROVIDE>\n"
+                   "        </NODE>\n"
+                   "        <NODE name=\"key\" mode=\"r\" help=\"Key read by a helper function\">\n"
+                   "          <PROVIDE>test_saved = test_saved or _segments return test_key()</PROVIDE>\n"
+                   "        </NODE>\n"
+                   "        <NODE name=\"plain\" mode=\"r\" help=\"Does not read the path keys\">\n"
+                   "          <PROVIDE>return _path</PROVIDE>\n"
+                   "        </NODE>\n"
+                   "      </NODE>\n"
                    "    </NODE>\n"
                    "  </NODE>\n"
                    "</MODULE>\n");
         fclose (data);
     }
 
-    /* Init */
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        /* Trigger Action */
-        apteryx_set ("/test/set_node", "Goodnight moon");
-        sleep (1);
+    if (!alfred_inst)
+        goto exit;
 
-        /* Check output */
-        lua_getglobal (alfred_inst->ls, "test_value");
-        if (!lua_isnil (alfred_inst->ls, -1))
-        {
-            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
-        }
-        lua_pop (alfred_inst->ls, 1);
+    test_str = provide_node_changed ("/test/if/eth0/name");
+    g_assert (test_str && strcmp (test_str, "eth0:1:4:if") == 0);
+    g_free (test_str);
+
+    test_str = provide_node_changed ("/test/if/port1.0.1/name");
+    g_assert (test_str && strcmp (test_str, "port1.0.1:1:4:if") == 0);
+    g_free (test_str);
+
+    /* Set for functions the callback calls, and not changed once kept */
+    test_str = provide_node_changed ("/test/if/eth1/key");
+    g_assert (test_str && strcmp (test_str, "eth1") == 0);
+    g_free (test_str);
+    test_str = provide_node_changed ("/test/if/eth2/key");
+    g_assert (test_str && strcmp (test_str, "eth2") == 0);
+    g_free (test_str);
+    g_assert (alfred_exec (alfred_inst->ls, "return test_saved[3]", 1));
+    g_assert (g_strcmp0 (lua_tostring (alfred_inst->ls, -1), "eth1") == 0);
+    lua_pop (alfred_inst->ls, 1);
 
-        g_assert (test_str && strcmp (test_str, "Goodnight moon") == 0);
-        apteryx_set ("/test/set_node", NULL);
-    }
+    /* Only built when read, and gone once the callback returns */
+    tables = alfred_inst->args_tables;
+    test_str = provide_node_changed ("/test/if/eth3/plain");
+    g_assert (test_str && strcmp (test_str, "/test/if/eth3/plain") == 0);
+    g_free (test_str);
+    g_assert (alfred_inst->args_tables == tables);
+    g_assert (!test_global_defined ("_keys"));
+    g_assert (!test_global_defined ("_segments"));
+    alfred_shutdown ();
 
-    /* Clean up */
-    if (alfred_inst)
-    {
-        alfred_shutdown ();
-    }
-    unlink ("alfred_test.lua");
+  exit:
     unlink ("alfred_test.xml");
-    free (test_str);
 }
 
 void
-test_native_watch ()
+test_watch_coalesce ()
 {
-    FILE *library = NULL;
+    const char *schema = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  test_watch_count = test_watch_count or 0\n"
+                   "  test_watch_value = test_watch_value or \"\"\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test watch coalescing\">\n"
+                   "      <WATCH coalesce=\"100ms\">\n"
+                   "        test_watch_count = test_watch_count + 1\n"
+                   "        test_watch_value = _value..\"%s\"\n"
+                   "      </WATCH>\n"
+                   "      <PROVIDE>return test_watch_count..\":\"..test_watch_value</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n";
+    FILE *data = NULL;
     char *test_str = NULL;
 
-    /* Create library file only */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
     {
-        fprintf (library,
-                "function test_node_change(path,value)\n"
-                "  test_value = value\n"
-                "  apteryx.unwatch('/test/set_node', test_node_change)\n"
-                "end\n"
-                "apteryx.watch('/test/set_node', test_node_change)\n"
-                );
-        fclose (library);
+        fprintf (data, schema, "");
+        fclose (data);
     }
 
-    /* Init */
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        /* Trigger Action */
-        apteryx_set ("/test/set_node", "Goodnight moon");
-        sleep (1);
-
-        /* Check output */
-        lua_getglobal (alfred_inst->ls, "test_value");
-        if (!lua_isnil (alfred_inst->ls, -1))
-        {
-            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
-        }
-        lua_pop (alfred_inst->ls, 1);
-        g_assert (test_str && strcmp (test_str, "Goodnight moon") == 0);
-        apteryx_set ("/test/set_node", NULL);
-    }
+    if (!alfred_inst)
+        goto exit;
 
-    /* Clean up */
-    if (alfred_inst)
+    /* Only the last value is dispatched, once the window closes */
+    watch_node_changed ("/test/set_node", "1");
+    watch_node_changed ("/test/set_node", "2");
+    watch_node_changed ("/test/set_node", "3");
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "0:") == 0);
+    g_free (test_str);
+    g_assert (alfred_inst->coalesced == 2);
+
+    usleep (300000);
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "1:3") == 0);
+    g_free (test_str);
+
+    /* A reload during the window hands the value to the new watch */
+    watch_node_changed ("/test/set_node", "4");
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
     {
-        alfred_shutdown ();
+        fprintf (data, schema, "!");
+        fclose (data);
     }
-    unlink ("alfred_test.lua");
-    free (test_str);
+    g_assert (alfred_reload_module (alfred_inst, "alfred_test.xml"));
+    usleep (300000);
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "2:4!") == 0);
+    g_free (test_str);
+    alfred_shutdown ();
+
+  exit:
+    unlink ("alfred_test.xml");
 }
 
 void
-test_dir_watch ()
+test_watch_tree ()
 {
-    FILE *library = NULL;
     FILE *data = NULL;
     char *test_str = NULL;
-    char *test_path = NULL;
 
-    /* Create library file + XML */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
     {
-        fprintf (library,
-                "function test_library_function(p, v)\n"
-                "  test_value = v\n"
-                "  test_path = p\n"
-                "end\n"
-                );
-        fclose (library);
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  test_watch_count = 0\n"
+                   "  test_watch_value = \"\"\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"tree\" help=\"Set nodes below here to test tree watches\">\n"
+                   "      <NODE name=\"*\" mode=\"rw\" help=\"Any node\">\n"
+                   "        <WATCH tree=\"true\">\n"
+                   "          test_watch_count = test_watch_count + 1\n"
+                   "          local t = _tree.test.tree\n"
+                   "          test_watch_value = t.a..t.b..t.c.d\n"
+                   "        </WATCH>\n"
+                   "      </NODE>\n"
+                   "    </NODE>\n"
+                   "    <NODE name=\"if\" help=\"Interfaces\">\n"
+                   "      <NODE name=\"*\" help=\"Interface\">\n"
+                   "        <NODE name=\"state\" mode=\"rw\" help=\"State\">\n"
+                   "          <WATCH tree=\"true\">test_tree_key = _keys[1]</WATCH>\n"
+                   "        </NODE>\n"
+                   "      </NODE>\n"
+                   "    </NODE>\n"
+                   "    <NODE name=\"result\" mode=\"r\" help=\"Runs and values seen by the tree watch\">\n"
+                   "      <PROVIDE>return test_watch_count..\":\"..test_watch_value</PROVIDE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
     }
 
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    g_assert (alfred_inst->tree_watches != NULL);
+
+    /* One script run for the whole batch, with the latest values. The
+     * batch is delivered here rather than from the main loop thread.
+     */
+    tree_watch_merge (alfred_inst, "/test/tree/a", "1");
+    tree_watch_merge (alfred_inst, "/test/tree/b", "2");
+    tree_watch_merge (alfred_inst, "/test/tree/c/d", "3");
+    tree_watch_merge (alfred_inst, "/test/tree/a", "4");
+    test_str = provide_node_changed ("/test/result");
+    g_assert (test_str && strcmp (test_str, "0:") == 0);
+    g_free (test_str);
+
+    tree_watch_flush (alfred_inst);
+    test_str = provide_node_changed ("/test/result");
+    g_assert (test_str && strcmp (test_str, "1:423") == 0);
+    g_free (test_str);
+    g_assert (alfred_inst->tree_pending == NULL);
+
+    /* _keys come from a changed leaf below the watch */
+    tree_watch_merge (alfred_inst, "/test/if/eth3/state", "up");
+    tree_watch_flush (alfred_inst);
+    test_str = test_global_string ("test_tree_key");
+    g_assert (test_str && strcmp (test_str, "eth3") == 0);
+    g_free (test_str);
+    alfred_shutdown ();
+
+  exit:
+    unlink ("alfred_test.xml");
+}
+
+static alfred_lane_work_t *
+test_lane_work (alfred_lane_type lane, const char *path, const char *script)
+{
+    alfred_lane_work_t *work = g_malloc0 (sizeof (alfred_lane_work_t));
+
+    work->lane = lane;
+    work->queued = get_time_us ();
+    work->path = g_strdup (path);
+    work->value = g_strdup ("1");
+    work->script = g_strdup (script);
+    work->call = LUA_NOREF;
+    return work;
+}
+
+void
+test_priority_lanes ()
+{
+    FILE *data = NULL;
+    char *test_str = NULL;
+    int weight_watch = alfred_lane_weight[ALFRED_LANE_WATCH];
+    int weight_delayed = alfred_lane_weight[ALFRED_LANE_DELAYED];
+    alfred_lane_t *watches;
+    alfred_lane_t *delayed;
+
     data = fopen ("alfred_test.xml", "w");
     g_assert (data != NULL);
     if (data)
@@ -1122,97 +7220,73 @@ test_dir_watch ()
                    "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
                    "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
                    "  <SCRIPT>\n"
-                   "  function test_dir_change(path, new_value)\n"
-                   "    test_library_function(path, new_value)\n"
-                   "  end\n"
+                   "  test_watch_count = 0\n"
+                   "  test_delayed_count = 0\n"
                    "  </SCRIPT>\n"
                    "  <NODE name=\"test\">\n"
-                   "    <WATCH>test_dir_change(_path, _value)</WATCH>\n"
-                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\"/>\n"
-                   "    <NODE name=\"deeper\">\n"
-                   "      <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the deeper function\"/>\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\" help=\"Set this node to test priority lanes\">\n"
+                   "      <WATCH>test_watch_count = test_watch_count + 1</WATCH>\n"
+                   "      <PROVIDE>return test_watch_count..\":\"..test_delayed_count</PROVIDE>\n"
                    "    </NODE>\n"
                    "  </NODE>\n"
                    "</MODULE>\n");
         fclose (data);
     }
 
-    /* Init */
+    alfred_lane_weight[ALFRED_LANE_WATCH] = 2;
+    alfred_lane_weight[ALFRED_LANE_DELAYED] = 1;
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        /* Trigger Action */
-        apteryx_set ("/test/set_node", "Goodnight cow jumping over the moon");
-        sleep (1);
-
-        /* Check output */
-        lua_getglobal (alfred_inst->ls, "test_value");
-        if (!lua_isnil (alfred_inst->ls, -1))
-            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
-        lua_pop (alfred_inst->ls, 1);
-        lua_getglobal (alfred_inst->ls, "test_path");
-        if (!lua_isnil (alfred_inst->ls, -1))
-            test_path = strdup (lua_tostring (alfred_inst->ls, -1));
-        lua_pop (alfred_inst->ls, 1);
-
-        g_assert (test_path && strcmp (test_path, "/test/set_node") == 0);
-        g_assert (test_str && strcmp (test_str, "Goodnight cow jumping over the moon") == 0);
-        free (test_path);
-        free (test_str);
-
-        /* Trigger Action */
-        apteryx_set ("/test/deeper/set_node", "Goodnight bears");
-        sleep (1);
-
-        /* Check output */
-        lua_getglobal (alfred_inst->ls, "test_value");
-        if (!lua_isnil (alfred_inst->ls, -1))
-            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
-        lua_pop (alfred_inst->ls, 1);
-
-        lua_getglobal (alfred_inst->ls, "test_path");
-        if (!lua_isnil (alfred_inst->ls, -1))
-            test_path = strdup (lua_tostring (alfred_inst->ls, -1));
-        lua_pop (alfred_inst->ls, 1);
-
-        g_assert (test_path && strcmp (test_path, "/test/deeper/set_node") == 0);
-        g_assert (test_str && strcmp (test_str, "Goodnight bears") == 0);
-
-        apteryx_set ("/test/set_node", NULL);
-        apteryx_set ("/test/deeper/set_node", NULL);
-    }
+    if (!alfred_inst)
+        goto exit;
+    watches = &alfred_inst->lanes[ALFRED_LANE_WATCH];
+    delayed = &alfred_inst->lanes[ALFRED_LANE_DELAYED];
 
-    /* Clean up */
-    if (alfred_inst)
+    /* Queue directly so the main loop does not dispatch behind our back */
+    for (int i = 0; i < 4; i++)
     {
-        alfred_shutdown ();
+        g_queue_push_tail (&watches->queue,
+                           test_lane_work (ALFRED_LANE_WATCH, "/test/set_node", NULL));
+        g_queue_push_tail (&delayed->queue,
+                           test_lane_work (ALFRED_LANE_DELAYED, NULL,
+                                           "test_delayed_count = test_delayed_count + 1"));
     }
-    unlink ("alfred_test.lua");
+
+    /* Gets do not wait for queued work */
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "0:0") == 0);
+    g_free (test_str);
+
+    /* Each round runs work from both lanes in proportion to their weights */
+    g_assert (alfred_lane_dispatch (alfred_inst));
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "2:1") == 0);
+    g_free (test_str);
+    g_assert (alfred_lane_dispatch (alfred_inst));
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "4:2") == 0);
+    g_free (test_str);
+    while (alfred_lane_dispatch (alfred_inst))
+        ;
+    test_str = provide_node_changed ("/test/set_node");
+    g_assert (test_str && strcmp (test_str, "4:4") == 0);
+    g_free (test_str);
+    g_assert (watches->runs == 4 && delayed->runs == 4);
+    g_assert (g_queue_is_empty (&watches->queue) && g_queue_is_empty (&delayed->queue));
+    alfred_shutdown ();
+
+  exit:
+    alfred_lane_weight[ALFRED_LANE_WATCH] = weight_watch;
+    alfred_lane_weight[ALFRED_LANE_DELAYED] = weight_delayed;
     unlink ("alfred_test.xml");
-    free (test_str);
-    free (test_path);
 }
 
 void
-test_simple_provide ()
+test_shard_filter ()
 {
-    FILE *library = NULL;
     FILE *data = NULL;
-    char *test_str = NULL;
-
-    /* Create library file + XML */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
-    {
-        fprintf (library,
-                "function test_library_function(path)\n"
-                "  return \"hello \"..path\n"
-                "end\n"
-                );
-        fclose (library);
-    }
+    const char *names[] = { "a.xml", "b.xml", "interface.xml", "system.xml.gz", NULL };
+    char shard[16];
 
     data = fopen ("alfred_test.xml", "w");
     g_assert (data != NULL);
@@ -1223,90 +7297,58 @@ test_simple_provide ()
                    "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
                    "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
                    "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
-                   "  <SCRIPT>\n"
-                   "  function test_provide(path)\n"
-                   "    return test_library_function(path)\n"
-                   "  end\n"
-                   "  </SCRIPT>\n"
                    "  <NODE name=\"test\">\n"
-                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Get this node to test the provide function\">\n"
-                   "      <PROVIDE>return test_provide(_path)</PROVIDE>\n"
+                   "    <NODE name=\"set_node\" mode=\"rw\" help=\"Set this node to test sharding\">\n"
+                   "      <WATCH>test_value = _value</WATCH>\n"
                    "    </NODE>\n"
                    "  </NODE>\n"
                    "</MODULE>\n");
         fclose (data);
     }
 
-    /* Init */
-    alfred_init ("./");
-    g_assert (alfred_inst != NULL);
-    if (alfred_inst)
+    /* Every schema file belongs to exactly one shard */
+    for (int i = 0; names[i]; i++)
     {
-        sleep (1);
-
-        /* Trigger provide */
-        test_str = apteryx_get ("/test/set_node");
-        g_assert (test_str && strcmp (test_str, "hello /test/set_node") == 0);
-    }
+        int owners = 0;
 
-    /* Clean up */
-    if (alfred_inst)
-    {
-        alfred_shutdown ();
+        for (int j = 0; j < 3; j++)
+        {
+            sprintf (shard, "%d/3", j);
+            alfred_shard = shard;
+            owners += alfred_shard_owns (names[i]);
+        }
+        g_assert (owners == 1);
     }
-    unlink ("alfred_test.lua");
-    unlink ("alfred_test.xml");
-    free (test_str);
-}
 
-void
-test_native_provide ()
-{
-    FILE *library = NULL;
-    char *test_str = NULL;
-
-    /* Create library file only */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
-    {
-        fprintf (library,
-                "function test_node_provide(path)\n"
-                "  apteryx.unprovide('/test/set_node', test_node_provide)\n"
-                "  return \"hello \"..path\n"
-                "end\n"
-                "apteryx.provide('/test/set_node', test_node_provide)\n"
-                );
-        fclose (library);
-    }
+    /* A worker only runs its own schema files */
+    alfred_shard = "alfred_other.xml";
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    g_assert (alfred_inst->watches == NULL);
+    alfred_shutdown ();
 
-    /* Init */
+    alfred_shard = "alfred_test.xml";
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        /* Trigger provide */
-        test_str = apteryx_get ("/test/set_node");
-        g_assert (test_str && strcmp (test_str, "hello /test/set_node") == 0);
-    }
+    if (!alfred_inst)
+        goto exit;
+    g_assert (alfred_inst->watches != NULL);
+    alfred_shutdown ();
 
-    /* Clean up */
-    if (alfred_inst)
-    {
-        alfred_shutdown ();
-    }
-    unlink ("alfred_test.lua");
-    free (test_str);
+  exit:
+    alfred_shard = NULL;
+    unlink ("alfred_test.xml");
 }
 
+#ifdef HAVE_LUAJIT
 void
-test_simple_refresh ()
+test_luajit_ffi ()
 {
     FILE *data = NULL;
     char *test_str = NULL;
-    GList *paths = NULL;
 
-    /* Create XML */
     data = fopen ("alfred_test.xml", "w");
     g_assert (data != NULL);
     if (data)
@@ -1316,142 +7358,110 @@ test_simple_refresh ()
                    "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
                    "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
                    "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
-                   "  <SCRIPT>\n"
-                   "  count = 0\n"
-                   "  function test_refresh(path)\n"
-                   "    apteryx.set('/test/eth0/refresh/count', tostring(count))\n"
-                   "    count = count + 1\n"
-                   "    return 500000\n"
-                   "  end\n"
-                   "  </SCRIPT>\n"
                    "  <NODE name=\"test\">\n"
-                   "    <NODE name=\"*\">\n"
-                   "      <NODE name=\"refresh\">\n"
-                   "        <NODE name=\"count\" mode=\"rw\" help=\"Get this node to test the refresh function\" />\n"
-                   "        <REFRESH>return test_refresh(_path)</REFRESH>\n"
-                   "      </NODE>\n"
+                   "    <NODE name=\"ffi\" mode=\"rw\" help=\"Round trip through the FFI\">\n"
+                   "      <PROVIDE>\n"
+                   "        apteryx.set('/test/ffi_value', 'jit')\n"
+                   "        local value = apteryx.get('/test/ffi_value')\n"
+                   "        apteryx.set('/test/ffi_value', nil)\n"
+                   "        return value..':'..tostring(apteryx.get('/test/ffi_value'))\n"
+                   "      </PROVIDE>\n"
                    "    </NODE>\n"
                    "  </NODE>\n"
                    "</MODULE>\n");
         fclose (data);
     }
 
-    /* Init */
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        sleep (1);
-
-        /* Search */
-        paths = apteryx_search ("/test/eth0/refresh/");
-        g_assert (g_list_length (paths) == 1);
-        g_assert (paths && (strcmp ((char *) paths->data, "/test/eth0/refresh/count") == 0));
-        g_list_free_full (paths, free);
-        usleep (500000);
-
-        /* Trigger provide */
-        test_str = apteryx_get ("/test/eth0/refresh/count");
-        g_assert (test_str && strcmp (test_str, "1") == 0);
-        free (test_str);
-        test_str = apteryx_get ("/test/eth0/refresh/count");
-        g_assert (test_str && strcmp (test_str, "1") == 0);
-        free (test_str);
-        usleep (500000);
-        test_str = apteryx_get ("/test/eth0/refresh/count");
-        g_assert (test_str && strcmp (test_str, "2") == 0);
-        free (test_str);
-        apteryx_set ("/test/eth0/refresh/count", NULL);
-    }
+    if (!alfred_inst)
+        goto exit;
+    g_assert (test_global_defined ("jit"));
+    test_str = provide_node_changed ("/test/ffi");
+    g_assert (test_str && strcmp (test_str, "jit:nil") == 0);
+    g_free (test_str);
+    alfred_shutdown ();
 
-    /* Clean up */
-    if (alfred_inst)
-    {
-        alfred_shutdown ();
-    }
+  exit:
     unlink ("alfred_test.xml");
 }
+#endif
+
+static void
+test_write_bytecode (const char *filename, const char *script)
+{
+    GByteArray *code = g_byte_array_new ();
+    lua_State *ls = luaL_newstate ();
+
+    g_assert (luaL_loadstring (ls, script) == 0);
+    g_assert (alfred_dump (ls, alfred_dump_writer, code) == 0);
+    g_assert (g_file_set_contents (filename, (const gchar *) code->data, code->len, NULL));
+    lua_close (ls);
+    g_byte_array_free (code, true);
+}
 
 void
-test_native_refresh ()
+test_bytecode_library ()
 {
     FILE *library = NULL;
     char *test_str = NULL;
-    GList *paths = NULL;
+    const char bad[] = "\033Lua\001 not for this build";
 
-    /* Create library file only */
     library = fopen ("alfred_test.lua", "w");
     g_assert (library != NULL);
     if (library)
     {
-        fprintf (library,
-                "count = 0\n"
-                "function test_refresh(path)\n"
-                "  if count == 2 then\n"
-                "    apteryx.unrefresh('/test/refresh/*', test_refresh)\n"
-                "  end\n"
-                "  apteryx.set('/test/refresh/count', tostring(count))\n"
-                "  count = count + 1\n"
-                "  return 500000\n"
-                "end\n"
-                "apteryx.refresh('/test/refresh/*', test_refresh)\n"
-                );
+        fprintf (library, "test_loaded_from = 'source'\n");
         fclose (library);
     }
+    test_write_bytecode ("alfred_test.luac", "test_loaded_from = 'bytecode'");
 
-    /* Init */
+    /* The bytecode replaces the source */
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        /* Search */
-        paths = apteryx_search ("/test/refresh/");
-        g_assert (g_list_length (paths) == 1);
-        g_assert (paths && (strcmp ((char *) paths->data, "/test/refresh/count") == 0));
-        g_list_free_full (paths, free);
-        usleep (500000);
-
-        /* Get */
-        test_str = apteryx_get ("/test/refresh/count");
-        g_assert (test_str && strcmp (test_str, "1") == 0);
-        free (test_str);
-        test_str = apteryx_get ("/test/refresh/count");
-        g_assert (test_str && strcmp (test_str, "1") == 0);
-        free (test_str);
-        usleep (500000);
-        test_str = apteryx_get ("/test/refresh/count");
-        g_assert (test_str && strcmp (test_str, "2") == 0);
-        free (test_str);
-        apteryx_set ("/test/refresh/count", NULL);
-    }
+    if (!alfred_inst)
+        goto exit;
+    g_assert (g_list_length (alfred_inst->modules) == 1);
+    test_str = test_global_string ("test_loaded_from");
+    g_assert (test_str && strcmp (test_str, "bytecode") == 0);
+    g_free (test_str);
+    alfred_shutdown ();
+
+    /* Bytecode for a different Lua falls back to the source */
+    g_assert (g_file_set_contents ("alfred_test.luac", bad, sizeof (bad), NULL));
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    test_str = test_global_string ("test_loaded_from");
+    g_assert (test_str && strcmp (test_str, "source") == 0);
+    g_free (test_str);
+    alfred_shutdown ();
 
-    /* Clean up */
-    if (alfred_inst)
-    {
-        alfred_shutdown ();
-    }
+  exit:
     unlink ("alfred_test.lua");
+    unlink ("alfred_test.luac");
 }
 
 void
-test_simple_index ()
+test_lazy_api ()
 {
-    FILE *library = NULL;
+    const char *lua_path = getenv ("LUA_PATH");
+    char *saved_path = lua_path ? g_strdup (lua_path) : NULL;
     FILE *data = NULL;
-    GList *paths = NULL;
+    char *test_str = NULL;
 
-    /* Create library file + XML */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
+    /* An api module that require can find */
+    mkdir ("alfred_test_api", 0755);
+    data = fopen ("alfred_test_api/api.lua", "w");
+    g_assert (data != NULL);
+    if (data)
     {
-        fprintf (library,
-            "function test_library_function()\n"
-            "  return {\"Goodnight light\", \"and the red balloon\"}\n"
-            "end\n"
-            );
-        fclose (library);
+        fprintf (data, "api = { answer = 42 }\n"
+                       "return api\n");
+        fclose (data);
     }
+    setenv ("LUA_PATH", "./alfred_test_api/?.lua;;", 1);
 
     data = fopen ("alfred_test.xml", "w");
     g_assert (data != NULL);
@@ -1462,129 +7472,114 @@ test_simple_index ()
                    "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
                    "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
                    "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
-                   "  <SCRIPT>\n"
-                   "  function test_index(path)\n"
-                   "    return test_library_function()\n"
-                   "  end\n"
-                   "  </SCRIPT>\n"
                    "  <NODE name=\"test\">\n"
-                   "    <NODE name=\"*\" help=\"Set this node to test the watch function\">\n"
-                   "      <INDEX>return test_index(_path)</INDEX>\n"
-                   "      <NODE name=\"id\" mode=\"rw\"/>\n"
+                   "    <NODE name=\"api\" mode=\"r\" help=\"Read a field of the api module\">\n"
+                   "      <PROVIDE>return tostring(api.answer)</PROVIDE>\n"
                    "    </NODE>\n"
                    "  </NODE>\n"
                    "</MODULE>\n");
         fclose (data);
     }
 
-    /* Init */
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        /* Trigger Action */
-        paths = apteryx_search ("/test/");
+    if (!alfred_inst)
+        goto exit;
 
-        g_assert (g_list_length (paths) == 2);
-        g_assert (paths && (strcmp ((char *) paths->data, "Goodnight light") == 0 ||
-                strcmp ((char *) paths->data, "and the red balloon") == 0));
-        g_assert (paths && paths->next &&
-                (strcmp ((char *) paths->next->data, "and the red balloon") == 0 ||
-                strcmp ((char *) paths->next->data, "Goodnight light") == 0));
-        g_assert (paths && paths->next &&
-                (strcmp ((char *) paths->data, (char *) paths->next->data) != 0));
-    }
+    /* Nothing has used api, so the module has not been loaded */
+    g_assert (test_global_defined ("api"));
+    g_assert (luaL_dostring (alfred_inst->ls, "assert (package.loaded.api == nil)") == 0);
+    g_assert (alfred_inst->api_ref == LUA_NOREF);
+
+    /* First use loads it and replaces the stub */
+    test_str = provide_node_changed ("/test/api");
+    g_assert (test_str && strcmp (test_str, "42") == 0);
+    g_free (test_str);
+    g_assert (alfred_inst->api_ref != LUA_NOREF);
+    g_assert (luaL_dostring (alfred_inst->ls,
+                             "assert (getmetatable (api) == nil and api.answer == 42)") == 0);
+
+    /* Without a module to find, no stub is installed */
+    g_assert (luaL_dostring (alfred_inst->ls,
+                             "package.preload.api = nil\n"
+                             "package.path = './alfred_test_none/?.lua'\n"
+                             "package.cpath = ''\n") == 0);
+    g_assert (!alfred_api_available (alfred_inst->ls));
+    alfred_shutdown ();
 
-    /* Clean up */
-    if (alfred_inst)
-    {
-        alfred_shutdown ();
-        alfred_inst = NULL;
-    }
-    unlink ("alfred_test.lua");
+  exit:
+    if (saved_path)
+        setenv ("LUA_PATH", saved_path, 1);
+    else
+        unsetenv ("LUA_PATH");
+    g_free (saved_path);
+    unlink ("alfred_test_api/api.lua");
+    rmdir ("alfred_test_api");
     unlink ("alfred_test.xml");
-    if (paths)
-    {
-        g_list_free_full (paths, free);
-    }
 }
 
 void
-test_native_index ()
+test_exec_helper ()
 {
-    FILE *library = NULL;
-    GList *paths = NULL;
+    FILE *data = NULL;
+    char *test_str = NULL;
 
-    /* Create library file only */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
     {
-        fprintf (library,
-                "function test_node_index(path)\n"
-                "  apteryx.unindex('/test', test_node_index)\n"
-                "  return {\"Goodnight light\", \"and the red balloon\"}\n"
-                "end\n"
-                "apteryx.index('/test', test_node_index)\n"
-                );
-        fclose (library);
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"exec\" mode=\"r\" help=\"Run a command through the helpers\">\n"
+                   "      <PROVIDE>\n"
+                   "        local out, status = Alfred.exec('echo hello')\n"
+                   "        local _, failed = Alfred.exec('exit 3')\n"
+                   "        return out..status..':'..failed\n"
+                   "      </PROVIDE>\n"
+                   "    </NODE>\n"
+                   "    <NODE name=\"exec_async\" mode=\"w\" help=\"Run a command and call back\">\n"
+                   "      <WATCH>\n"
+                   "        Alfred.exec('echo '.._value, function (out, status)\n"
+                   "          test_exec_result = out\n"
+                   "        end)\n"
+                   "      </WATCH>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
     }
 
-    /* Init */
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        /* Trigger Action */
-        paths = apteryx_search ("/test/");
+    if (!alfred_inst)
+        goto exit;
+    g_assert (alfred_num_helpers > 0);
 
-        g_assert (g_list_length (paths) == 2);
-        g_assert (paths && (strcmp ((char *) paths->data, "Goodnight light") == 0 ||
-                strcmp ((char *) paths->data, "and the red balloon") == 0));
-        g_assert (paths && paths->next &&
-                (strcmp ((char *) paths->next->data, "and the red balloon") == 0 ||
-                strcmp ((char *) paths->next->data, "Goodnight light") == 0));
-        g_assert (paths && paths->next &&
-                (strcmp ((char *) paths->data, (char *) paths->next->data) != 0));
-    }
+    test_str = provide_node_changed ("/test/exec");
+    g_assert (test_str && strcmp (test_str, "hello\n0:3") == 0);
+    g_free (test_str);
 
-    /* Clean up */
-    if (alfred_inst)
-    {
-        alfred_shutdown ();
-        alfred_inst = NULL;
-    }
-    unlink ("alfred_test.lua");
-    if (paths)
-    {
-        g_list_free_full (paths, free);
-    }
+    /* The main loop delivers the output */
+    watch_node_changed ("/test/exec_async", "later");
+    sleep (1);
+    test_str = test_global_string ("test_exec_result");
+    g_assert (test_str && strcmp (test_str, "later\n") == 0);
+    g_free (test_str);
+    alfred_shutdown ();
+
+  exit:
+    unlink ("alfred_test.xml");
 }
 
-/* Glib unit test */
 void
-test_rate_limit ()
+test_refresh_adaptive ()
 {
-    FILE *library = NULL;
     FILE *data = NULL;
-    char *test_str = NULL;
-    lua_Integer test_count;
-
-    apteryx_init (false);
-    /* Create library file + XML */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
-    {
-        fprintf (library,
-            "count = 0\n\n"
-            "function test_library_function(test_str)\n"
-            "  test_value = test_str\n"
-            "  count = count + 1\n"
-            "end\n"
-            );
-        fclose (library);
-    }
+    uint64_t timeout;
 
     data = fopen ("alfred_test.xml", "w");
     g_assert (data != NULL);
@@ -1595,205 +7590,339 @@ test_rate_limit ()
                    "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
                    "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
                    "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
-                   "  <SCRIPT>\n"
-                   "  function test_node_change(new_value)\n"
-                   "    test_library_function(new_value)\n"
-                   "  end\n"
-                   "  </SCRIPT>\n"
                    "  <NODE name=\"test\">\n"
-                   "    <NODE name=\"set_node\" mode=\"rw\"  help=\"Set this node to test the watch function\">\n"
-                   "      <WATCH>Alfred.rate_limit(0.1,'test_node_change(_value)')</WATCH>\n"
+                   "    <NODE name=\"state\" help=\"Refreshed when read\">\n"
+                   "      <REFRESH min=\"10ms\" max=\"1s\">return 100000</REFRESH>\n"
+                   "      <NODE name=\"*\" mode=\"r\" help=\"Any node\"/>\n"
                    "    </NODE>\n"
                    "  </NODE>\n"
                    "</MODULE>\n");
         fclose (data);
     }
 
-    /* Init */
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        /* Trigger Action */
-        int count = 0;
-
-        while (count < 50)
-        {
-            apteryx_set ("/test/set_node", "Goodnight scoot");
-            count++;
-        }
-
-        sleep (1);
-        /* Check output */
-        lua_getglobal (alfred_inst->ls, "test_value");
-        if (!lua_isnil (alfred_inst->ls, -1))
-        {
-            test_str = strdup (lua_tostring (alfred_inst->ls, -1));
-        }
-        lua_pop (alfred_inst->ls, 1);
-
-        lua_getglobal (alfred_inst->ls, "count");
-        test_count = lua_tointeger(alfred_inst->ls, -1);
-        lua_pop (alfred_inst->ls, 1);
+    if (!alfred_inst)
+        goto exit;
 
-        g_assert (test_str && strcmp (test_str, "Goodnight scoot") == 0);
-        g_assert (test_count < 50);
-        apteryx_set ("/test/set_node", NULL);
-        sleep(1);
-    }
+    /* Nothing known yet, so the script's timeout */
+    timeout = refresh_node_changed ("/test/state/a");
+    g_assert (timeout == 100000);
 
-    /* Clean up */
-    if (alfred_inst)
+    /* A hot path is read as soon as each timeout expires, as apteryxd
+     * calls the refresher then. The timeout shrinks, but not below min.
+     */
+    usleep (timeout);
+    timeout = refresh_node_changed ("/test/state/a");
+    g_assert (timeout == 50000);
+    usleep (timeout);
+    timeout = refresh_node_changed ("/test/state/a");
+    g_assert (timeout == 25000);
+    for (int i = 0; i < 3; i++)
     {
-        alfred_shutdown ();
+        usleep (timeout);
+        timeout = refresh_node_changed ("/test/state/a");
     }
-    unlink ("alfred_test.lua");
+    g_assert (timeout == 10000);
+
+    /* A cold path is read long after each timeout expires. The timeout
+     * grows, so fewer reads need a refresh.
+     */
+    timeout = refresh_node_changed ("/test/state/b");
+    g_assert (timeout == 100000);
+    usleep (300000);
+    timeout = refresh_node_changed ("/test/state/b");
+    g_assert (timeout == 200000);
+    usleep (500000);
+    timeout = refresh_node_changed ("/test/state/b");
+    g_assert (timeout == 400000);
+
+    /* Read neither soon nor long after, the timeout is kept */
+    timeout = refresh_node_changed ("/test/state/c");
+    g_assert (timeout == 100000);
+    usleep (150000);
+    timeout = refresh_node_changed ("/test/state/c");
+    g_assert (timeout == 100000);
+    alfred_shutdown ();
+
+  exit:
     unlink ("alfred_test.xml");
-    free (test_str);
 }
 
-/* Glib unit test */
 void
-test_after_quiet ()
+test_provide_prefetch ()
 {
-    FILE *library = NULL;
     FILE *data = NULL;
-
-    apteryx_init (false);
-    /* Create library file + XML */
-    library = fopen ("alfred_test.lua", "w");
-    g_assert (library != NULL);
-    if (library)
-    {
-        fprintf (library,
-                 "count = 0\n\n"
-                 "function test_library_function(test_str)\n"
-                 "  test_value = test_str\n"
-                 "  count = count + 1\n"
-                 "end\n\n"
-                 "function test_library_function2(...)\n"
-                 "  local args = table.pack(...)\n"
-                 "  test_value = \"CONCATED:\"\n"
-                 "  for i=1, args.n do\n"
-                 "    test_value = test_value .. tostring(args[i])\n"
-                 "  end\n"
-                 "end\n");
-        fclose (library);
-    }
+    char *test_str = NULL;
 
     data = fopen ("alfred_test.xml", "w");
     g_assert (data != NULL);
     if (data)
     {
         fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-                    "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
-                    "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
-                    "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
-                    "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
-                    "  <SCRIPT>\n"
-                    "  function test_node_change(new_value)\n"
-                    "    test_library_function(new_value)\n"
-                    "  end\n"
-                    "  </SCRIPT>\n"
-                    "  <NODE name=\"test\">\n"
-                    "    <NODE name=\"set_script_node\" mode=\"rw\">\n"
-                    "      <WATCH>Alfred.after_quiet(0.1, 'test_node_change(_value)')</WATCH>\n"
-                    "    </NODE>\n"
-                    "    <NODE name=\"set_function_node\" mode=\"rw\">\n"
-                    "      <WATCH>Alfred.after_quiet(0.1, test_library_function2)</WATCH>\n"
-                    "    </NODE>\n"
-                    "    <NODE name=\"set_function_arg_node\" mode=\"rw\">\n"
-                    "      <WATCH>Alfred.after_quiet(0.1, test_library_function, _value)</WATCH>\n"
-                    "    </NODE>\n"
-                    "    <NODE name=\"set_function_many_args_node\" mode=\"rw\">\n"
-                    "      <WATCH>Alfred.after_quiet(0.1, test_library_function2, nil, 1, '\\\\2', 3, false, _value, true, nil, 4, '5', 6)</WATCH>\n"
-                    "    </NODE>\n"
-                    "  </NODE>\n"
-                    "</MODULE>\n");
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  test_prefetch_count = 0\n"
+                   "  function test_rows_prefetch(path)\n"
+                   "    test_prefetch_count = test_prefetch_count + 1\n"
+                   "    return { ['/test/rows/a/counter'] = test_prefetch_count,\n"
+                   "             ['/test/rows/b/counter'] = 'b' }\n"
+                   "  end\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"rows\" help=\"Rows answered from one prefetch\">\n"
+                   "      <NODE name=\"*\" help=\"Any row\">\n"
+                   "        <NODE name=\"counter\" mode=\"r\" help=\"Counter\">\n"
+                   "          <PROVIDE prefetch=\"test_rows_prefetch\" ttl=\"50ms\">return 'script'</PROVIDE>\n"
+                   "        </NODE>\n"
+                   "      </NODE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
+
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+
+    /* One call to the prefetch function answers every sibling */
+    test_str = provide_node_changed ("/test/rows/a/counter");
+    g_assert (test_str && strcmp (test_str, "1") == 0);
+    g_free (test_str);
+    test_str = provide_node_changed ("/test/rows/b/counter");
+    g_assert (test_str && strcmp (test_str, "b") == 0);
+    g_free (test_str);
+    g_assert (test_global_int ("test_prefetch_count") == 1);
+
+    /* Paths the function did not return fall back to the script */
+    test_str = provide_node_changed ("/test/rows/c/counter");
+    g_assert (test_str && strcmp (test_str, "script") == 0);
+    g_free (test_str);
+    g_assert (test_global_int ("test_prefetch_count") == 1);
+    g_assert (alfred_inst->prefetch_hits == 2);
+
+    /* Until the values expire */
+    usleep (60000);
+    test_str = provide_node_changed ("/test/rows/a/counter");
+    g_assert (test_str && strcmp (test_str, "2") == 0);
+    g_free (test_str);
+    g_assert (test_global_int ("test_prefetch_count") == 2);
+    alfred_shutdown ();
+
+  exit:
+    unlink ("alfred_test.xml");
+}
+
+void
+test_validate_native ()
+{
+    FILE *data = NULL;
+
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  test_validate_count = 0\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"mode\" mode=\"rw\" help=\"One of the values\">\n"
+                   "      <VALUE name=\"up\" value=\"1\" help=\"Up\"/>\n"
+                   "      <VALUE name=\"down\" value=\"0\" help=\"Down\"/>\n"
+                   "    </NODE>\n"
+                   "    <NODE name=\"name\" mode=\"rw\" help=\"Lower case\" pattern=\"[a-z]+\"/>\n"
+                   "    <NODE name=\"count\" mode=\"rw\" help=\"Any number\" pattern=\"[0-9]+\"/>\n"
+                   "    <NODE name=\"port\" mode=\"rw\" help=\"Port number\" pattern=\"[0-9]+\">\n"
+                   "      <VALIDATE>\n"
+                   "        test_validate_count = test_validate_count + 1\n"
+                   "        return tonumber(_value) &lt; 65536\n"
+                   "      </VALIDATE>\n"
+                   "    </NODE>\n"
+                   "    <NODE name=\"list\" help=\"List with a key pattern\">\n"
+                   "      <NODE name=\"*\" help=\"Interface\" pattern=\"eth[0-9]+\">\n"
+                   "        <NODE name=\"mtu\" mode=\"rw\" help=\"MTU\" pattern=\"[0-9]+\"/>\n"
+                   "        <NODE name=\"name\" mode=\"rw\" help=\"Name\"/>\n"
+                   "        <NODE name=\"outer\" help=\"Nested\" pattern=\"x\">\n"
+                   "          <NODE name=\"inner\" mode=\"rw\" help=\"Inner\" pattern=\"[a-z]\"/>\n"
+                   "        </NODE>\n"
+                   "      </NODE>\n"
+                   "    </NODE>\n"
+                   "    <NODE name=\"ports\" help=\"Leaf list\">\n"
+                   "      <NODE name=\"*\" mode=\"rw\" help=\"Any port\" pattern=\"[0-9]+\"/>\n"
+                   "      <NODE name=\"http\" mode=\"rw\" help=\"Web port\" pattern=\"80|8080\"/>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
         fclose (data);
     }
 
-    /* Init */
+    /* Without -v only the VALIDATE script is registered */
     alfred_init ("./");
     g_assert (alfred_inst != NULL);
-    if (alfred_inst)
-    {
-        char *test_str = NULL;
-        lua_Integer test_count;
-        struct {
-            const char *node;
-            const char *check;
-        } tests[4];
+    if (!alfred_inst)
+        goto exit;
+    g_assert (g_list_length (alfred_inst->validates) == 1);
+    g_assert (validate_node_changed ("/test/port", "80") == 0);
+    g_assert (test_global_int ("test_validate_count") == 1);
+    alfred_shutdown ();
 
-        tests[0].node = "/test/set_script_node";
-        tests[0].check = "Goodnight scoot";
-        tests[1].node = "/test/set_function_node";
-        tests[1].check = "CONCATED:";
-        tests[2].node = "/test/set_function_arg_node";
-        tests[2].check = "Goodnight scoot";
-        tests[3].node = "/test/set_function_many_args_node";
-        tests[3].check = "CONCATED:nil1\\23falseGoodnight scoottruenil456";
+    alfred_native_validate = true;
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    g_assert (g_list_length (alfred_inst->validates) == 8);
+
+    /* VALUE lists, and deletes are always allowed */
+    g_assert (validate_node_changed ("/test/mode", "1") == 0);
+    g_assert (validate_node_changed ("/test/mode", "2") == -EINVAL);
+    g_assert (validate_node_changed ("/test/mode", NULL) == 0);
+
+    /* Patterns match the whole value, and are compiled once */
+    g_assert (validate_node_changed ("/test/name", "abc") == 0);
+    g_assert (validate_node_changed ("/test/name", "abc1") == -EINVAL);
+    g_assert (validate_node_changed ("/test/count", "12") == 0);
+    g_assert (g_hash_table_size (alfred_inst->regexes) == 4);
+
+    /* The script only runs once the native checks pass */
+    g_assert (validate_node_changed ("/test/port", "http") == -EINVAL);
+    g_assert (test_global_int ("test_validate_count") == 0);
+    g_assert (validate_node_changed ("/test/port", "80") == 0);
+    g_assert (validate_node_changed ("/test/port", "70000") == -EINVAL);
+    g_assert (test_global_int ("test_validate_count") == 2);
+
+    /* Key patterns do not apply to the leaves below a list entry */
+    g_assert (validate_node_changed ("/test/list/eth0/mtu", "1500") == 0);
+    g_assert (validate_node_changed ("/test/list/eth0/mtu", "big") == -EINVAL);
+    g_assert (validate_node_changed ("/test/list/eth0/outer/inner", "a") == 0);
+    g_assert (validate_node_changed ("/test/list/eth0/outer/inner", "ab") == -EINVAL);
+
+    /* Every leaf that matches the path checks the value */
+    g_assert (validate_node_changed ("/test/ports/ssh", "22") == 0);
+    g_assert (validate_node_changed ("/test/ports/http", "8080") == 0);
+    g_assert (validate_node_changed ("/test/ports/http", "443") == -EINVAL);
+    g_assert (validate_node_changed ("/test/ports/http", "web") == -EINVAL);
+    alfred_shutdown ();
 
-        for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
-        {
-            int count = 0;
+  exit:
+    alfred_native_validate = false;
+    unlink ("alfred_test.xml");
+}
 
-            while (count < 50)
-            {
-                apteryx_set (tests[i].node, "Goodnight scoot");
-                count++;
-            }
+static gint test_loop_blocked;
 
-            sleep (1);
-            /* Check output */
-            lua_getglobal (alfred_inst->ls, "test_value");
-            if (!lua_isnil (alfred_inst->ls, -1))
-            {
-                test_str = strdup (lua_tostring (alfred_inst->ls, -1));
-            }
-            lua_pop (alfred_inst->ls, 1);
+/* Hold up the main loop so apteryx callbacks queue behind it */
+static gboolean
+test_block_loop (gpointer data)
+{
+    g_atomic_int_set (&test_loop_blocked, 1);
+    usleep (500000);
+    g_atomic_int_set (&test_loop_blocked, 0);
+    return false;
+}
 
-            lua_getglobal (alfred_inst->ls, "count");
-            test_count = lua_tointeger(alfred_inst->ls, -1);
-            lua_pop (alfred_inst->ls, 1);
+void
+test_process_batch ()
+{
+    FILE *data = NULL;
+    uint64_t events;
+    uint64_t wakeups;
+    char path[64];
 
-            g_assert (test_str && strcmp (test_str, tests[i].check) == 0);
-            g_assert (test_count == 1);
+    data = fopen ("alfred_test.xml", "w");
+    g_assert (data != NULL);
+    if (data)
+    {
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                   "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                   "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                   "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                   "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                   "  <SCRIPT>\n"
+                   "  test_watch_count = 0\n"
+                   "  </SCRIPT>\n"
+                   "  <NODE name=\"test\">\n"
+                   "    <NODE name=\"batch\" help=\"Set nodes below here to test batched dispatch\">\n"
+                   "      <NODE name=\"*\" mode=\"rw\" help=\"Any node\">\n"
+                   "        <WATCH>test_watch_count = test_watch_count + 1</WATCH>\n"
+                   "      </NODE>\n"
+                   "    </NODE>\n"
+                   "  </NODE>\n"
+                   "</MODULE>\n");
+        fclose (data);
+    }
 
-            /* Reset Lua variables */
-            lua_pushnil(alfred_inst->ls);
-            lua_setglobal(alfred_inst->ls, "test_value");
-            lua_pushinteger (alfred_inst->ls, (lua_Integer)0);
-            lua_setglobal(alfred_inst->ls, "count");
+    alfred_init ("./");
+    g_assert (alfred_inst != NULL);
+    if (!alfred_inst)
+        goto exit;
+    events = alfred_inst->process_events;
+    wakeups = alfred_inst->process_wakeups;
 
-            apteryx_set (tests[i].node, NULL);
-            free (test_str);
-            sleep(1);
-        }
+    /* A burst of sets sent while the loop is busy is drained in batches
+     * rather than one per wakeup.
+     */
+    g_idle_add (test_block_loop, NULL);
+    while (!g_atomic_int_get (&test_loop_blocked))
+        usleep (1000);
+    for (int i = 0; i < 200; i++)
+    {
+        sprintf (path, "/test/batch/node%d", i);
+        apteryx_set (path, "1");
     }
-
-    /* Clean up */
-    if (alfred_inst)
+    sleep (1);
+    g_assert (test_global_int ("test_watch_count") == 200);
+    events = alfred_inst->process_events - events;
+    wakeups = alfred_inst->process_wakeups - wakeups;
+    g_assert (events >= 200);
+    g_assert (wakeups > 0);
+    g_assert (events - wakeups > 0);
+
+    for (int i = 0; i < 200; i++)
     {
-        alfred_shutdown ();
+        sprintf (path, "/test/batch/node%d", i);
+        apteryx_set (path, NULL);
     }
-    unlink ("alfred_test.lua");
+    sleep (1);
+    alfred_shutdown ();
+
+  exit:
     unlink ("alfred_test.xml");
 }
 
 static gboolean
 process_apteryx (GIOChannel *source, GIOCondition condition, gpointer data)
 {
+    uint8_t pending[ALFRED_PROCESS_BATCH];
+    ssize_t count;
+
     assert (alfred_inst);
-    luaL_loadstring (alfred_inst->ls, "apteryx.process()");
-    int res = lua_pcall (alfred_inst->ls, 0, 0, 0);
-    if (res != 0)
-        alfred_error (alfred_inst->ls, res);
-    uint8_t dummy = 0;
-    if (read (alfred_apteryx_fd, &dummy, 1) == 0)
+
+    /* Each queued callback writes one byte. Run everything that is pending,
+     * up to a batch, and leave the rest for the next main loop iteration so
+     * timers and idle work still get a turn.
+     */
+    count = read (alfred_apteryx_fd, pending, sizeof (pending));
+    if (count <= 0)
     {
-        ERROR ("Poll/Read error: %s\n", strerror (errno));
+        if (count == 0 || (errno != EAGAIN && errno != EINTR))
+            ERROR ("Poll/Read error: %s\n", strerror (errno));
+        return true;
     }
+    for (ssize_t i = 0; i < count; i++)
+        apteryx_process (false);
+    alfred_inst->process_wakeups++;
+    alfred_inst->process_events += count;
     return true;
 }
 
@@ -1805,14 +7934,222 @@ termination_handler (gpointer arg1)
     return false;
 }
 
+/* Supervisor mode. Each shard of the schema files runs in its own worker
+ * process with its own Lua state and Apteryx registrations. Workers that
+ * exit are restarted, backing off while they keep failing.
+ */
+#define ALFRED_WORKER_BACKOFF_MIN_MS    500
+#define ALFRED_WORKER_BACKOFF_MAX_MS    30000
+#define ALFRED_WORKER_STABLE_US         (60 * 1000000ULL)
+
+typedef struct alfred_worker_t
+{
+    int index;
+    char *shard;
+    GPid pid;
+    uint64_t started;
+    guint backoff_ms;
+    guint timer;
+    uint64_t restarts;
+} alfred_worker_t;
+
+static GList *alfred_workers = NULL;
+static GPtrArray *alfred_worker_args = NULL;
+static const char *alfred_worker_cache = NULL;
+static const char *alfred_worker_trace = NULL;
+static bool alfred_supervisor_stopping = false;
+
+static bool alfred_worker_spawn (alfred_worker_t *worker);
+
+static void
+alfred_worker_setup (gpointer data)
+{
+    /* Do not outlive the supervisor */
+    prctl (PR_SET_PDEATHSIG, SIGTERM);
+}
+
+static gboolean
+alfred_worker_restart (gpointer data)
+{
+    alfred_worker_t *worker = (alfred_worker_t *) data;
+
+    worker->timer = 0;
+    worker->restarts++;
+    if (!alfred_worker_spawn (worker))
+    {
+        worker->timer = g_timeout_add (worker->backoff_ms, alfred_worker_restart, worker);
+    }
+    return false;
+}
+
+static void
+alfred_worker_exited (GPid pid, gint status, gpointer data)
+{
+    alfred_worker_t *worker = (alfred_worker_t *) data;
+
+    g_spawn_close_pid (pid);
+    worker->pid = 0;
+    if (alfred_supervisor_stopping)
+        return;
+
+    /* Start again quickly if it had been running for a while */
+    if (get_time_us () - worker->started > ALFRED_WORKER_STABLE_US)
+        worker->backoff_ms = ALFRED_WORKER_BACKOFF_MIN_MS;
+    else
+        worker->backoff_ms = MIN (worker->backoff_ms * 2, ALFRED_WORKER_BACKOFF_MAX_MS);
+    ERROR ("ALFRED: Worker %s (pid %d) exited with status %d, restarting in %ums\n",
+           worker->shard, pid, status, worker->backoff_ms);
+    worker->timer = g_timeout_add (worker->backoff_ms, alfred_worker_restart, worker);
+}
+
+static bool
+alfred_worker_spawn (alfred_worker_t *worker)
+{
+    GPtrArray *argv = g_ptr_array_new_with_free_func (g_free);
+    GError *error = NULL;
+    bool ret;
+
+    for (guint i = 0; i < alfred_worker_args->len; i++)
+        g_ptr_array_add (argv, g_strdup (g_ptr_array_index (alfred_worker_args, i)));
+    if (alfred_worker_cache)
+    {
+        g_ptr_array_add (argv, g_strdup ("-C"));
+        g_ptr_array_add (argv, g_strdup_printf ("%s.%d", alfred_worker_cache, worker->index));
+    }
+    if (alfred_worker_trace)
+    {
+        g_ptr_array_add (argv, g_strdup ("-t"));
+        g_ptr_array_add (argv, g_strdup_printf ("%s.%d", alfred_worker_trace, worker->index));
+    }
+    g_ptr_array_add (argv, g_strdup ("-M"));
+    g_ptr_array_add (argv, g_strdup (worker->shard));
+    g_ptr_array_add (argv, NULL);
+
+    worker->started = get_time_us ();
+    ret = g_spawn_async (NULL, (char **) argv->pdata, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                         alfred_worker_setup, NULL, &worker->pid, &error);
+    if (ret)
+    {
+        DEBUG ("ALFRED: Worker %s started (pid %d)\n", worker->shard, worker->pid);
+        g_child_watch_add (worker->pid, alfred_worker_exited, worker);
+    }
+    else
+    {
+        ERROR ("ALFRED: Failed to start worker %s: %s\n", worker->shard, error->message);
+        g_error_free (error);
+        worker->backoff_ms = MIN (worker->backoff_ms * 2, ALFRED_WORKER_BACKOFF_MAX_MS);
+    }
+    g_ptr_array_free (argv, true);
+    return ret;
+}
+
+static void
+alfred_worker_add (const char *shard)
+{
+    alfred_worker_t *worker = g_malloc0 (sizeof (alfred_worker_t));
+
+    worker->index = g_list_length (alfred_workers);
+    worker->shard = g_strdup (shard);
+    worker->backoff_ms = ALFRED_WORKER_BACKOFF_MIN_MS;
+    alfred_workers = g_list_append (alfred_workers, worker);
+}
+
+/* Work out the shards and start a worker for each */
+static bool
+alfred_supervisor_start (const char *path, GPtrArray *args)
+{
+    alfred_worker_args = args;
+    if (alfred_shards > 0)
+    {
+        for (int i = 0; i < alfred_shards; i++)
+        {
+            char *shard = g_strdup_printf ("%d/%d", i, alfred_shards);
+            alfred_worker_add (shard);
+            g_free (shard);
+        }
+    }
+    else
+    {
+        GList *modules = NULL;
+
+        if (!find_modules (path, &modules))
+            return false;
+        for (GList *iter = modules; iter; iter = g_list_next (iter))
+        {
+            alfred_module_t *module = (alfred_module_t *) iter->data;
+            if (!module->library)
+                alfred_worker_add (module->filename);
+        }
+        g_list_free_full (modules, (GDestroyNotify) module_free);
+    }
+    if (!alfred_workers)
+    {
+        ERROR ("ALFRED: No schema files to run in %s\n", path);
+        return false;
+    }
+    for (GList *iter = alfred_workers; iter; iter = g_list_next (iter))
+    {
+        alfred_worker_t *worker = (alfred_worker_t *) iter->data;
+        if (!alfred_worker_spawn (worker))
+            worker->timer = g_timeout_add (worker->backoff_ms, alfred_worker_restart, worker);
+    }
+    return true;
+}
+
+/* Stop the workers and wait for them to exit */
+static void
+alfred_supervisor_stop (void)
+{
+    alfred_supervisor_stopping = true;
+    for (GList *iter = alfred_workers; iter; iter = g_list_next (iter))
+    {
+        alfred_worker_t *worker = (alfred_worker_t *) iter->data;
+
+        if (worker->timer)
+            g_source_remove (worker->timer);
+        if (worker->pid)
+            kill (worker->pid, SIGTERM);
+    }
+    for (GList *iter = alfred_workers; iter; iter = g_list_next (iter))
+    {
+        alfred_worker_t *worker = (alfred_worker_t *) iter->data;
+
+        if (worker->pid)
+        {
+            waitpid (worker->pid, NULL, 0);
+            g_spawn_close_pid (worker->pid);
+        }
+        g_free (worker->shard);
+        g_free (worker);
+    }
+    g_list_free (alfred_workers);
+    alfred_workers = NULL;
+    if (alfred_worker_args)
+        g_ptr_array_free (alfred_worker_args, true);
+    alfred_worker_args = NULL;
+}
+
 void
 help (char *app_name)
 {
-    printf ("Usage: %s [-h] [-b] [-d] [-p <pidfile>] [-c <configdir>] [-u <filter>]\n"
+    printf ("Usage: %s [-h] [-b] [-d] [-a] [-l] [-g <gcparams>] [-G] [-v] [-C <cachefile>] [-r] [-t <tracefile>] [-R <tracefile> [-x]] [-W <weights>] [-S <shards>] [-E <helpers>] [-p <pidfile>] [-c <configdir>] [-u <filter>]\n"
             "  -h   show this help\n"
             "  -b   background mode\n"
             "  -d   enable verbose debug\n"
             "  -m   memory profiling\n"
+            "  -a   use the pooled Lua allocator\n"
+            "  -l   load modules when first used (needs -C)\n"
+            "  -g   collect Lua garbage when idle (<pause>[:<stepmul>[:<stepkb>]])\n"
+            "  -G   cache apteryx.get/search results within each callback\n"
+            "  -v   validate sets against the pattern and VALUE list of each leaf\n"
+            "  -C   cache parsed schema files in <cachefile>\n"
+            "  -r   reload schema files when they change\n"
+            "  -t   capture incoming events to <tracefile>\n"
+            "  -R   replay events from <tracefile>, report throughput and latency, then exit\n"
+            "  -x   replay as fast as possible rather than at the captured rate\n"
+            "  -W   queue watches and delayed work behind gets (<watch>:<delayed> weights)\n"
+            "  -S   run the schema files in <shards> worker processes (0 for one per file)\n"
+            "  -E   number of helper processes for Alfred.exec (defaults to 2)\n"
             "  -p   use <pidfile> (defaults to "APTERYX_ALFRED_PID")\n"
             "  -c   use <configdir> (defaults to "APTERYX_CONFIG_DIR")\n"
             ,app_name);
@@ -1828,9 +8165,14 @@ main (int argc, char *argv[])
     FILE *fp = NULL;
     GMainLoop *loop = NULL;
     bool unit_test = false;
+    const char *trace_file = NULL;
+    const char *replay_file = NULL;
+    bool replay_max_speed = false;
+    bool supervise = false;
+    GPtrArray *worker_args = NULL;
 
     /* Parse options */
-    while ((i = getopt (argc, argv, "hdbp:c:mu::")) != -1)
+    while ((i = getopt (argc, argv, "hdbalg:GvC:rt:R:xW:S:M:E:p:c:mu::")) != -1)
     {
         switch (i)
         {
@@ -1841,6 +8183,65 @@ main (int argc, char *argv[])
         case 'b':
             background = true;
             break;
+        case 'a':
+            alfred_lua_pool = true;
+            break;
+        case 'l':
+            alfred_lazy = true;
+            break;
+        case 'g':
+            alfred_idle_gc = true;
+            if (sscanf (optarg, "%d:%d:%d", &alfred_gc_pause, &alfred_gc_stepmul,
+                        &alfred_gc_step_kb) < 1)
+            {
+                help (argv[0]);
+                return 0;
+            }
+            break;
+        case 'G':
+            alfred_memo = true;
+            break;
+        case 'v':
+            alfred_native_validate = true;
+            break;
+        case 'C':
+            alfred_cache_file = optarg;
+            break;
+        case 'r':
+            alfred_reload = true;
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'R':
+            replay_file = optarg;
+            break;
+        case 'x':
+            replay_max_speed = true;
+            break;
+        case 'W':
+            alfred_lanes = true;
+            if (sscanf (optarg, "%d:%d", &alfred_lane_weight[ALFRED_LANE_WATCH],
+                        &alfred_lane_weight[ALFRED_LANE_DELAYED]) != 2)
+            {
+                help (argv[0]);
+                return 0;
+            }
+            for (int i = 0; i < ALFRED_LANES; i++)
+            {
+                if (alfred_lane_weight[i] < 1)
+                    alfred_lane_weight[i] = 1;
+            }
+            break;
+        case 'S':
+            alfred_shards = atoi (optarg);
+            break;
+        case 'M':
+            alfred_shard = optarg;
+            break;
+        case 'E':
+            alfred_exec_helpers = atoi (optarg);
+            break;
         case 'p':
             pid_file = optarg;
             break;
@@ -1858,6 +8259,61 @@ main (int argc, char *argv[])
         }
     }
 
+    /* Finding what a deferred module defines means running its scripts,
+     * which only pays off if the result is kept in the schema cache.
+     */
+    if (alfred_lazy && !alfred_cache_file)
+    {
+        help (argv[0]);
+        return 0;
+    }
+
+    /* Replay runs in the foreground and exits, without side effects */
+    if (replay_file)
+    {
+        background = false;
+        alfred_offline = true;
+    }
+
+    /* Workers get the same options, less the ones that belong to the supervisor */
+    supervise = alfred_shards >= 0 && !unit_test && !replay_file;
+    if (supervise)
+    {
+        worker_args = g_ptr_array_new_with_free_func (g_free);
+        g_ptr_array_add (worker_args, g_strdup ("/proc/self/exe"));
+        if (apteryx_debug)
+            g_ptr_array_add (worker_args, g_strdup ("-d"));
+        if (alfred_lua_pool)
+            g_ptr_array_add (worker_args, g_strdup ("-a"));
+        if (alfred_lazy)
+            g_ptr_array_add (worker_args, g_strdup ("-l"));
+        if (alfred_idle_gc)
+        {
+            g_ptr_array_add (worker_args, g_strdup ("-g"));
+            g_ptr_array_add (worker_args, g_strdup_printf ("%d:%d:%d", alfred_gc_pause,
+                                                           alfred_gc_stepmul, alfred_gc_step_kb));
+        }
+        if (alfred_memo)
+            g_ptr_array_add (worker_args, g_strdup ("-G"));
+        if (alfred_native_validate)
+            g_ptr_array_add (worker_args, g_strdup ("-v"));
+        if (alfred_reload)
+            g_ptr_array_add (worker_args, g_strdup ("-r"));
+        g_ptr_array_add (worker_args, g_strdup ("-E"));
+        g_ptr_array_add (worker_args, g_strdup_printf ("%d", alfred_exec_helpers));
+        if (alfred_lanes)
+        {
+            g_ptr_array_add (worker_args, g_strdup ("-W"));
+            g_ptr_array_add (worker_args, g_strdup_printf ("%d:%d",
+                                                           alfred_lane_weight[ALFRED_LANE_WATCH],
+                                                           alfred_lane_weight[ALFRED_LANE_DELAYED]));
+        }
+        g_ptr_array_add (worker_args, g_strdup ("-c"));
+        g_ptr_array_add (worker_args, g_strdup (config_dir));
+        alfred_worker_cache = alfred_cache_file;
+        alfred_worker_trace = trace_file;
+    }
+
     /* Daemonize */
     if (!unit_test && background && fork () != 0)
     {
@@ -1865,13 +8321,29 @@ main (int argc, char *argv[])
         return 0;
     }
 
-    /* Initialise Apteryx client library in single threaded mode */
-    apteryx_init (apteryx_debug);
-    alfred_apteryx_fd = apteryx_process (true);
-    g_io_add_watch (g_io_channel_unix_new (alfred_apteryx_fd),
-                    G_IO_IN, process_apteryx, NULL);
-
-    cb_init ();
+    if (supervise)
+    {
+        /* The supervisor itself does not talk to Apteryx */
+        if (!alfred_supervisor_start (config_dir, worker_args))
+            goto exit;
+    }
+    else
+    {
+        /* Fork the exec helpers while we are small */
+        if (!alfred_offline)
+            alfred_exec_start ();
+
+        /* Initialise Apteryx client library in single threaded mode */
+        apteryx_init (apteryx_debug);
+        alfred_apteryx_fd = apteryx_process (true);
+        fcntl (alfred_apteryx_fd, F_SETFL, fcntl (alfred_apteryx_fd, F_GETFL) | O_NONBLOCK);
+        /* With priority lanes, requests are always taken ahead of queued work */
+        g_io_add_watch_full (g_io_channel_unix_new (alfred_apteryx_fd),
+                             alfred_lanes ? G_PRIORITY_HIGH : G_PRIORITY_DEFAULT,
+                             G_IO_IN, process_apteryx, NULL, NULL);
+
+        cb_init ();
+    }
 
     if (unit_test)
     {
@@ -1893,6 +8365,31 @@ main (int argc, char *argv[])
         g_test_add_func ("/test_native_index", test_native_index);
         g_test_add_func ("/test_rate_limit", test_rate_limit);
         g_test_add_func ("/test_after_quiet", test_after_quiet);
+        g_test_add_func ("/test_pool_alloc", test_pool_alloc);
+        g_test_add_func ("/test_idle_gc", test_idle_gc);
+        g_test_add_func ("/test_schema_cache", test_schema_cache);
+        g_test_add_func ("/test_parallel_load", test_parallel_load);
+        g_test_add_func ("/test_hot_reload", test_hot_reload);
+        g_test_add_func ("/test_lazy_load", test_lazy_load);
+        g_test_add_func ("/test_trace_replay", test_trace_replay);
+        g_test_add_func ("/test_memo_get", test_memo_get);
+        g_test_add_func ("/test_index_depends", test_index_depends);
+        g_test_add_func ("/test_index_scaling", test_index_scaling);
+        g_test_add_func ("/test_path_keys", test_path_keys);
+        g_test_add_func ("/test_watch_coalesce", test_watch_coalesce);
+        g_test_add_func ("/test_watch_tree", test_watch_tree);
+        g_test_add_func ("/test_process_batch", test_process_batch);
+        g_test_add_func ("/test_priority_lanes", test_priority_lanes);
+        g_test_add_func ("/test_shard_filter", test_shard_filter);
+        g_test_add_func ("/test_bytecode_library", test_bytecode_library);
+        g_test_add_func ("/test_lazy_api", test_lazy_api);
+        g_test_add_func ("/test_exec_helper", test_exec_helper);
+        g_test_add_func ("/test_refresh_adaptive", test_refresh_adaptive);
+        g_test_add_func ("/test_provide_prefetch", test_provide_prefetch);
+        g_test_add_func ("/test_validate_native", test_validate_native);
+#ifdef HAVE_LUAJIT
+        g_test_add_func ("/test_luajit_ffi", test_luajit_ffi);
+#endif
 
         loop = g_main_loop_new (NULL, true);
         g_unix_signal_add (SIGINT, termination_handler, loop);
@@ -1904,12 +8401,21 @@ main (int argc, char *argv[])
         pthread_attr_destroy(&attr);
         goto exit;
     }
-    else
+    else if (!supervise)
     {
         /* Create the alfred glists */
         alfred_init (config_dir);
         if (!alfred_inst)
             goto exit;
+
+        /* Benchmark the schemas against a captured trace */
+        if (replay_file)
+        {
+            alfred_replay (replay_file, replay_max_speed);
+            goto exit;
+        }
+        if (trace_file && !alfred_trace_start (trace_file))
+            goto exit;
     }
 
     /* Create pid file */
@@ -1945,9 +8451,18 @@ main (int argc, char *argv[])
     /* Clean alfreds */
     if (alfred_inst)
         alfred_shutdown ();
+    alfred_trace_stop ();
 
-    /* Cleanup client library */
-    apteryx_shutdown ();
+    /* Stop the workers, or cleanup client library */
+    if (supervise)
+    {
+        alfred_supervisor_stop ();
+    }
+    else
+    {
+        apteryx_shutdown ();
+        alfred_exec_stop ();
+    }
 
     /* Remove the pid file */
     if (background)
@@ -0,0 +1,439 @@
+/**
+ * @file alfred_bench.c
+ * End-to-end throughput benchmark for alfred.
+ *
+ * Generates a schema with a configurable number of watches, provides and
+ * indexes, starts alfred against it and drives sets/gets/searches through
+ * a running apteryxd at increasing rates.
+ *
+ * Copyright 2026, Allied Telesis Labs New Zealand, Ltd
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library. If not, see <http://www.gnu.org/licenses/>
+ */
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <apteryx.h>
+#include "common.h"
+
+/* Debug */
+bool apteryx_debug = false;
+
+/* Number of keys used to fill in wildcards */
+#define BENCH_KEYS      16
+
+/* Give up if alfred has not started in this time */
+#define BENCH_START_US  (10 * 1000000)
+
+/* A step has saturated alfred when it gets this far behind */
+#define BENCH_SATURATED 90
+
+typedef enum
+{
+    BENCH_WATCH,
+    BENCH_PROVIDE,
+    BENCH_INDEX,
+    BENCH_TYPES,
+} bench_type;
+
+static const char *bench_names[] = { "watch", "provide", "index" };
+static const char *bench_tags[] = { "WATCH", "PROVIDE", "INDEX" };
+
+/* Benchmark parameters */
+static int bench_count = 100;
+static int bench_depth = 2;
+static int bench_wild = 25;
+static int bench_start_rate = 100;
+static int bench_max_rate = 100000;
+static int bench_seconds = 2;
+static int bench_index_size = 2;
+
+/* Leaf paths to drive, for each type ('*' is replaced with a key) */
+static GPtrArray *bench_paths[BENCH_TYPES];
+
+static bool
+bench_is_wild (int i)
+{
+    return (i * 100 / bench_count) < bench_wild;
+}
+
+static void
+bench_schema_type (GString *xml, bench_type type)
+{
+    GString *path = g_string_new (NULL);
+
+    g_string_append_printf (xml, "    <NODE name=\"%s\">\n", bench_names[type]);
+    g_string_append_printf (path, "/bench/%s", bench_names[type]);
+    for (int d = 0; d < bench_depth; d++)
+    {
+        g_string_append_printf (xml, "      <NODE name=\"l%d\">\n", d);
+        g_string_append_printf (path, "/l%d", d);
+    }
+
+    /* Plain nodes, then the wildcard list */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bool wild = (pass == 1);
+
+        if (wild)
+            g_string_append (xml, "        <NODE name=\"wild\"><NODE name=\"*\">\n");
+        for (int i = 0; i < bench_count; i++)
+        {
+            if (bench_is_wild (i) != wild)
+                continue;
+            g_string_append_printf (xml, "        <NODE name=\"n%d\" mode=\"%s\" help=\"Benchmark node\">\n",
+                                    i, type == BENCH_WATCH ? "rw" : "r");
+            switch (type)
+            {
+            case BENCH_WATCH:
+                g_string_append (xml, "          <WATCH>bench_watches = bench_watches + 1</WATCH>\n");
+                break;
+            case BENCH_PROVIDE:
+                g_string_append (xml, "          <PROVIDE>return _path</PROVIDE>\n");
+                break;
+            case BENCH_INDEX:
+                g_string_append_printf (xml, "          <INDEX>local t = {} for i = 1, %d do t[i] = _path..i end return t</INDEX>\n",
+                                        bench_index_size);
+                g_string_append (xml, "          <NODE name=\"*\" mode=\"r\" help=\"Benchmark entry\"/>\n");
+                break;
+            default:
+                break;
+            }
+            g_string_append (xml, "        </NODE>\n");
+
+            g_ptr_array_add (bench_paths[type],
+                             g_strdup_printf ("%s%s/n%d%s", path->str, wild ? "/wild/*" : "",
+                                              i, type == BENCH_INDEX ? "/" : ""));
+        }
+        if (wild)
+            g_string_append (xml, "        </NODE></NODE>\n");
+    }
+
+    for (int d = 0; d < bench_depth; d++)
+        g_string_append (xml, "      </NODE>\n");
+    g_string_append (xml, "    </NODE>\n");
+    g_string_free (path, true);
+}
+
+/* Write the synthetic schema into the benchmark directory */
+static bool
+bench_schema (const char *dir)
+{
+    GString *xml = g_string_new (NULL);
+    char *filename;
+    bool res;
+
+    g_string_append (xml, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                     "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                     "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                     "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                     "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                     "  <SCRIPT>\n"
+                     "  bench_watches = 0\n"
+                     "  </SCRIPT>\n"
+                     "  <NODE name=\"bench\">\n"
+                     "    <NODE name=\"watches\" mode=\"r\" help=\"Watch callbacks run\">\n"
+                     "      <PROVIDE>return tostring(bench_watches)</PROVIDE>\n"
+                     "    </NODE>\n");
+    for (int type = 0; type < BENCH_TYPES; type++)
+        bench_schema_type (xml, type);
+    g_string_append (xml, "  </NODE>\n</MODULE>\n");
+
+    filename = g_strdup_printf ("%s/bench.xml", dir);
+    res = g_file_set_contents (filename, xml->str, xml->len, NULL);
+    if (!res)
+        fprintf (stderr, "Failed to write %s\n", filename);
+    g_free (filename);
+    g_string_free (xml, true);
+    return res;
+}
+
+static uint64_t
+bench_watches (void)
+{
+    char *value = apteryx_get ("/bench/watches");
+    uint64_t count = value ? strtoull (value, NULL, 10) : 0;
+    free (value);
+    return count;
+}
+
+/* Start alfred and wait until it is serving the schema */
+static pid_t
+bench_alfred_start (const char *alfred, const char *dir, const char *args)
+{
+    char *cmd = g_strdup_printf ("exec %s -c %s %s", alfred, dir, args ? args : "");
+    uint64_t start = get_time_us ();
+    char *value = NULL;
+    pid_t pid;
+
+    pid = fork ();
+    if (pid == 0)
+    {
+        execl ("/bin/sh", "sh", "-c", cmd, NULL);
+        _exit (1);
+    }
+    g_free (cmd);
+    if (pid < 0)
+        return -1;
+
+    while (!(value = apteryx_get ("/bench/watches")))
+    {
+        if (waitpid (pid, NULL, WNOHANG) == pid || get_time_us () - start > BENCH_START_US)
+        {
+            fprintf (stderr, "Alfred failed to start\n");
+            kill (pid, SIGTERM);
+            return -1;
+        }
+        g_usleep (10000);
+    }
+    free (value);
+    printf ("Alfred started in %.3fs\n", (get_time_us () - start) / 1000000.0);
+    return pid;
+}
+
+/* User plus system CPU time of a process in microseconds */
+static uint64_t
+bench_cpu_us (pid_t pid)
+{
+    char *filename = g_strdup_printf ("/proc/%d/stat", pid);
+    unsigned long utime = 0, stime = 0;
+    gchar *stat = NULL;
+    char *ptr;
+
+    if (g_file_get_contents (filename, &stat, NULL, NULL) &&
+        (ptr = strrchr (stat, ')')) != NULL)
+    {
+        /* Skip state and fields 4 to 13 to get to utime and stime */
+        sscanf (ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime);
+    }
+    g_free (stat);
+    g_free (filename);
+    return (uint64_t) (utime + stime) * 1000000 / sysconf (_SC_CLK_TCK);
+}
+
+static char *
+bench_fill_path (const char *path, int key)
+{
+    char **parts = g_strsplit (path, "*", -1);
+    char *k = g_strdup_printf ("k%d", key % BENCH_KEYS);
+    char *filled = g_strjoinv (k, parts);
+    g_strfreev (parts);
+    g_free (k);
+    return filled;
+}
+
+static int
+latency_cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Run one step at a fixed rate, returns false once alfred can't keep up */
+static bool
+bench_step (pid_t pid, int rate)
+{
+    GArray *latencies = g_array_new (false, false, sizeof (uint64_t));
+    uint64_t ops = (uint64_t) rate * bench_seconds;
+    uint64_t watches, cpu, start, elapsed, events;
+    uint64_t *us;
+    double achieved;
+
+    watches = bench_watches ();
+    cpu = bench_cpu_us (pid);
+    start = get_time_us ();
+    for (uint64_t op = 0; op < ops; op++)
+    {
+        bench_type type = op % BENCH_TYPES;
+        GPtrArray *paths = bench_paths[type];
+        char *path = bench_fill_path (g_ptr_array_index (paths, (op / BENCH_TYPES) % paths->len), op);
+        uint64_t due = start + op * 1000000 / rate;
+        uint64_t t0 = get_time_us ();
+        uint64_t latency;
+
+        if (due > t0)
+        {
+            g_usleep (due - t0);
+            t0 = get_time_us ();
+        }
+        switch (type)
+        {
+        case BENCH_WATCH:
+        {
+            char *value = g_strdup_printf ("%"PRIu64, op);
+            apteryx_set (path, value);
+            g_free (value);
+            break;
+        }
+        case BENCH_PROVIDE:
+            free (apteryx_get (path));
+            break;
+        case BENCH_INDEX:
+            g_list_free_full (apteryx_search (path), free);
+            break;
+        default:
+            break;
+        }
+        latency = get_time_us () - t0;
+        g_array_append_val (latencies, latency);
+        g_free (path);
+    }
+    elapsed = get_time_us () - start;
+
+    /* Count the watch callbacks alfred actually ran, not just the sets */
+    g_usleep (100000);
+    watches = bench_watches () - watches;
+    events = watches + (ops - (ops + BENCH_TYPES - 1) / BENCH_TYPES);
+    cpu = bench_cpu_us (pid) - cpu;
+
+    us = (uint64_t *) latencies->data;
+    qsort (us, latencies->len, sizeof (uint64_t), latency_cmp);
+    achieved = elapsed ? events * 1000000.0 / elapsed : 0;
+    printf ("%10d %12.0f %10"PRIu64" %10.1f %10"PRIu64" %10"PRIu64"\n",
+            rate, achieved, watches, events ? (double) cpu / events : 0,
+            us[latencies->len * 50 / 100], us[latencies->len * 99 / 100]);
+    g_array_free (latencies, true);
+
+    return achieved * 100 >= (double) rate * BENCH_SATURATED;
+}
+
+void
+help (char *app_name)
+{
+    printf ("Usage: %s [-h] [-d] [-A <alfred>] [-a <alfredargs>] [-n <count>] [-l <depth>] [-w <wild%%>]\n"
+            "                    [-i <indexsize>] [-s <startrate>] [-m <maxrate>] [-t <seconds>] [-k]\n"
+            "  -h   show this help\n"
+            "  -d   enable verbose debug\n"
+            "  -A   alfred binary (defaults to ./alfred)\n"
+            "  -a   extra arguments for alfred\n"
+            "  -n   number of each of watches, provides and indexes (defaults to 100)\n"
+            "  -l   depth of the schema tree (defaults to 2)\n"
+            "  -w   percentage of nodes below a wildcard (defaults to 25)\n"
+            "  -i   number of entries returned by each index (defaults to 2)\n"
+            "  -s   starting rate in events/s (defaults to 100)\n"
+            "  -m   maximum rate in events/s (defaults to 100000)\n"
+            "  -t   seconds at each rate (defaults to 2)\n"
+            "  -k   keep the generated schema directory\n"
+            , app_name);
+}
+
+int
+main (int argc, char *argv[])
+{
+    const char *alfred = "./alfred";
+    const char *alfred_args = NULL;
+    char dir[] = "/tmp/alfred-bench-XXXXXX";
+    bool keep = false;
+    pid_t pid = -1;
+    int i = 0;
+
+    /* Parse options */
+    while ((i = getopt (argc, argv, "hdA:a:n:l:w:i:s:m:t:k")) != -1)
+    {
+        switch (i)
+        {
+        case 'd':
+            apteryx_debug = true;
+            break;
+        case 'A':
+            alfred = optarg;
+            break;
+        case 'a':
+            alfred_args = optarg;
+            break;
+        case 'n':
+            bench_count = MAX (1, atoi (optarg));
+            break;
+        case 'l':
+            bench_depth = MAX (0, atoi (optarg));
+            break;
+        case 'w':
+            bench_wild = CLAMP (atoi (optarg), 0, 100);
+            break;
+        case 'i':
+            bench_index_size = MAX (0, atoi (optarg));
+            break;
+        case 's':
+            bench_start_rate = MAX (1, atoi (optarg));
+            break;
+        case 'm':
+            bench_max_rate = MAX (1, atoi (optarg));
+            break;
+        case 't':
+            bench_seconds = MAX (1, atoi (optarg));
+            break;
+        case 'k':
+            keep = true;
+            break;
+        case '?':
+        case 'h':
+        default:
+            help (argv[0]);
+            return 0;
+        }
+    }
+
+    apteryx_init (apteryx_debug);
+    for (int type = 0; type < BENCH_TYPES; type++)
+        bench_paths[type] = g_ptr_array_new_with_free_func (g_free);
+
+    if (!mkdtemp (dir))
+    {
+        fprintf (stderr, "Failed to create %s: %s\n", dir, strerror (errno));
+        goto exit;
+    }
+    if (!bench_schema (dir))
+        goto exit;
+    printf ("Schema: %d of each of %s, %s and %s, depth %d, %d%% wildcard, %d index entries (%s)\n",
+            bench_count, bench_tags[BENCH_WATCH], bench_tags[BENCH_PROVIDE],
+            bench_tags[BENCH_INDEX], bench_depth, bench_wild, bench_index_size, dir);
+
+    pid = bench_alfred_start (alfred, dir, alfred_args);
+    if (pid < 0)
+        goto exit;
+
+    printf ("%10s %12s %10s %10s %10s %10s\n",
+            "rate", "events/s", "watches", "cpu-us/ev", "p50-us", "p99-us");
+    for (int rate = bench_start_rate; rate <= bench_max_rate; rate *= 2)
+    {
+        if (!bench_step (pid, rate))
+        {
+            printf ("Saturated at %d events/s\n", rate);
+            break;
+        }
+    }
+
+  exit:
+    if (pid > 0)
+    {
+        kill (pid, SIGTERM);
+        waitpid (pid, NULL, 0);
+    }
+    if (!keep)
+    {
+        char *filename = g_strdup_printf ("%s/bench.xml", dir);
+        unlink (filename);
+        rmdir (dir);
+        g_free (filename);
+    }
+    for (int type = 0; type < BENCH_TYPES; type++)
+    {
+        if (bench_paths[type])
+            g_ptr_array_free (bench_paths[type], true);
+    }
+    apteryx_shutdown ();
+    return 0;
+}
@@ -17,9 +17,10 @@
  * along with this library. If not, see <http://www.gnu.org/licenses/>
  */
 #include <string.h>
-#include <libxml/xmlschemas.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <libxml/xmlreader.h>
 #include <apteryx.h>
-#include <apteryx-xml.h>
 #include <glib-unix.h>
 #include <syslog.h>
 
@@ -131,51 +132,143 @@ _path_to_node (GNode *root, const char *path, const char *value)
     return;
 }
 
+/* As sch_is_config, a NODE is config when its mode includes 'c' */
 static bool
-process_node (xmlNode *node, char *parent)
+schema_is_config (const xmlChar *mode)
 {
-    xmlChar *name = NULL;
-    char *path = NULL;
+    return mode && strchr ((const char *) mode, 'c') != NULL;
+}
+
+/* Stream through a schema file, tracking only the path of the open NODEs,
+ * and add each NODE marked as config to the tree of nodes to save.
+ */
+static bool
+load_schema_file (const char *filename)
+{
+    xmlTextReaderPtr reader;
+    GList *paths = NULL;
     bool res = true;
+    int ret;
 
-    /* Ignore fluff */
-    if (!node || node->type != XML_ELEMENT_NODE)
+    reader = xmlReaderForFile (filename, NULL, 0);
+    if (reader == NULL)
     {
-        return true;
+        ERROR ("Schema: Invalid file \"%s\"\n", filename);
+        return false;
     }
 
-    /* Process this node */
-    if (strcmp ((const char *) node->name, "NODE") == 0)
+    while ((ret = xmlTextReaderRead (reader)) == 1)
     {
-        /* Find node name and path */
-        name = xmlGetProp (node, (xmlChar *) "name");
-        if (parent)
+        int type = xmlTextReaderNodeType (reader);
+        const char *name = (const char *) xmlTextReaderConstName (reader);
+
+        if (strcmp (name, "NODE") != 0)
         {
-            path = g_strdup_printf ("%s/%s", parent, name);
+            continue;
         }
-        else
+        if (type == XML_READER_TYPE_ELEMENT)
         {
-            path = g_strdup_printf ("/%s", name);
+            xmlChar *node_name = xmlTextReaderGetAttribute (reader, (xmlChar *) "name");
+            xmlChar *mode = xmlTextReaderGetAttribute (reader, (xmlChar *) "mode");
+            char *path;
+
+            if (paths)
+            {
+                path = g_strdup_printf ("%s/%s", (char *) paths->data, node_name);
+            }
+            else
+            {
+                path = g_strdup_printf ("/%s", node_name);
+            }
+            if (schema_is_config (mode))
+            {
+                DEBUG ("Schema: %s\n", path);
+                _path_to_node (saver_nodes, path, NULL);
+            }
+            xmlFree (mode);
+            xmlFree (node_name);
+
+            if (xmlTextReaderIsEmptyElement (reader))
+            {
+                g_free (path);
+            }
+            else
+            {
+                paths = g_list_prepend (paths, path);
+            }
         }
-        if (sch_is_config (node))
+        else if (type == XML_READER_TYPE_END_ELEMENT && paths)
         {
-            DEBUG ("Schema: %s\n", path);
-            _path_to_node (saver_nodes, path, NULL);
+            g_free (paths->data);
+            paths = g_list_delete_link (paths, paths);
         }
     }
-    /* Process children */
-    for (xmlNode *n = node->children; n; n = n->next)
+    if (ret != 0)
+    {
+        ERROR ("Schema: Invalid file \"%s\"\n", filename);
+        res = false;
+    }
+
+    g_list_free_full (paths, g_free);
+    xmlFreeTextReader (reader);
+    return res;
+}
+
+/* Load all the schema files in a directory */
+static bool
+load_schema_dir (const char *path)
+{
+    struct dirent *entry;
+    DIR *dp;
+    bool res = true;
+
+    dp = opendir (path);
+    if (!dp)
+    {
+        ERROR ("Schema: Failed to open schema directory \"%s\"\n", path);
+        return false;
+    }
+    while ((entry = readdir (dp)) != NULL)
     {
-        if (!process_node (n, path))
+        char *filename;
+
+        if (!g_str_has_suffix (entry->d_name, ".xml") &&
+            !g_str_has_suffix (entry->d_name, ".xml.gz"))
+        {
+            continue;
+        }
+        filename = g_strdup_printf ("%s%s%s", path,
+                                    path[strlen (path) - 1] == '/' ? "" : "/",
+                                    entry->d_name);
+        if (!load_schema_file (filename))
         {
             res = false;
-            goto exit;
         }
+        g_free (filename);
     }
+    closedir (dp);
+    return res;
+}
 
-  exit:
-    g_free (path);
-    g_free (name);
+/* Load the schema files in a ':' separated list of directories, as sch_load */
+static bool
+load_schema_files (const char *path)
+{
+    char **dirs = g_strsplit (path, ":", 0);
+    bool res = true;
+
+    for (int i = 0; dirs[i]; i++)
+    {
+        if (dirs[i][0] == '\0')
+        {
+            continue;
+        }
+        if (!load_schema_dir (dirs[i]))
+        {
+            res = false;
+        }
+    }
+    g_strfreev (dirs);
     return res;
 }
 
@@ -400,8 +493,7 @@ test_xml_to_nodes_basic ()
     data = NULL;
 
     /* Trigger Action */
-    sch_instance *test_schemas = sch_load ("./");
-    process_node (test_schemas, NULL);
+    g_assert (load_schema_files ("./"));
 
     const char *nodes[2] = {"test", "set_node"};
     int i = 0;
@@ -424,7 +516,6 @@ test_xml_to_nodes_basic ()
     {
         free (test_str);
     }
-    sch_free (test_schemas);
     apteryx_free_tree (saver_nodes);
     saver_nodes = NULL;
 }
@@ -459,8 +550,7 @@ test_xml_to_nodes_no_mode ()
     data = NULL;
 
     /* Trigger Action */
-    sch_instance *test_schemas = sch_load ("./");
-    process_node (test_schemas, NULL);
+    g_assert (load_schema_files ("./"));
 
     const char *nodes[2] = {"test", "set_node2"};
     int i = 0;
@@ -483,7 +573,66 @@ test_xml_to_nodes_no_mode ()
     {
         free (test_str);
     }
-    sch_free (test_schemas);
+    apteryx_free_tree (saver_nodes);
+    saver_nodes = NULL;
+}
+
+/* Glib unit test */
+void
+test_xml_to_nodes_path_list ()
+{
+    const char *dirs[2] = {"saver_test_a", "saver_test_b"};
+    const char *names[2] = {"node_a", "node_b"};
+    char *filename;
+    FILE *data = NULL;
+    GNode *test;
+
+    saver_nodes = g_node_new (g_strdup("/"));
+    /* Create one schema file in each of two directories */
+    for (int i = 0; i < 2; i++)
+    {
+        mkdir (dirs[i], 0755);
+        filename = g_strdup_printf ("%s/saver_test.xml", dirs[i]);
+        data = fopen (filename, "w");
+        g_free (filename);
+        g_assert (data != NULL);
+
+        fprintf (data, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                       "<MODULE xmlns=\"https://github.com/alliedtelesis/apteryx\"\n"
+                       "  xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"\n"
+                       "  xsi:schemaLocation=\"https://github.com/alliedtelesis/apteryx\n"
+                       "  https://github.com/alliedtelesis/apteryx/releases/download/v2.10/apteryx.xsd\">\n"
+                       "  <NODE name=\"test\">\n"
+                       "    <NODE name=\"%s\" mode=\"rwc\"  help=\"Set this node for fun\"/>\n"
+                       "    <NODE name=\"%s_rw\" mode=\"rw\"  help=\"Set this node for fun\"/>\n"
+                       "  </NODE>\n"
+                       "</MODULE>\n", names[i], names[i]);
+        fclose (data);
+        data = NULL;
+    }
+
+    /* Trigger Action */
+    g_assert (load_schema_files ("saver_test_a:saver_test_b"));
+
+    /* Config nodes from both directories, and nothing else */
+    test = g_node_first_child (saver_nodes);
+    g_assert (test && strcmp ("test", (char *) test->data) == 0);
+    g_assert (g_node_n_children (test) == 2);
+    for (int i = 0; i < 2; i++)
+    {
+        GNode *node = g_node_nth_child (test, i);
+        g_assert (strcmp (names[0], (char *) node->data) == 0 ||
+                  strcmp (names[1], (char *) node->data) == 0);
+    }
+
+    /* Clean up */
+    for (int i = 0; i < 2; i++)
+    {
+        filename = g_strdup_printf ("%s/saver_test.xml", dirs[i]);
+        unlink (filename);
+        g_free (filename);
+        rmdir (dirs[i]);
+    }
     apteryx_free_tree (saver_nodes);
     saver_nodes = NULL;
 }
@@ -596,7 +745,7 @@ help (char *app_name)
             "  -b   background mode\n"
             "  -d   enable verbose debug\n"
             "  -p   use <pidfile> (defaults to " APTERYX_SAVE_PID ")\n"
-            "  -s   use <schemadir> to search for schemas (defaults to " APTERYX_SCHEMA_DIR ")\n"
+            "  -s   use <schemadir> (':' separated list) to search for schemas (defaults to " APTERYX_SCHEMA_DIR ")\n"
             "  -c   use <configdir> to search for config files (defaults to " APTERYX_CONFIG_DIR ")\n"
             "  -f   use <configfile> for saving configuration (defaults to " APTERYX_SAVE_CONFIG_FILE ")\n"
             "  -w   set write delay (defaults to 15 seconds)\n"
@@ -612,7 +761,6 @@ main (int argc, char *argv[])
     const char *pid_file = APTERYX_SAVE_PID;
     char *old_root_name = NULL;
     FILE *fp = NULL;
-    sch_instance *schemas = NULL;
     bool unit_test = false;
     bool background = false;
     bool load_startup_config = false;
@@ -693,6 +841,7 @@ main (int argc, char *argv[])
         g_test_init (&argc, &argv, NULL);
         g_test_add_func ("/test_xml_to_nodes_basic", test_xml_to_nodes_basic);
         g_test_add_func ("/test_xml_to_nodes_no_mode", test_xml_to_nodes_no_mode);
+        g_test_add_func ("/test_xml_to_nodes_path_list", test_xml_to_nodes_path_list);
         g_test_add_func ("/test_write_config", test_write_config);
         g_test_add_func ("/test_load_config", test_load_config);
 
@@ -721,8 +870,7 @@ main (int argc, char *argv[])
     }
 
     saver_nodes = g_node_new (g_strdup("/"));
-    schemas = sch_load (schema_dir);
-    process_node (schemas, NULL);
+    load_schema_files (schema_dir);
     parse_config_files (config_dir);
     if (load_startup_config)
     {
@@ -751,10 +899,6 @@ main (int argc, char *argv[])
     g_main_loop_run (g_loop);
 
   exit:
-    if (schemas)
-    {
-        sch_free (schemas);
-    }
     apteryx_free_tree (config_nodes);
     apteryx_free_tree (saver_nodes);
     /* Free the glib main loop */